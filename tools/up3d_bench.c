@@ -0,0 +1,812 @@
+/*
+ * up3d_bench - 用户空间采集基准测试
+ *
+ * 打开采集节点，设置格式、分辨率和帧率，用mmap、dmabuf(从/dev/dma_heap/system申请)
+ * 或read()方式采集，统计实际帧率、出队延迟分位数、时间戳抖动、丢帧数和CPU占用。
+ * -j输出一行JSON，便于回归测试记录。
+ *
+ * -o指定回环输出节点时，另一个线程同时向它写入帧，采集端不加-p即用阻塞的DQBUF/read()读取，
+ * 检查阻塞的读者不会挡住写者的QBUF；BENCH_STALL_S秒内没有新帧视为死锁，以退出码3结束。
+ *
+ * 出队延迟 = 出队时刻 - 缓冲区时间戳，驱动以tstamp_clock参数选择时间戳的时钟，
+ * -c要与之一致(默认monotonic)。驱动默认给出开始曝光(帧时钟截止)时间戳，延迟包含填充耗时。
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/videodev2.h>
+#include <linux/dma-heap.h>
+
+#define BENCH_MAX_BUFS		32
+#define DMA_HEAP_SYSTEM		"/dev/dma_heap/system"
+#define BENCH_STALL_S		5		// 回环模式下等待一帧的最长时间
+
+enum bench_io {
+	IO_MMAP = 0,
+	IO_DMABUF,
+	IO_READ,
+};
+
+static const char * const io_names[] = { "mmap", "dmabuf", "read" };
+
+struct bench_opts {
+	const char	*dev;
+	const char	*out_dev;		// 回环输出节点，NULL表示不写入
+	uint32_t	fourcc;
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	fps;
+	enum bench_io	io;
+	unsigned int	frames;
+	unsigned int	nbufs;
+	bool		use_poll;
+	bool		touch;			// 读一遍每帧的数据，模拟使用者的访问
+	bool		json;
+	clockid_t	clock;			// 与驱动的tstamp_clock一致
+};
+
+struct bench_buf {
+	void		*start[VIDEO_MAX_PLANES];
+	size_t		length[VIDEO_MAX_PLANES];
+	int			dmabuf_fd[VIDEO_MAX_PLANES];
+};
+
+struct bench_ctx {
+	struct bench_opts	opts;
+	int					fd;
+	bool				mplane;
+	enum v4l2_buf_type	type;
+	unsigned int		num_planes;
+	uint32_t			sizeimage[VIDEO_MAX_PLANES];
+	uint32_t			width;
+	uint32_t			height;
+	uint32_t			pixelformat;
+	struct v4l2_fract	tpf;
+	struct bench_buf	bufs[BENCH_MAX_BUFS];
+	unsigned int		nbufs;
+
+	/* 统计 */
+	double				*lat_us;		// 每帧的出队延迟
+	double				*ival_us;		// 相邻两帧时间戳的间隔
+	unsigned int		frames;
+	unsigned int		intervals;
+	uint64_t			bytes;
+	uint64_t			drops;
+	uint32_t			last_seq;
+	uint64_t			last_ts;
+	bool				seq_valid;
+	volatile uint64_t	touch_sum;
+
+	/* 回环写入线程 */
+	pthread_t			writer;
+	bool				writer_running;
+	volatile bool		writer_stop;
+	int					writer_ret;
+	unsigned int		written;
+};
+
+static uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int xioctl(int fd, unsigned long req, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, req, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DEV      capture node (default /dev/video0)\n"
+		"  -f FOURCC   pixel format, e.g. RGB3, YUYV, NV12, MJPG (default: keep current)\n"
+		"  -s WxH      frame size (default: keep current)\n"
+		"  -r FPS      frame rate (default: keep current)\n"
+		"  -m MODE     mmap, dmabuf or read (default mmap)\n"
+		"  -n FRAMES   frames to capture (default 300)\n"
+		"  -b BUFS     buffers to request, 2..%d (default 4)\n"
+		"  -p          wait with poll() instead of blocking DQBUF\n"
+		"  -t          read every byte of each frame\n"
+		"  -c CLOCK    timestamp clock: monotonic, boottime or realtime (default monotonic)\n"
+		"  -j          print one line of JSON\n"
+		"  -o DEV      feed this loopback output node from a writer thread while capturing\n",
+		prog, BENCH_MAX_BUFS);
+}
+
+static int parse_opts(struct bench_opts *o, int argc, char **argv)
+{
+	int c;
+
+	memset(o, 0, sizeof(*o));
+	o->dev = "/dev/video0";
+	o->frames = 300;
+	o->nbufs = 4;
+	o->clock = CLOCK_MONOTONIC;
+
+	while ((c = getopt(argc, argv, "d:f:s:r:m:n:b:ptjc:o:h")) != -1) {
+		switch (c) {
+		case 'd':
+			o->dev = optarg;
+			break;
+		case 'f':
+			if (strlen(optarg) != 4)
+				return -1;
+			o->fourcc = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+			break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &o->width, &o->height) != 2)
+				return -1;
+			break;
+		case 'r':
+			o->fps = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "mmap"))
+				o->io = IO_MMAP;
+			else if (!strcmp(optarg, "dmabuf"))
+				o->io = IO_DMABUF;
+			else if (!strcmp(optarg, "read"))
+				o->io = IO_READ;
+			else
+				return -1;
+			break;
+		case 'n':
+			o->frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			o->nbufs = strtoul(optarg, NULL, 0);
+			if (o->nbufs < 2 || o->nbufs > BENCH_MAX_BUFS)
+				return -1;
+			break;
+		case 'p':
+			o->use_poll = true;
+			break;
+		case 't':
+			o->touch = true;
+			break;
+		case 'j':
+			o->json = true;
+			break;
+		case 'o':
+			o->out_dev = optarg;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "monotonic"))
+				o->clock = CLOCK_MONOTONIC;
+			else if (!strcmp(optarg, "boottime"))
+				o->clock = CLOCK_BOOTTIME;
+			else if (!strcmp(optarg, "realtime"))
+				o->clock = CLOCK_REALTIME;
+			else
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return o->frames ? 0 : -1;
+}
+
+/* 设置格式和帧率，回读驱动实际使用的值 */
+static int bench_setup_format(struct bench_ctx *b)
+{
+	struct v4l2_capability cap;
+	struct v4l2_format fmt;
+	struct v4l2_streamparm parm;
+	unsigned int p;
+
+	if (xioctl(b->fd, VIDIOC_QUERYCAP, &cap) < 0) {
+		perror("VIDIOC_QUERYCAP");
+		return -1;
+	}
+
+	b->mplane = cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE;
+	b->type = b->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (!(cap.device_caps & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE))) {
+		fprintf(stderr, "%s is not a video capture node\n", b->opts.dev);
+		return -1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = b->type;
+	if (xioctl(b->fd, VIDIOC_G_FMT, &fmt) < 0) {
+		perror("VIDIOC_G_FMT");
+		return -1;
+	}
+
+	if (b->mplane) {
+		if (b->opts.fourcc)
+			fmt.fmt.pix_mp.pixelformat = b->opts.fourcc;
+		if (b->opts.width) {
+			fmt.fmt.pix_mp.width = b->opts.width;
+			fmt.fmt.pix_mp.height = b->opts.height;
+		}
+	} else {
+		if (b->opts.fourcc)
+			fmt.fmt.pix.pixelformat = b->opts.fourcc;
+		if (b->opts.width) {
+			fmt.fmt.pix.width = b->opts.width;
+			fmt.fmt.pix.height = b->opts.height;
+		}
+	}
+	if (xioctl(b->fd, VIDIOC_S_FMT, &fmt) < 0) {
+		perror("VIDIOC_S_FMT");
+		return -1;
+	}
+
+	if (b->mplane) {
+		b->width = fmt.fmt.pix_mp.width;
+		b->height = fmt.fmt.pix_mp.height;
+		b->pixelformat = fmt.fmt.pix_mp.pixelformat;
+		b->num_planes = fmt.fmt.pix_mp.num_planes;
+		for (p = 0; p < b->num_planes; p++)
+			b->sizeimage[p] = fmt.fmt.pix_mp.plane_fmt[p].sizeimage;
+	} else {
+		b->width = fmt.fmt.pix.width;
+		b->height = fmt.fmt.pix.height;
+		b->pixelformat = fmt.fmt.pix.pixelformat;
+		b->num_planes = 1;
+		b->sizeimage[0] = fmt.fmt.pix.sizeimage;
+	}
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = b->type;
+	if (b->opts.fps) {
+		parm.parm.capture.timeperframe.numerator = 1;
+		parm.parm.capture.timeperframe.denominator = b->opts.fps;
+		if (xioctl(b->fd, VIDIOC_S_PARM, &parm) < 0)
+			perror("VIDIOC_S_PARM");
+	}
+	if (xioctl(b->fd, VIDIOC_G_PARM, &parm) == 0)
+		b->tpf = parm.parm.capture.timeperframe;
+
+	return 0;
+}
+
+/* 从DMA heap为每个缓冲区平面申请一个dmabuf，映射出来用于-t读取数据 */
+static int bench_alloc_dmabuf(struct bench_ctx *b)
+{
+	struct dma_heap_allocation_data alloc;
+	unsigned int i, p;
+	int heap;
+
+	heap = open(DMA_HEAP_SYSTEM, O_RDWR | O_CLOEXEC);
+	if (heap < 0) {
+		perror(DMA_HEAP_SYSTEM);
+		return -1;
+	}
+
+	for (i = 0; i < b->nbufs; i++) {
+		for (p = 0; p < b->num_planes; p++) {
+			memset(&alloc, 0, sizeof(alloc));
+			alloc.len = b->sizeimage[p];
+			alloc.fd_flags = O_RDWR | O_CLOEXEC;
+			if (xioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0) {
+				perror("DMA_HEAP_IOCTL_ALLOC");
+				close(heap);
+				return -1;
+			}
+			b->bufs[i].dmabuf_fd[p] = alloc.fd;
+			b->bufs[i].length[p] = alloc.len;
+			b->bufs[i].start[p] = mmap(NULL, alloc.len, PROT_READ, MAP_SHARED, alloc.fd, 0);
+			if (b->bufs[i].start[p] == MAP_FAILED)
+				b->bufs[i].start[p] = NULL;
+		}
+	}
+
+	close(heap);
+	return 0;
+}
+
+static void bench_fill_v4l2_buf(struct bench_ctx *b, struct v4l2_buffer *buf,
+						struct v4l2_plane *planes, unsigned int index)
+{
+	enum v4l2_memory memory = b->opts.io == IO_DMABUF ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+	unsigned int p;
+
+	memset(buf, 0, sizeof(*buf));
+	memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+	buf->type = b->type;
+	buf->memory = memory;
+	buf->index = index;
+	if (b->mplane) {
+		buf->m.planes = planes;
+		buf->length = b->num_planes;
+		if (memory == V4L2_MEMORY_DMABUF) {
+			for (p = 0; p < b->num_planes; p++) {
+				planes[p].m.fd = b->bufs[index].dmabuf_fd[p];
+				planes[p].length = b->bufs[index].length[p];
+			}
+		}
+	} else if (memory == V4L2_MEMORY_DMABUF) {
+		buf->m.fd = b->bufs[index].dmabuf_fd[0];
+		buf->length = b->bufs[index].length[0];
+	}
+}
+
+/* 申请缓冲区，mmap方式映射每个平面，然后全部入队 */
+static int bench_setup_buffers(struct bench_ctx *b)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buf;
+	unsigned int i, p;
+	size_t len;
+	off_t off;
+
+	memset(&req, 0, sizeof(req));
+	req.count = b->opts.nbufs;
+	req.type = b->type;
+	req.memory = b->opts.io == IO_DMABUF ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+	if (xioctl(b->fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("VIDIOC_REQBUFS");
+		return -1;
+	}
+	b->nbufs = req.count < BENCH_MAX_BUFS ? req.count : BENCH_MAX_BUFS;
+
+	if (b->opts.io == IO_DMABUF && bench_alloc_dmabuf(b) < 0)
+		return -1;
+
+	for (i = 0; i < b->nbufs; i++) {
+		bench_fill_v4l2_buf(b, &buf, planes, i);
+
+		if (b->opts.io == IO_MMAP) {
+			if (xioctl(b->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+				perror("VIDIOC_QUERYBUF");
+				return -1;
+			}
+			for (p = 0; p < b->num_planes; p++) {
+				len = b->mplane ? planes[p].length : buf.length;
+				off = b->mplane ? planes[p].m.mem_offset : buf.m.offset;
+				b->bufs[i].length[p] = len;
+				b->bufs[i].start[p] = mmap(NULL, len, PROT_READ, MAP_SHARED, b->fd, off);
+				if (b->bufs[i].start[p] == MAP_FAILED) {
+					perror("mmap");
+					return -1;
+				}
+			}
+		}
+
+		if (xioctl(b->fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("VIDIOC_QBUF");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void bench_touch(struct bench_ctx *b, const void *data, size_t len)
+{
+	const uint64_t *p = data;
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*p); i++)
+		sum += p[i];
+	b->touch_sum += sum;
+}
+
+/* 记录一帧：出队延迟、时间戳间隔和序号间隔 */
+static void bench_account(struct bench_ctx *b, const struct v4l2_buffer *buf, uint64_t dq_ns)
+{
+	uint64_t ts = (uint64_t)buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL;
+
+	b->lat_us[b->frames] = dq_ns > ts ? (dq_ns - ts) / 1000.0 : 0;
+	if (b->frames > 0 && ts > b->last_ts)
+		b->ival_us[b->intervals++] = (ts - b->last_ts) / 1000.0;
+	if (b->seq_valid && buf->sequence != b->last_seq + 1)
+		b->drops += buf->sequence - b->last_seq - 1;
+
+	b->last_ts = ts;
+	b->last_seq = buf->sequence;
+	b->seq_valid = true;
+	b->frames++;
+}
+
+static void bench_stall(int sig)
+{
+	static const char msg[] = "no frame in time: capture reader and output writer are stalled\n";
+
+	(void)sig;
+	if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0)
+		_exit(3);
+	_exit(3);
+}
+
+/* 回环模式下每次等待一帧前重新计时，阻塞的读者与写者互相挡住时由SIGALRM结束 */
+static void bench_watchdog(struct bench_ctx *b)
+{
+	if (b->opts.out_dev)
+		alarm(BENCH_STALL_S);
+}
+
+/**
+ * 回环写入线程：以阻塞方式打开输出节点，格式与采集节点相同(实例级)，
+ * 每个缓冲区写入帧计数后入队，输出完成后出队再写下一帧，直到采集结束。
+ */
+static void *bench_writer_thread(void *arg)
+{
+	struct bench_ctx *b = arg;
+	enum v4l2_buf_type type = b->mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	struct bench_buf bufs[BENCH_MAX_BUFS];
+	unsigned int i, p, nbufs;
+	int fd;
+
+	b->writer_ret = -1;
+	memset(bufs, 0, sizeof(bufs));
+
+	fd = open(b->opts.out_dev, O_RDWR);
+	if (fd < 0) {
+		perror(b->opts.out_dev);
+		return NULL;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.count = b->opts.nbufs;
+	req.type = type;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("output VIDIOC_REQBUFS");
+		goto out;
+	}
+	nbufs = req.count < BENCH_MAX_BUFS ? req.count : BENCH_MAX_BUFS;
+
+	for (i = 0; i < nbufs; i++) {
+		memset(&buf, 0, sizeof(buf));
+		memset(planes, 0, sizeof(planes));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (b->mplane) {
+			buf.m.planes = planes;
+			buf.length = b->num_planes;
+		}
+		if (xioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			perror("output VIDIOC_QUERYBUF");
+			goto out;
+		}
+		for (p = 0; p < b->num_planes; p++) {
+			bufs[i].length[p] = b->mplane ? planes[p].length : buf.length;
+			bufs[i].start[p] = mmap(NULL, bufs[i].length[p], PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+						b->mplane ? planes[p].m.mem_offset : buf.m.offset);
+			if (bufs[i].start[p] == MAP_FAILED) {
+				bufs[i].start[p] = NULL;
+				perror("output mmap");
+				goto out;
+			}
+		}
+	}
+
+	for (i = 0; !b->writer_stop; i++) {
+		memset(&buf, 0, sizeof(buf));
+		memset(planes, 0, sizeof(planes));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (b->mplane) {
+			buf.m.planes = planes;
+			buf.length = b->num_planes;
+		}
+
+		// 先把所有缓冲区入队一遍，之后每输出一帧取回一个
+		if (i < nbufs) {
+			buf.index = i;
+		} else if (xioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("output VIDIOC_DQBUF");
+			goto out;
+		}
+
+		for (p = 0; p < b->num_planes; p++) {
+			memset(bufs[buf.index].start[p], i & 0xff, b->sizeimage[p]);
+			if (b->mplane)
+				planes[p].bytesused = b->sizeimage[p];
+			else
+				buf.bytesused = b->sizeimage[p];
+		}
+		if (xioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("output VIDIOC_QBUF");
+			goto out;
+		}
+		b->written++;
+
+		if (i + 1 == nbufs && xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+			perror("output VIDIOC_STREAMON");
+			goto out;
+		}
+	}
+
+	b->writer_ret = 0;
+out:
+	xioctl(fd, VIDIOC_STREAMOFF, &type);
+	for (i = 0; i < BENCH_MAX_BUFS; i++)
+		for (p = 0; p < VIDEO_MAX_PLANES; p++)
+			if (bufs[i].start[p])
+				munmap(bufs[i].start[p], bufs[i].length[p]);
+	close(fd);
+	return NULL;
+}
+
+static int bench_writer_start(struct bench_ctx *b)
+{
+	if (!b->opts.out_dev)
+		return 0;
+
+	signal(SIGALRM, bench_stall);
+	if (pthread_create(&b->writer, NULL, bench_writer_thread, b)) {
+		fprintf(stderr, "cannot start the output writer\n");
+		return -1;
+	}
+	b->writer_running = true;
+	return 0;
+}
+
+/* 停止写入线程，返回它是否出错；线程最多再等一帧输出完成 */
+static int bench_writer_stop(struct bench_ctx *b)
+{
+	if (!b->writer_running)
+		return 0;
+
+	b->writer_stop = true;
+	pthread_join(b->writer, NULL);
+	alarm(0);
+	b->writer_running = false;
+	return b->writer_ret;
+}
+
+static int bench_stream(struct bench_ctx *b)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buf;
+	struct pollfd pfd = { .fd = b->fd, .events = POLLIN };
+	unsigned int p;
+	uint32_t used;
+	int ret;
+
+	if (xioctl(b->fd, VIDIOC_STREAMON, &b->type) < 0) {
+		perror("VIDIOC_STREAMON");
+		return -1;
+	}
+
+	while (b->frames < b->opts.frames) {
+		if (b->opts.use_poll) {
+			ret = poll(&pfd, 1, 2000);
+			if (ret <= 0) {
+				fprintf(stderr, "poll: %s\n", ret ? strerror(errno) : "timeout");
+				return -1;
+			}
+		}
+
+		bench_fill_v4l2_buf(b, &buf, planes, 0);
+		bench_watchdog(b);
+		if (xioctl(b->fd, VIDIOC_DQBUF, &buf) < 0) {
+			if (errno == EAGAIN)
+				continue;
+			perror("VIDIOC_DQBUF");
+			return -1;
+		}
+
+		bench_account(b, &buf, now_ns(b->opts.clock));
+		for (p = 0; p < b->num_planes; p++) {
+			used = b->mplane ? planes[p].bytesused : buf.bytesused;
+			b->bytes += used;
+			if (b->opts.touch && b->bufs[buf.index].start[p])
+				bench_touch(b, b->bufs[buf.index].start[p], used);
+		}
+
+		if (xioctl(b->fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("VIDIOC_QBUF");
+			return -1;
+		}
+	}
+
+	xioctl(b->fd, VIDIOC_STREAMOFF, &b->type);
+	return 0;
+}
+
+/* read()方式：没有时间戳和序号，只统计帧率、字节数和CPU占用 */
+static int bench_read(struct bench_ctx *b)
+{
+	struct pollfd pfd = { .fd = b->fd, .events = POLLIN };
+	size_t size = b->sizeimage[0];
+	void *data = malloc(size);
+	ssize_t n;
+	int ret;
+
+	if (!data)
+		return -1;
+
+	while (b->frames < b->opts.frames) {
+		if (b->opts.use_poll) {
+			ret = poll(&pfd, 1, 2000);
+			if (ret <= 0) {
+				fprintf(stderr, "poll: %s\n", ret ? strerror(errno) : "timeout");
+				free(data);
+				return -1;
+			}
+		}
+
+		bench_watchdog(b);
+		n = read(b->fd, data, size);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("read");
+			free(data);
+			return -1;
+		}
+		if (b->opts.touch)
+			bench_touch(b, data, n);
+		b->bytes += n;
+		b->frames++;
+	}
+
+	free(data);
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *v, unsigned int n, double pct)
+{
+	unsigned int i;
+
+	if (!n)
+		return 0;
+	i = (unsigned int)(pct / 100.0 * (n - 1) + 0.5);
+	return v[i < n ? i : n - 1];
+}
+
+static void bench_report(struct bench_ctx *b, double wall_s, double cpu_s)
+{
+	double mean = 0, var = 0, nominal = 0, max_dev = 0, d;
+	double p50, p90, p99, pmax;
+	unsigned int i;
+	char fourcc[5];
+
+	qsort(b->lat_us, b->frames, sizeof(double), cmp_double);
+	p50 = percentile(b->lat_us, b->frames, 50);
+	p90 = percentile(b->lat_us, b->frames, 90);
+	p99 = percentile(b->lat_us, b->frames, 99);
+	pmax = b->frames ? b->lat_us[b->frames - 1] : 0;
+
+	// 抖动：时间戳间隔的标准差，以及相对标称帧间隔的最大偏差
+	if (b->tpf.denominator)
+		nominal = 1e6 * b->tpf.numerator / b->tpf.denominator;
+	for (i = 0; i < b->intervals; i++)
+		mean += b->ival_us[i];
+	if (b->intervals)
+		mean /= b->intervals;
+	for (i = 0; i < b->intervals; i++) {
+		var += (b->ival_us[i] - mean) * (b->ival_us[i] - mean);
+		d = fabs(b->ival_us[i] - (nominal ? nominal : mean));
+		if (d > max_dev)
+			max_dev = d;
+	}
+	if (b->intervals)
+		var /= b->intervals;
+
+	snprintf(fourcc, sizeof(fourcc), "%c%c%c%c", b->pixelformat & 0xff, (b->pixelformat >> 8) & 0xff,
+		(b->pixelformat >> 16) & 0xff, (b->pixelformat >> 24) & 0xff);
+
+	if (b->opts.json) {
+		printf("{\"device\":\"%s\",\"format\":\"%s\",\"width\":%u,\"height\":%u,\"io\":\"%s\","
+			"\"poll\":%s,\"buffers\":%u,\"frames\":%u,\"duration_s\":%.3f,\"fps\":%.2f,"
+			"\"bytes_per_frame\":%.0f,\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+			"\"interval_us\":{\"nominal\":%.1f,\"mean\":%.1f,\"stddev\":%.1f,\"max_dev\":%.1f},"
+			"\"drops\":%llu,\"written\":%u,\"cpu_pct\":%.2f}\n",
+			b->opts.dev, fourcc, b->width, b->height, io_names[b->opts.io],
+			b->opts.use_poll ? "true" : "false", b->nbufs, b->frames, wall_s, b->frames / wall_s,
+			b->frames ? (double)b->bytes / b->frames : 0, p50, p90, p99, pmax,
+			nominal, mean, sqrt(var), max_dev, (unsigned long long)b->drops, b->written, 100.0 * cpu_s / wall_s);
+		return;
+	}
+
+	printf("device     %s  %s %ux%u  io=%s%s  buffers=%u\n", b->opts.dev, fourcc, b->width, b->height,
+		io_names[b->opts.io], b->opts.use_poll ? "+poll" : "", b->nbufs);
+	printf("frames     %u in %.3f s, %.2f fps, %.0f bytes/frame\n", b->frames, wall_s,
+		b->frames / wall_s, b->frames ? (double)b->bytes / b->frames : 0);
+	if (b->opts.io != IO_READ) {
+		printf("latency    p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n", p50, p90, p99, pmax);
+		printf("interval   nominal %.1f us  mean %.1f us  stddev %.1f us  max dev %.1f us\n",
+			nominal, mean, sqrt(var), max_dev);
+		printf("drops      %llu\n", (unsigned long long)b->drops);
+	}
+	if (b->opts.out_dev)
+		printf("written    %u frames to %s\n", b->written, b->opts.out_dev);
+	printf("cpu        %.2f %%\n", 100.0 * cpu_s / wall_s);
+}
+
+static double rusage_cpu_s(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_ctx *b;
+	double cpu0, wall_s;
+	uint64_t t0;
+	int ret;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return 1;
+
+	if (parse_opts(&b->opts, argc, argv) < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	b->lat_us = calloc(b->opts.frames, sizeof(double));
+	b->ival_us = calloc(b->opts.frames, sizeof(double));
+	if (!b->lat_us || !b->ival_us)
+		return 1;
+
+	b->fd = open(b->opts.dev, O_RDWR | (b->opts.use_poll ? O_NONBLOCK : 0));
+	if (b->fd < 0) {
+		perror(b->opts.dev);
+		return 1;
+	}
+
+	if (bench_setup_format(b) < 0)
+		return 1;
+
+	if (b->opts.io == IO_READ && b->num_planes != 1) {
+		fprintf(stderr, "read() needs a single-plane format\n");
+		return 1;
+	}
+
+	if (b->opts.io != IO_READ && bench_setup_buffers(b) < 0)
+		return 1;
+
+	cpu0 = rusage_cpu_s();
+	t0 = now_ns(CLOCK_MONOTONIC);
+	ret = bench_writer_start(b);
+	if (ret == 0)
+		ret = b->opts.io == IO_READ ? bench_read(b) : bench_stream(b);
+	if (bench_writer_stop(b) < 0)
+		ret = -1;
+	wall_s = (now_ns(CLOCK_MONOTONIC) - t0) / 1e9;
+
+	if (b->frames)
+		bench_report(b, wall_s, rusage_cpu_s() - cpu0);
+
+	close(b->fd);
+	return ret < 0;
+}
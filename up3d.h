@@ -3,68 +3,252 @@
 
 #include <media/videobuf2-vmalloc.h>
 #include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-dma-sg.h>
 #include <media/v4l2-device.h>
 #include <linux/printk.h>
 #include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <linux/export.h>
+
+#include "up3d_compat.h"
+#include "up3d_pattern.h"
+#include "up3d_replay.h"
+#include "up3d_pool.h"
+#include "up3d_trace.h"
+
+// 分辨率范围：宽度4像素对齐，高度按格式对齐
+#define WIDTH_MIN	48
+#define HEIGHT_MIN	32
+#define WIDTH_MAX	4096
+#define HEIGHT_MAX	2160
+#define WIDTH_ALIGN	2			// 2的幂次，v4l_bound_align_image的walign
 
 // 默认格式
-#define WIDTH_MAX	1920
-#define HEIGHT_MAX	1080
 
 #define WIDTH_DEF	640
 #define HEIGHT_DEF	360
 
-extern unsigned long long get_current_timestamp(void);
+// 默认帧间隔 1/30s
+#define FRAME_INTERVAL_NUM_DEF	1
+#define FRAME_INTERVAL_DEN_DEF	30
+
+// 每个实例最多的采集节点数：1个主节点 + 扇出节点
+#define UP3D_MAX_STREAMS	4
 
-#if 1
-#define trace_in()					printk(KERN_DEBUG "%s:%d|%s(%lld) in.", __FILE__, __LINE__,__FUNCTION__, get_current_timestamp())
-#define trace_exit()				printk(KERN_DEBUG "%s:%d|%s(%lld) exit.", __FILE__, __LINE__,__FUNCTION__, get_current_timestamp())
-#define UP3D_DEBUG(format, ...)  	printk(KERN_DEBUG "%s:%d|%s(%lld) " format , __FILE__, __LINE__,__FUNCTION__, get_current_timestamp(), ##__VA_ARGS__)
-#else 
-#define trace_in()					
-#define trace_exit()				
-#define UP3D_DEBUG(format, ...)  	
+/**
+ * 控制路径的函数进入/退出走ftrace跟踪点，帧路径(生产线程、buf_*回调)只用up3d_trace.h中的帧级跟踪点；
+ * 调试信息走动态调试(pr_debug)，未启用时都只是一个静态键跳转，帧路径上没有printk和取时间的开销。
+ * 打开调试信息：echo 'module up3d610 +p' > /sys/kernel/debug/dynamic_debug/control
+ */
+#define trace_in()					trace_up3d_func_entry(__func__)
+#define trace_exit()				trace_up3d_func_exit(__func__)
+#define UP3D_DEBUG(format, ...)  	pr_debug("%s:%d|%s " format , __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+/**
+ * KUnit测试套件单独编译成up3d610_test.ko(见Makefile)，它用到的驱动内部函数
+ * 只在启用测试时导出，正常构建的驱动不导出也不依赖kunit
+ */
+#ifdef UP3D_KUNIT_TEST
+#define UP3D_EXPORT_FOR_TESTS(sym)	EXPORT_SYMBOL_GPL(sym)
+#else
+#define UP3D_EXPORT_FOR_TESTS(sym)
 #endif
 
 
+// 缓冲区内存分配器
+enum up3d_allocator {
+	ALLOCATOR_VMALLOC = 0,			// vb2_vmalloc_memops
+	ALLOCATOR_DMA_CONTIG,			// vb2_dma_contig_memops，物理连续
+	ALLOCATOR_DMA_SG,				// vb2_dma_sg_memops，分散/聚集
+};
+
+// 帧生产线程的调度策略
+enum up3d_producer_sched {
+	PRODUCER_SCHED_NORMAL = 0,		// SCHED_NORMAL，优先级由producer_nice决定
+	PRODUCER_SCHED_FIFO_LOW,		// SCHED_FIFO最低优先级，只抢占普通任务
+	PRODUCER_SCHED_FIFO,			// SCHED_FIFO中等优先级
+};
+
+// 没有空闲缓冲区时的丢帧策略
+enum up3d_drop_policy {
+	DROP_POLICY_NEWEST = 0,			// 丢掉新产生的帧
+	DROP_POLICY_LATEST,				// 驱动保留一个缓冲区，始终交付最新的帧，旧帧被覆盖
+	DROP_POLICY_BLOCK,				// 生产线程等待使用者入队，帧时钟暂停，不丢帧
+};
+
+// 缓冲区时间戳取自哪个时刻
+enum up3d_tstamp_src {
+	TSTAMP_SRC_SOE = 0,				// 帧时钟截止时间，相当于开始曝光，不含填充耗时
+	TSTAMP_SRC_EOF,					// 一帧填充(含扇出拷贝)完成时
+};
+
+// 缓冲区时间戳使用的时钟
+enum up3d_tstamp_clock {
+	TSTAMP_CLOCK_MONOTONIC = 0,
+	TSTAMP_CLOCK_BOOTTIME,			// 包含系统挂起的时间
+	TSTAMP_CLOCK_REALTIME,
+};
+
 struct up3d_vb2_buf {
 	struct vb2_v4l2_buffer vb;	// 必须在第一个
 	bool			prepared;
+	u64				qbuf_ns;		// 入队时间，统计入队到完成的延迟
 	struct list_head list;
 };
 
-struct up3d_framesize
+/* 延迟直方图：第0格<1us，第n格[2^(n-1), 2^n)us，最后一格包含更大的值 */
+#define UP3D_HIST_BUCKETS	16
+
+struct up3d_hist {
+	u64		count[UP3D_HIST_BUCKETS];
+	u64		sum_ns;
+	u64		max_ns;
+};
+
+static inline void up3d_hist_add(struct up3d_hist *h, u64 ns)
 {
-	uint32_t	width;
-	uint32_t	height;
+	u64 us = ns / NSEC_PER_USEC;
+	int b = us ? min_t(int, ilog2(us) + 1, UP3D_HIST_BUCKETS - 1) : 0;
+
+	h->count[b]++;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+/* 实例级统计，由生产线程在frame_lock下更新 */
+struct up3d_ctx_stats {
+	u64					ticks;			// 处理过的帧时钟节拍
+	u64					missed_ticks;	// 生产线程来不及处理而合并掉的节拍
+	u64					frames;			// 生成的帧
+	struct up3d_hist	fill_time;		// 填充一帧(含扇出拷贝)的时间
+	struct up3d_hist	lateness;		// 截止时间到生产线程开始填充的延迟
+	u64					loop_underruns;	// 回环输出节点没有待输出的帧而空过的节拍
+};
+
+/* 节点级统计 */
+struct up3d_stream_stats {
+	u64					delivered;		// 交付的帧
+	u64					dropped;		// 没有空闲缓冲区而丢掉的帧
+	u64					seq_gaps;		// 交付的序号不连续时跳过的帧数
+	u32					last_seq;
+	bool				seq_valid;
+	u32					queue_depth;	// 当前待填充的缓冲区个数，受vb_queue_lock保护
+	u32					queue_depth_max;
+	struct up3d_hist	qbuf_to_done;	// 入队到完成的延迟
 };
 
 struct up3d_fmtdesc
 {
 	uint8_t		description[32]; 	
 	uint32_t	pixel_format;		// 像素格式V4L2_PIX_FMT_XXX
-	uint8_t		bytes_per_pixel;		// 每个像素占用多少字节
-	struct up3d_framesize framesize;
+	uint8_t		bits_per_pixel;		// 第一个分量平面(打包格式或亮度)每个像素的位数，压缩格式为0
+	uint8_t		stride_div;			// 色度平面行跨度为亮度的几分之一(YUV420为2)，0和1表示相同
+	uint8_t		mem_planes;			// 缓冲区平面数，大于1的格式只在多平面节点上提供
+	uint8_t		height_align;		// 高度对齐(2的幂次)，4:2:0格式色度垂直下采样，高度必须为偶数
+	uint32_t	flags;				// VIDIOC_ENUM_FMT返回的标志，如V4L2_FMT_FLAG_COMPRESSED
+	const struct v4l2_frmsize_discrete *sizes;	// 支持的分辨率，为NULL时支持步进范围内的任意分辨率
+	uint32_t	sizes_cnt;
+};
+
+struct up3d_video_ctx;
+
+/**
+ * 一个采集节点：各自的video_device、缓冲队列和待填充链表。
+ * 同一实例的所有节点共享格式、帧时钟和生产线程，每个节拍只生成一帧，
+ * 再分发给所有正在采集的节点。
+ */
+struct up3d_stream
+{
+	struct up3d_video_ctx	*ctx;
+	int						index;			// 0为主节点，其余为扇出节点，元数据节点为-1，回环输出节点为-2
+	bool					streaming;		// 受ctx->frame_lock保护
+	struct video_device		vid_cap_dev;
+	struct vb2_queue		vb_queue;
+	struct list_head		vb_queue_active;
+	spinlock_t				vb_queue_lock;
+
+	/* DROP_POLICY_LATEST保留的缓冲区，受ctx->frame_lock保护 */
+	struct up3d_vb2_buf		*held;
+	bool					held_pending;	// 里面是还没交付的帧
+	enum vb2_buffer_state	held_state;
+
+	struct up3d_stream_stats	stats;
 };
 
 struct up3d_video_ctx
 {
+	int						inst;			// 实例编号
 	struct device			*dev;
-	struct v4l2_format 		cur_v4l2_format;	// 保存当前的格式设置
+	struct v4l2_format 		cur_v4l2_format;	// 保存当前的格式设置，内部统一用单平面的fmt.pix描述，sizeimage为整帧大小
+	struct up3d_frame_layout	layout;			// 当前格式各平面的布局
+	bool					mplane;			// 节点使用V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
 	struct v4l2_device		v4l2_dev;		
-	struct video_device		vid_cap_dev;	
-	struct mutex			mutex;
+	struct mutex			mutex;			// 所有节点的ioctl和vb2队列共用
+
 	struct up3d_fmtdesc 	*fmt_lists;			// 支持的格式列表
 	uint32_t 				fmt_lists_cnt;		
 
 	/* 队列和buffer */
-	struct vb2_queue vb_queue;
-	struct list_head vb_queue_active;
-	spinlock_t		 vb_queue_lock;
+	int				 allocator;			// enum up3d_allocator，probe时确定
+	uint32_t		 sequence;			// 帧序号，每次开始采集时清零，每个帧时钟节拍加1
+	int				 drop_policy;		// enum up3d_drop_policy
+	unsigned int	 read_buffers;		// read()方式使用的内部缓冲区个数
+	unsigned int	 min_buffers;		// 采集节点开始采集需要的最少缓冲区个数
+	unsigned int	 max_buffers;		// 每个节点最多的缓冲区个数，REQBUFS/CREATE_BUFS超出时减少
+	unsigned int	 line_align;		// bytesperline的对齐字节数，2的幂次
+	u64				 mem_budget;		// 所有节点的缓冲区总共可以占用的内存(字节)，0表示不限制
+	int				 tstamp_src;		// enum up3d_tstamp_src
+	int				 tstamp_clock;		// enum up3d_tstamp_clock
+
+	/* 采集节点 */
+	struct up3d_stream	streams[UP3D_MAX_STREAMS];
+	int					stream_cnt;
+	int					streaming_cnt;		// 正在采集的节点数，受mutex保护
+	struct mutex		frame_lock;			// 生产一帧期间持有，停止采集的节点等待它释放
+
+	/* 元数据节点(可选)，每帧一条up3d_meta_record，index为-1 */
+	struct up3d_stream	meta;
+	u64					meta_dropped;		// 上一条记录时所有采集节点的丢帧总数
+
+	/* 回环输出节点(可选)，正在输出时代替测试图案作为帧来源，index为-2 */
+	struct up3d_stream	loop;
 
 	/* querycap信息 */
 	struct v4l2_capability cap;
 
+	/* 帧时钟：hrtimer按绝对截止时间推进，周期由VIDIOC_S_PARM设置 */
+	struct hrtimer		frame_timer;
+	struct v4l2_fract	timeperframe;		// 当前帧间隔
+	ktime_t				frame_period;		// timeperframe换算成的纳秒周期
+
+	/* 帧生产线程：帧时钟只负责唤醒，填充在进程上下文中完成，不占用软中断 */
+	struct task_struct	*producer;
+	wait_queue_head_t	producer_wq;
+	atomic_t			frame_ticks;		// 尚未处理的帧时钟节拍数
+	ktime_t				frame_deadline;		// 最近一个节拍的截止时间
+	spinlock_t			tick_lock;			// 使取走的节拍数与frame_deadline一致
+	atomic_t			held_kick;			// 有缓冲区入队，交付保留着的帧
+	int					producer_cpu;		// 绑定的CPU，<0表示不绑定
+	int					producer_sched;		// enum up3d_producer_sched
+	int					producer_nice;		// PRODUCER_SCHED_NORMAL时的nice值
+
+	/* 测试图案 */
+	struct up3d_pattern	pattern;
+
+	/* 回放源(可选)，有可用的回放数据时代替测试图案，受frame_lock保护 */
+	struct up3d_replay	replay;
+
+	/* 常驻缓冲池(可选)，只用于vmalloc分配器 */
+	struct up3d_pool	pool;
+
+	/* 统计，通过debugfs导出 */
+	struct up3d_ctx_stats	stats;
+	struct dentry			*debugfs_dir;
+
 	uint32_t	width_max;
 	uint32_t	height_max;
 	uint32_t	width_def;
@@ -73,5 +257,20 @@ struct up3d_video_ctx
 
 
 extern struct up3d_fmtdesc up3d_fmtdesc_lists[];
+extern const uint32_t up3d_fmtdesc_lists_cnt;
+
+/* 缓冲队列的时间戳来源标志，元数据与帧使用相同的时间戳 */
+static inline u32 up3d_tstamp_src_flag(struct up3d_video_ctx *ctx)
+{
+	return ctx->tstamp_src == TSTAMP_SRC_EOF ? V4L2_BUF_FLAG_TSTAMP_SRC_EOF : V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+}
+
+/* 文件句柄所属的实例，格式等参数是实例级的 */
+static inline struct up3d_video_ctx *up3d_file_ctx(struct file *file)
+{
+	struct up3d_stream *stream = video_drvdata(file);
+
+	return stream->ctx;
+}
 
 #endif /*__UP3DTECH_610_H__*/
\ No newline at end of file
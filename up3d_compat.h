@@ -0,0 +1,35 @@
+#ifndef __UP3D_COMPAT_H__
+#define __UP3D_COMPAT_H__
+
+#include <linux/version.h>
+#include <media/videobuf2-core.h>
+
+/**
+ * 不同内核版本的接口差异，驱动支持5.9及以后的内核：
+ * 5.16  vb2_mem_ops.alloc/vaddr改为带vb2_buffer参数，dma_dir和gfp从vb->vb2_queue取(up3d_pool.c)
+ * 6.8   q->num_buffers改为vb2_get_num_buffers()，缓冲区下标可以不连续，最多q->max_num_buffers个；
+ *       q->min_buffers_needed改名为q->min_queued_buffers
+ * 6.11  platform_driver.remove返回void(up3d_core.c)
+ * 6.13  hrtimer_setup()取代hrtimer_init()；vb2没有wait_prepare/wait_finish时自己在等待期间释放q->lock
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define up3d_vb2_num_buffers(q)		vb2_get_num_buffers(q)
+#define up3d_vb2_buf_slots(q)		((q)->max_num_buffers)		// 用vb2_get_buffer遍历的下标上限
+#define up3d_vb2_min_queued(q)		((q)->min_queued_buffers)
+#else
+#define up3d_vb2_num_buffers(q)		((q)->num_buffers)
+#define up3d_vb2_buf_slots(q)		((q)->num_buffers)
+#define up3d_vb2_min_queued(q)		((q)->min_buffers_needed)
+#endif
+
+// 6.13起不设置这两个回调，vb2在等待缓冲区时自己释放和重新获取q->lock
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+#define UP3D_VB2_WAIT_OPS									\
+	.wait_prepare		= vb2_ops_wait_prepare,			\
+	.wait_finish		= vb2_ops_wait_finish,
+#else
+#define UP3D_VB2_WAIT_OPS
+#endif
+
+#endif /*__UP3D_COMPAT_H__*/
@@ -0,0 +1,271 @@
+#include "up3d_convert.h"
+#include "up3d_pattern.h"
+#include "up3d.h"
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
+
+// 基准测试每种格式、分辨率转换的帧数
+#define CONVERT_BENCH_FRAMES	30
+
+/* 源数据为RGB24，除压缩格式外都可以转换 */
+bool up3d_convert_supported(u32 pixelformat)
+{
+	return up3d_pattern_bytes_per_pixel(pixelformat) != 0;
+}
+
+/* 当前上下文能否使用NEON：CPU支持，且不在不允许使用FPU的上下文中 */
+static bool up3d_convert_simd_usable(void)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+	return cpu_has_neon() && may_use_simd();
+#else
+	return false;
+#endif
+}
+
+static inline void up3d_convert_simd_begin(bool simd)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+	if (simd)
+		kernel_neon_begin();
+#endif
+}
+
+static inline void up3d_convert_simd_end(bool simd)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+	if (simd)
+		kernel_neon_end();
+#endif
+}
+
+/* 以下每个函数转换一行，先交给NEON处理16像素的整数倍，剩余部分用标量实现 */
+
+static void up3d_convert_rgb565(u8 *dst, const u8 *src, u32 width, bool simd)
+{
+	u32 x = 0;
+	u16 v;
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+	if (simd)
+		x = up3d_neon_rgb565(dst, src, width);
+#endif
+	for (; x < width; x++) {
+		v = ((src[3 * x] & 0xf8) << 8) | ((src[3 * x + 1] & 0xfc) << 3) | (src[3 * x + 2] >> 3);
+		dst[2 * x] = v;
+		dst[2 * x + 1] = v >> 8;
+	}
+}
+
+static void up3d_convert_yuyv(u8 *dst, const u8 *src, u32 width, bool simd)
+{
+	const u8 *p;
+	u32 x = 0, r, g, b;
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+	if (simd)
+		x = up3d_neon_yuyv(dst, src, width);
+#endif
+	for (; x + 1 < width; x += 2) {
+		p = src + 3 * x;
+		r = (p[0] + p[3]) / 2;
+		g = (p[1] + p[4]) / 2;
+		b = (p[2] + p[5]) / 2;
+		dst[2 * x] = rgb_to_y(p[0], p[1], p[2]);
+		dst[2 * x + 1] = rgb_to_u(r, g, b);
+		dst[2 * x + 2] = rgb_to_y(p[3], p[4], p[5]);
+		dst[2 * x + 3] = rgb_to_v(r, g, b);
+	}
+}
+
+static void up3d_convert_luma(u8 *dst, const u8 *src, u32 width, bool simd)
+{
+	u32 x = 0;
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+	if (simd)
+		x = up3d_neon_luma(dst, src, width);
+#endif
+	for (; x < width; x++)
+		dst[x] = rgb_to_y(src[3 * x], src[3 * x + 1], src[3 * x + 2]);
+}
+
+/* 色度：水平方向两个像素取平均，u、v之间的距离为step(交错为2，平面为1时u、v分开存放) */
+static void up3d_convert_chroma(u8 *u, u8 *v, u32 step, const u8 *src, u32 width, bool simd)
+{
+	const u8 *p;
+	u32 x = 0, r, g, b;
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+	if (simd)
+		x = step == 2 ? up3d_neon_uv(u, src, width) : up3d_neon_u_v(u, v, src, width);
+#endif
+	for (; x + 1 < width; x += 2) {
+		p = src + 3 * x;
+		r = (p[0] + p[3]) / 2;
+		g = (p[1] + p[4]) / 2;
+		b = (p[2] + p[5]) / 2;
+		u[x / 2 * step] = rgb_to_u(r, g, b);
+		v[x / 2 * step] = rgb_to_v(r, g, b);
+	}
+}
+
+/* 转换一行像素到各分量平面，垂直下采样的色度平面取每组的第一行 */
+static void up3d_convert_line(const u8 *src, const struct up3d_frame_layout *l, u8 * const dst[],
+						u32 y, bool simd)
+{
+	u32 w = l->width, cy;
+	u8 *c1, *c2;
+
+	switch (l->pixelformat) {
+	case V4L2_PIX_FMT_RGB24:
+		memcpy(dst[0] + (size_t)y * l->bytesperline[0], src, w * 3);
+		return;
+	case V4L2_PIX_FMT_RGB565:
+		up3d_convert_rgb565(dst[0] + (size_t)y * l->bytesperline[0], src, w, simd);
+		return;
+	case V4L2_PIX_FMT_YUYV:
+		up3d_convert_yuyv(dst[0] + (size_t)y * l->bytesperline[0], src, w, simd);
+		return;
+	}
+
+	up3d_convert_luma(dst[0] + (size_t)y * l->bytesperline[0], src, w, simd);
+
+	if (y % (l->height / l->lines[1]))
+		return;
+
+	cy = y / (l->height / l->lines[1]);
+	c1 = dst[1] + (size_t)cy * l->bytesperline[1];
+	if (l->comp_planes == 2) {
+		up3d_convert_chroma(c1, c1 + 1, 2, src, w, simd);
+	} else {
+		c2 = dst[2] + (size_t)cy * l->bytesperline[2];
+		up3d_convert_chroma(c1, c2, 1, src, w, simd);
+	}
+}
+
+/**
+ * 把一帧RGB24(src_bpl为源行跨度)转换为layout描述的格式，写入vaddr/size给出的缓冲区平面。
+ * simd为false时只用标量实现。缓冲区放不下时返回false，payload为0。
+ */
+bool up3d_convert_frame(const u8 *src, u32 src_bpl, const struct up3d_frame_layout *layout,
+						void * const vaddr[], const unsigned long size[], unsigned long payload[],
+						bool simd)
+{
+	u8 *dst[UP3D_MAX_PLANES];
+	u32 c, mem, y, end;
+
+	for (mem = 0; mem < layout->mem_planes; mem++) {
+		payload[mem] = 0;
+		if (!vaddr[mem] || size[mem] < layout->sizeimage[mem])
+			return false;
+	}
+
+	if (!up3d_convert_supported(layout->pixelformat))
+		return false;
+
+	for (c = 0; c < layout->comp_planes; c++)
+		dst[c] = (u8 *)vaddr[layout->mem_plane[c]] + layout->offset[c];
+
+	simd = simd && up3d_convert_simd_usable();
+	for (y = 0; y < layout->height; y = end) {
+		end = min_t(u32, y + UP3D_CONVERT_BAND, layout->height);
+		up3d_convert_simd_begin(simd);
+		for (; y < end; y++)
+			up3d_convert_line(src + (size_t)y * src_bpl, layout, dst, y, simd);
+		up3d_convert_simd_end(simd);
+	}
+
+	for (mem = 0; mem < layout->mem_planes; mem++)
+		payload[mem] = layout->sizeimage[mem];
+
+	return true;
+}
+
+static void up3d_convert_bench_one(const char *impl, u32 pixelformat, const u8 *src,
+						const struct up3d_frame_layout *layout, void *buf, unsigned long size, bool simd)
+{
+	unsigned long payload;
+	u64 start, ns;
+	int n;
+
+	start = ktime_get_ns();
+	for (n = 0; n < CONVERT_BENCH_FRAMES; n++)
+		up3d_convert_frame(src, layout->width * 3, layout, &buf, &size, &payload, simd);
+	ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	// 吞吐量按读入的RGB24字节数计算
+	pr_info("up3d: convert bench %s %c%c%c%c %ux%u: %llu us/frame, %llu MB/s\n", impl,
+		pixelformat & 0xff, (pixelformat >> 8) & 0xff,
+		(pixelformat >> 16) & 0xff, (pixelformat >> 24) & 0xff,
+		layout->width, layout->height, div_u64(ns, CONVERT_BENCH_FRAMES * NSEC_PER_USEC),
+		div64_u64((u64)layout->width * layout->height * 3 * CONVERT_BENCH_FRAMES * 1000, ns));
+}
+
+/**
+ * 每种格式、分辨率的RGB24转换吞吐量，标量和NEON各测一次，结果输出到内核日志。
+ * 两种实现的输出逐字节比较，不一致时报错。
+ */
+void up3d_convert_bench(void)
+{
+	static const u32 formats[] = {
+		V4L2_PIX_FMT_RGB565, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12,
+		V4L2_PIX_FMT_NV16, V4L2_PIX_FMT_YUV420,
+	};
+	static const struct v4l2_frmsize_discrete sizes[] = {
+		{ 1920, 1080 },
+		{ 3840, 2160 },
+	};
+	struct up3d_frame_layout layout;
+	unsigned long size, payload;
+	void *buf, *ref;
+	u8 *src;
+	int i, j;
+
+	for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+		src = vmalloc((size_t)sizes[j].width * sizes[j].height * 3);
+		if (!src) {
+			pr_err("up3d: convert bench: out of memory\n");
+			return;
+		}
+		get_random_bytes(src, (size_t)sizes[j].width * sizes[j].height * 3);
+
+		for (i = 0; i < ARRAY_SIZE(formats); i++) {
+			up3d_pattern_layout(formats[i], sizes[j].width, sizes[j].height,
+				sizes[j].width * up3d_pattern_bytes_per_pixel(formats[i]), &layout);
+			size = layout.sizeimage[0];
+			buf = vmalloc(size);
+			ref = vmalloc(size);
+			if (!buf || !ref) {
+				pr_err("up3d: convert bench: out of memory\n");
+				vfree(buf);
+				vfree(ref);
+				vfree(src);
+				return;
+			}
+
+			// 预热并生成标量实现的参考输出
+			up3d_convert_frame(src, layout.width * 3, &layout, &ref, &size, &payload, false);
+			up3d_convert_bench_one("scalar", formats[i], src, &layout, ref, size, false);
+
+			if (up3d_convert_simd_usable()) {
+				up3d_convert_frame(src, layout.width * 3, &layout, &buf, &size, &payload, true);
+				if (memcmp(buf, ref, size))
+					pr_err("up3d: convert bench: NEON output differs from scalar\n");
+				up3d_convert_bench_one("neon", formats[i], src, &layout, buf, size, true);
+			}
+
+			vfree(buf);
+			vfree(ref);
+		}
+
+		vfree(src);
+	}
+}
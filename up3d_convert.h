@@ -0,0 +1,48 @@
+#ifndef __UP3D_CONVERT_H__
+#define __UP3D_CONVERT_H__
+
+#include <linux/types.h>
+
+/**
+ * RGB24(规范格式)到各未压缩格式的整帧转换，逐行进行。
+ * ARM上有内核态NEON时每行的前16*n个像素由NEON处理，剩余的像素走标量实现，
+ * 两种实现使用同样的整数运算，结果逐字节相同。
+ */
+
+// 每次kernel_neon_begin/end之间转换的行数，避免长时间关抢占
+#define UP3D_CONVERT_BAND	16
+
+struct up3d_frame_layout;
+
+/* RGB转YUV，BT.601有限范围 */
+static inline u8 rgb_to_y(u32 r, u32 g, u32 b)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static inline u8 rgb_to_u(u32 r, u32 g, u32 b)
+{
+	return ((-38 * (int)r - 74 * (int)g + 112 * (int)b + 128) >> 8) + 128;
+}
+
+static inline u8 rgb_to_v(u32 r, u32 g, u32 b)
+{
+	return ((112 * (int)r - 94 * (int)g - 18 * (int)b + 128) >> 8) + 128;
+}
+
+extern bool up3d_convert_supported(u32 pixelformat);
+extern bool up3d_convert_frame(const u8 *src, u32 src_bpl, const struct up3d_frame_layout *layout,
+						void * const vaddr[], const unsigned long size[], unsigned long payload[],
+						bool simd);
+extern void up3d_convert_bench(void);
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+/* up3d_convert_neon.c：返回处理了的像素数(16的倍数)，必须在kernel_neon_begin/end之间调用 */
+extern unsigned int up3d_neon_rgb565(u8 *dst, const u8 *src, unsigned int width);
+extern unsigned int up3d_neon_yuyv(u8 *dst, const u8 *src, unsigned int width);
+extern unsigned int up3d_neon_luma(u8 *dst, const u8 *src, unsigned int width);
+extern unsigned int up3d_neon_uv(u8 *dst, const u8 *src, unsigned int width);
+extern unsigned int up3d_neon_u_v(u8 *u, u8 *v, const u8 *src, unsigned int width);
+#endif
+
+#endif /*__UP3D_CONVERT_H__*/
@@ -0,0 +1,140 @@
+/**
+ * RGB24转换的NEON实现，只包含内联函数可用的头文件，用NEON编译选项单独编译。
+ * 每次从源行取16个像素(vld3q_u8按R、G、B分开)，运算与up3d_convert.h中的标量实现相同：
+ * 亮度的乘加在u16内不会溢出，色度的乘加在s16内不会溢出，色度取相邻两个像素的平均值(截断)。
+ */
+#ifdef CONFIG_ARM64
+#include <asm/neon-intrinsics.h>
+#else
+#include <arm_neon.h>
+#endif
+
+unsigned int up3d_neon_rgb565(uint8_t *dst, const uint8_t *src, unsigned int width);
+unsigned int up3d_neon_yuyv(uint8_t *dst, const uint8_t *src, unsigned int width);
+unsigned int up3d_neon_luma(uint8_t *dst, const uint8_t *src, unsigned int width);
+unsigned int up3d_neon_uv(uint8_t *dst, const uint8_t *src, unsigned int width);
+unsigned int up3d_neon_u_v(uint8_t *u, uint8_t *v, const uint8_t *src, unsigned int width);
+
+/* ((66r + 129g + 25b + 128) >> 8) + 16 */
+static inline uint8x8_t up3d_neon_y8(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t acc = vmull_u8(r, vdup_n_u8(66));
+
+	acc = vmlal_u8(acc, g, vdup_n_u8(129));
+	acc = vmlal_u8(acc, b, vdup_n_u8(25));
+	acc = vaddq_u16(acc, vdupq_n_u16(128));
+	return vadd_u8(vshrn_n_u16(acc, 8), vdup_n_u8(16));
+}
+
+static inline uint8x16_t up3d_neon_y16(uint8x16x3_t px)
+{
+	return vcombine_u8(up3d_neon_y8(vget_low_u8(px.val[0]), vget_low_u8(px.val[1]), vget_low_u8(px.val[2])),
+				up3d_neon_y8(vget_high_u8(px.val[0]), vget_high_u8(px.val[1]), vget_high_u8(px.val[2])));
+}
+
+/* (((kr*r + kg*g + kb*b + 128) >> 8) + 128，系数带符号 */
+static inline uint8x8_t up3d_neon_c8(int16x8_t r, int16x8_t g, int16x8_t b,
+						int16_t kr, int16_t kg, int16_t kb)
+{
+	int16x8_t acc = vmulq_n_s16(r, kr);
+
+	acc = vmlaq_n_s16(acc, g, kg);
+	acc = vmlaq_n_s16(acc, b, kb);
+	acc = vaddq_s16(acc, vdupq_n_s16(128));
+	acc = vaddq_s16(vshrq_n_s16(acc, 8), vdupq_n_s16(128));
+	return vmovn_u16(vreinterpretq_u16_s16(acc));
+}
+
+/* 16个像素两两平均，得到8个像素对的U、V */
+static inline void up3d_neon_uv8(uint8x16x3_t px, uint8x8_t *u, uint8x8_t *v)
+{
+	int16x8_t r = vreinterpretq_s16_u16(vshrq_n_u16(vpaddlq_u8(px.val[0]), 1));
+	int16x8_t g = vreinterpretq_s16_u16(vshrq_n_u16(vpaddlq_u8(px.val[1]), 1));
+	int16x8_t b = vreinterpretq_s16_u16(vshrq_n_u16(vpaddlq_u8(px.val[2]), 1));
+
+	*u = up3d_neon_c8(r, g, b, -38, -74, 112);
+	*v = up3d_neon_c8(r, g, b, 112, -94, -18);
+}
+
+/* R的高5位、G的高6位、B的高5位，小端存放 */
+unsigned int up3d_neon_rgb565(uint8_t *dst, const uint8_t *src, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16x3_t px = vld3q_u8(src + x * 3);
+		uint16x8_t lo, hi;
+
+		lo = vshll_n_u8(vget_low_u8(px.val[0]), 8);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[1]), 8), 5);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[2]), 8), 11);
+		hi = vshll_n_u8(vget_high_u8(px.val[0]), 8);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[1]), 8), 5);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[2]), 8), 11);
+		vst1q_u8(dst + x * 2, vreinterpretq_u8_u16(lo));
+		vst1q_u8(dst + x * 2 + 16, vreinterpretq_u8_u16(hi));
+	}
+
+	return x;
+}
+
+/* Y0 U Y1 V */
+unsigned int up3d_neon_yuyv(uint8_t *dst, const uint8_t *src, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16x3_t px = vld3q_u8(src + x * 3);
+		uint8x16_t y = up3d_neon_y16(px);
+		uint8x8x2_t yy = vuzp_u8(vget_low_u8(y), vget_high_u8(y));
+		uint8x8x4_t out;
+
+		out.val[0] = yy.val[0];
+		out.val[2] = yy.val[1];
+		up3d_neon_uv8(px, &out.val[1], &out.val[3]);
+		vst4_u8(dst + x * 2, out);
+	}
+
+	return x;
+}
+
+unsigned int up3d_neon_luma(uint8_t *dst, const uint8_t *src, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16)
+		vst1q_u8(dst + x, up3d_neon_y16(vld3q_u8(src + x * 3)));
+
+	return x;
+}
+
+/* NV12/NV16：UV交错 */
+unsigned int up3d_neon_uv(uint8_t *dst, const uint8_t *src, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x2_t uv;
+
+		up3d_neon_uv8(vld3q_u8(src + x * 3), &uv.val[0], &uv.val[1]);
+		vst2_u8(dst + x, uv);
+	}
+
+	return x;
+}
+
+/* YUV420：U、V各自一个平面 */
+unsigned int up3d_neon_u_v(uint8_t *u, uint8_t *v, const uint8_t *src, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8_t cu, cv;
+
+		up3d_neon_uv8(vld3q_u8(src + x * 3), &cu, &cv);
+		vst1_u8(u + x / 2, cu);
+		vst1_u8(v + x / 2, cv);
+	}
+
+	return x;
+}
@@ -27,6 +27,7 @@
 #include <linux/font.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
 #include <linux/videodev2.h>
 #include <media/v4l2-event.h>
 
@@ -41,122 +42,581 @@
 #include "up3d.h"
 #include "up3d_ioctl.h"
 #include "up3d_v4l2_fops.h"
+#include "up3d_vb2ops.h"
+#include "up3d_debugfs.h"
+#include "up3d_meta.h"
+#include "up3d_loop.h"
+#include "up3d_convert.h"
+#include "up3d_pool.h"
 
 #define VID_MODULE_NAME "up3d_vid"
 
 
 
 
-static struct up3d_video_ctx up3dvideo_ctx;
+// 一个模块最多创建的设备实例数
+#define UP3D_MAX_INSTANCES	8
+
+static struct up3d_video_ctx *up3d_ctxs[UP3D_MAX_INSTANCES];
+
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances, " number of independent video devices to create, 1..8 (default 1)");
+
+/* 以下参数每个实例一个值，用逗号分隔，例如allocator=0,1 */
+
+/* 缓冲区内存分配器 */
+static int allocator[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = ALLOCATOR_VMALLOC };
+module_param_array(allocator, int, NULL, 0444);
+MODULE_PARM_DESC(allocator, " buffer allocator: 0 = vmalloc (default), 1 = dma-contig, 2 = dma-sg");
+
+/* 常驻缓冲池，只用于vmalloc分配器 */
+static unsigned int pool_buffers[UP3D_MAX_INSTANCES];
+module_param_array(pool_buffers, uint, NULL, 0444);
+MODULE_PARM_DESC(pool_buffers, " number of released capture buffers kept for reuse across sessions, 0 = no pool (default 0)");
+
+static unsigned int pool_size_kb[UP3D_MAX_INSTANCES];
+module_param_array(pool_size_kb, uint, NULL, 0444);
+MODULE_PARM_DESC(pool_size_kb, " preallocate pool_buffers buffers of this many KiB at probe, 0 = fill the pool as buffers are released (default 0)");
+
+/* read()方式的内部缓冲区个数 */
+static uint read_buffers[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = 4 };
+module_param_array(read_buffers, uint, NULL, 0444);
+MODULE_PARM_DESC(read_buffers, " number of buffers cycled internally by read(), 2..32 (default 4)");
+
+/* 帧生产线程的CPU亲和性与调度策略 */
+static int producer_cpu[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = -1 };
+module_param_array(producer_cpu, int, NULL, 0444);
+MODULE_PARM_DESC(producer_cpu, " CPU the frame producer thread is bound to, -1 = not bound (default)");
+
+static int producer_sched[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = PRODUCER_SCHED_NORMAL };
+module_param_array(producer_sched, int, NULL, 0444);
+MODULE_PARM_DESC(producer_sched, " producer scheduling class: 0 = SCHED_NORMAL (default), 1 = SCHED_FIFO low priority, 2 = SCHED_FIFO");
+
+static int producer_nice[UP3D_MAX_INSTANCES];
+module_param_array(producer_nice, int, NULL, 0444);
+MODULE_PARM_DESC(producer_nice, " producer nice value when producer_sched=0, -20..19 (default 0)");
+
+/* 测试图案 */
+static int pattern[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = PATTERN_GRADIENT };
+module_param_array(pattern, int, NULL, 0444);
+MODULE_PARM_DESC(pattern, " test pattern: 0 = solid, 1 = color bars, 2 = moving gradient (default)");
+
+static uint pattern_color[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = 0x00ff00 };
+module_param_array(pattern_color, uint, NULL, 0444);
+MODULE_PARM_DESC(pattern_color, " solid pattern color, 0xRRGGBB (default 0x00ff00)");
+
+static bool pattern_overlay[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = true };
+module_param_array(pattern_overlay, bool, NULL, 0444);
+MODULE_PARM_DESC(pattern_overlay, " overlay frame sequence and timestamp blocks in the top-left corner (default on)");
+
+/* 回放源：/lib/firmware下的原始帧序列，按当前格式循环回放，代替测试图案 */
+static char *replay_fw[UP3D_MAX_INSTANCES];
+module_param_array(replay_fw, charp, NULL, 0444);
+MODULE_PARM_DESC(replay_fw, " firmware file with raw frames in the negotiated format, replayed in a loop instead of the test pattern");
+
+static bool replay_rgb24[UP3D_MAX_INSTANCES];
+module_param_array(replay_rgb24, bool, NULL, 0444);
+MODULE_PARM_DESC(replay_rgb24, " replay data is RGB24 at the negotiated size and is converted to the negotiated format (default off)");
+
+/* 每个节点的缓冲区个数范围 */
+static uint min_buffers[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = 2 };
+module_param_array(min_buffers, uint, NULL, 0444);
+MODULE_PARM_DESC(min_buffers, " buffers a capture node needs before streaming starts, 1..32, at least 2 with drop_policy=1 (default 2)");
+
+static uint max_buffers[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = VB2_MAX_FRAME };
+module_param_array(max_buffers, uint, NULL, 0444);
+MODULE_PARM_DESC(max_buffers, " most buffers a node may allocate, larger requests are reduced, min_buffers..32 (default 32)");
+
+/* 缓冲区内存预算，所有节点共用 */
+static uint mem_budget[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = 512 };
+module_param_array(mem_budget, uint, NULL, 0444);
+MODULE_PARM_DESC(mem_budget, " MiB of buffer memory all nodes of an instance may allocate, requests are reduced to fit, 0 = unlimited (default 512)");
+
+/* 行跨度对齐，例如64或128使每一行都从缓存行边界开始 */
+static uint line_align[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = 1 };
+module_param_array(line_align, uint, NULL, 0444);
+MODULE_PARM_DESC(line_align, " bytesperline alignment in bytes, a power of two up to 4096 (default 1, no padding)");
+
+/* 缓冲区时间戳：取开始曝光(帧时钟截止时间)还是填充完成的时刻，以及使用的时钟 */
+static int tstamp_src[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = TSTAMP_SRC_SOE };
+module_param_array(tstamp_src, int, NULL, 0444);
+MODULE_PARM_DESC(tstamp_src, " buffer timestamp: 0 = frame clock deadline, start of exposure (default), 1 = end of frame fill");
+
+static int tstamp_clock[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = TSTAMP_CLOCK_MONOTONIC };
+module_param_array(tstamp_clock, int, NULL, 0444);
+MODULE_PARM_DESC(tstamp_clock, " timestamp clock: 0 = CLOCK_MONOTONIC (default), 1 = CLOCK_BOOTTIME, 2 = CLOCK_REALTIME");
+
+/* 扇出：额外的采集节点数，与主节点共享同一路帧 */
+static uint fanout[UP3D_MAX_INSTANCES];
+module_param_array(fanout, uint, NULL, 0444);
+MODULE_PARM_DESC(fanout, " extra capture nodes fed from the same producer, 0..3 (default 0)");
+
+/* 没有空闲缓冲区时的丢帧策略 */
+static int drop_policy[UP3D_MAX_INSTANCES] = { [0 ... (UP3D_MAX_INSTANCES - 1)] = DROP_POLICY_NEWEST };
+module_param_array(drop_policy, int, NULL, 0444);
+MODULE_PARM_DESC(drop_policy, " when no buffer is queued: 0 = drop the new frame (default), 1 = always deliver the latest frame, 2 = block the producer");
+
+/* 多平面：节点使用VIDEO_CAPTURE_MPLANE缓冲区类型，额外提供NV12M/NV16M/YUV420M */
+static bool mplane[UP3D_MAX_INSTANCES];
+module_param_array(mplane, bool, NULL, 0444);
+MODULE_PARM_DESC(mplane, " use the multi-planar capture API and offer per-plane NV12M/NV16M/YUV420M (default off)");
+
+/* 元数据节点：每帧输出一条截止时间、填充时间、丢帧数等记录 */
+static bool meta[UP3D_MAX_INSTANCES];
+module_param_array(meta, bool, NULL, 0444);
+MODULE_PARM_DESC(meta, " create a metadata capture node with one timing record per frame (default off)");
+
+/* 回环输出节点：使用者写入的帧交给采集节点，代替测试图案 */
+static bool loopback[UP3D_MAX_INSTANCES];
+module_param_array(loopback, bool, NULL, 0444);
+MODULE_PARM_DESC(loopback, " create a video output node whose frames are delivered to the capture nodes (default off)");
+
+/* 全局参数 */
+static bool pattern_bench;
+module_param(pattern_bench, bool, 0444);
+MODULE_PARM_DESC(pattern_bench, " log per-format pattern fill throughput at probe (default off)");
+
+static bool handoff_bench;
+module_param(handoff_bench, bool, 0444);
+MODULE_PARM_DESC(handoff_bench, " stress the buf_queue/producer buffer handoff from several threads at probe (default off)");
+
+static bool convert_bench;
+module_param(convert_bench, bool, 0444);
+MODULE_PARM_DESC(convert_bench, " log RGB24 conversion throughput per format, scalar and NEON, at probe (default off)");
+
+/* RGB24只支持以下分辨率，其他格式支持步进范围内的任意分辨率 */
+static const struct v4l2_frmsize_discrete rgb24_sizes[] = {
+	{  320, 180 },
+	{  640, 360 },
+	{  640, 480 },
+	{ 1280, 720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+	{ 4096, 2160 },
+};
 
 struct up3d_fmtdesc up3d_fmtdesc_lists[]=
 {
 	{
 		.description = "8:8:8, RGB",
 		.pixel_format = V4L2_PIX_FMT_RGB24,
-		.bytes_per_pixel = 3,
-		.framesize.width = WIDTH_DEF,
-		.framesize.height = HEIGHT_DEF,
+		.bits_per_pixel = 24,
+		.mem_planes = 1,
+		.sizes = rgb24_sizes,
+		.sizes_cnt = ARRAY_SIZE(rgb24_sizes),
 	},
 	{
 		.description = "5:6:5, RGB",
 		.pixel_format = V4L2_PIX_FMT_RGB565,
-		.bytes_per_pixel = 1,
-		.framesize.width = WIDTH_DEF,
-		.framesize.height = HEIGHT_DEF,
+		.bits_per_pixel = 16,
+		.mem_planes = 1,
 	},
 	{
 		.description = "16  YUV 4:2:2",
 		.pixel_format = V4L2_PIX_FMT_YUYV,
-		.bytes_per_pixel = 1,
-		.framesize.width = WIDTH_DEF,
-		.framesize.height = HEIGHT_DEF,
+		.bits_per_pixel = 16,
+		.mem_planes = 1,
+	},
+	{
+		.description = "Y/CbCr 4:2:0",
+		.pixel_format = V4L2_PIX_FMT_NV12,
+		.bits_per_pixel = 8,
+		.mem_planes = 1,
+		.height_align = 1,
+	},
+	{
+		.description = "Y/CbCr 4:2:2",
+		.pixel_format = V4L2_PIX_FMT_NV16,
+		.bits_per_pixel = 8,
+		.mem_planes = 1,
+	},
+	{
+		.description = "Planar YUV 4:2:0",
+		.pixel_format = V4L2_PIX_FMT_YUV420,
+		.bits_per_pixel = 8,
+		.stride_div = 2,
+		.mem_planes = 1,
+		.height_align = 1,
+	},
+	{
+		.description = "Motion-JPEG",
+		.pixel_format = V4L2_PIX_FMT_MJPEG,
+		.bits_per_pixel = 0,			// 压缩格式，bytesperline为0
+		.mem_planes = 1,
+		.flags = V4L2_FMT_FLAG_COMPRESSED,
+	},
+	/* 以下每个分量平面单独一块内存，只在多平面节点上提供 */
+	{
+		.description = "Y/CbCr 4:2:0 (N-C)",
+		.pixel_format = V4L2_PIX_FMT_NV12M,
+		.bits_per_pixel = 8,
+		.mem_planes = 2,
+		.height_align = 1,
+	},
+	{
+		.description = "Y/CbCr 4:2:2 (N-C)",
+		.pixel_format = V4L2_PIX_FMT_NV16M,
+		.bits_per_pixel = 8,
+		.mem_planes = 2,
+	},
+	{
+		.description = "Planar YUV 4:2:0 (N-C)",
+		.pixel_format = V4L2_PIX_FMT_YUV420M,
+		.bits_per_pixel = 8,
+		.stride_div = 2,
+		.mem_planes = 3,
+		.height_align = 1,
 	}
 };
 
+UP3D_EXPORT_FOR_TESTS(up3d_fmtdesc_lists);
+const uint32_t up3d_fmtdesc_lists_cnt = ARRAY_SIZE(up3d_fmtdesc_lists);
+UP3D_EXPORT_FOR_TESTS(up3d_fmtdesc_lists_cnt);
+
+/* 最后一个引用释放时调用：此时所有video_device都已经释放，可以释放整个实例 */
 static void my_v4l2_release(struct v4l2_device *v4l2_dev)
 {
+	struct up3d_video_ctx *ctx = container_of(v4l2_dev, struct up3d_video_ctx, v4l2_dev);
+
 	trace_in();
+	v4l2_device_unregister(&ctx->v4l2_dev);
+	up3d_replay_release(&ctx->replay);
+	up3d_pool_exit(&ctx->pool);
+	kfree(ctx);
 	trace_exit();
 }
 
-
-static int up3d_video_pdrv_probe(struct platform_device *pdev)
+/* 注册一个采集节点，0号为主节点，其余为扇出节点 */
+static int up3d_register_stream(struct up3d_video_ctx *ctx, int index)
 {
     int erron;
-    int ret;
     struct video_device *vfd;
+	struct up3d_stream *stream = &ctx->streams[index];
 
-	trace_in();
-
-	up3dvideo_ctx.dev = &pdev->dev;
-    /* register v4l2_device */
-    snprintf(up3dvideo_ctx.v4l2_dev.name, sizeof(up3dvideo_ctx.v4l2_dev.name), "%s-%03d", VID_MODULE_NAME, 0);
-	ret = v4l2_device_register(&pdev->dev, &up3dvideo_ctx.v4l2_dev);
-	if (ret < 0) {
-		UP3D_DEBUG("v4l2_device_register failed ret:%d ", ret);
-		return ret;
+	stream->ctx = ctx;
+	stream->index = index;
+	erron = up3d_vb_queue_init(stream);
+	if (erron) {
+		UP3D_DEBUG("up3d_vb_queue_init erron:%d ", erron);
+		return erron;
 	}
-	up3dvideo_ctx.v4l2_dev.release = my_v4l2_release;
-	
-	// capabilities信息
-	strcpy(up3dvideo_ctx.cap.driver, "up3d_driver"); // 驱动名称
-	strcpy(up3dvideo_ctx.cap.card, "up3d_device");   // 设备名称
-	up3dvideo_ctx.cap.version = 0x0001;          // 版本号
-	up3dvideo_ctx.cap.capabilities =	V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING 
-									| V4L2_CAP_READWRITE | V4L2_CAP_DEVICE_CAPS;    // 能力，捕获和流 
-	up3dvideo_ctx.cap.device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
-	up3dvideo_ctx.width_max = WIDTH_MAX;
-	up3dvideo_ctx.height_max = HEIGHT_MAX;
-	up3dvideo_ctx.width_def = WIDTH_DEF;
-	up3dvideo_ctx.height_def = HEIGHT_DEF;
-	up3dvideo_ctx.fmt_lists = &up3d_fmtdesc_lists[0];
-	up3dvideo_ctx.fmt_lists_cnt = ARRAY_SIZE(up3d_fmtdesc_lists);
 
     // 视频设备操作
-	mutex_init(&up3dvideo_ctx.mutex);
-    vfd 				= &up3dvideo_ctx.vid_cap_dev;
+    vfd 				= &stream->vid_cap_dev;
     vfd->fops 			= &up3d_v4l2_fops;
     vfd->ioctl_ops 		= &up3d_v4l2_ioctl_ops;
-    vfd->device_caps 	= up3dvideo_ctx.cap.device_caps;
+    vfd->device_caps 	= ctx->cap.device_caps;
     vfd->release 		= video_device_release_empty;
-    vfd->v4l2_dev 		= &up3dvideo_ctx.v4l2_dev;
-    vfd->queue 			= &up3dvideo_ctx.vb_queue;  
+    vfd->v4l2_dev 		= &ctx->v4l2_dev;
+    vfd->queue 			= &stream->vb_queue;  
     vfd->tvnorms		= 0;   // 意义不明
-    vfd->lock 			= &up3dvideo_ctx.mutex;    // 未v4l2设置锁，先没用上暂时不加
-	snprintf(vfd->name, sizeof(vfd->name),  "up3d-%03d-vid-cap", 0);
-	video_set_drvdata(vfd, &up3dvideo_ctx);
+    vfd->lock 			= &ctx->mutex;    // 所有节点共用，格式和帧时钟是实例级的
+	if (index == 0)
+		snprintf(vfd->name, sizeof(vfd->name), "up3d-%03d-vid-cap", ctx->inst);
+	else
+		snprintf(vfd->name, sizeof(vfd->name), "up3d-%03d-vid-cap-%d", ctx->inst, index);
+	video_set_drvdata(vfd, stream);
     erron = video_register_device(vfd, VFL_TYPE_VIDEO, -1);
     if(erron)
     {
         UP3D_DEBUG("video_register_device erron:%d ", erron);
-        goto unreg_dev;
+        return erron;
     }
 
+	v4l2_info(&ctx->v4l2_dev, "registered %s as %s\n", vfd->name, video_device_node_name(vfd));
+	return 0;
+}
+
+/* 注册元数据节点，与采集节点共用ioctl锁和帧时钟 */
+static int up3d_register_meta(struct up3d_video_ctx *ctx)
+{
+	int erron;
+	struct video_device *vfd;
+	struct up3d_stream *stream = &ctx->meta;
+
+	stream->ctx = ctx;
+	stream->index = -1;
+	erron = up3d_meta_queue_init(stream);
+	if (erron) {
+		UP3D_DEBUG("up3d_meta_queue_init erron:%d ", erron);
+		return erron;
+	}
+
+	vfd					= &stream->vid_cap_dev;
+	vfd->fops			= &up3d_v4l2_fops;
+	vfd->ioctl_ops		= &up3d_meta_ioctl_ops;
+	vfd->device_caps	= V4L2_CAP_META_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
+	vfd->release		= video_device_release_empty;
+	vfd->v4l2_dev		= &ctx->v4l2_dev;
+	vfd->queue			= &stream->vb_queue;
+	vfd->lock			= &ctx->mutex;
+	snprintf(vfd->name, sizeof(vfd->name), "up3d-%03d-meta-cap", ctx->inst);
+	video_set_drvdata(vfd, stream);
+	erron = video_register_device(vfd, VFL_TYPE_VIDEO, -1);
+	if (erron) {
+		UP3D_DEBUG("video_register_device erron:%d ", erron);
+		return erron;
+	}
+
+	v4l2_info(&ctx->v4l2_dev, "registered %s as %s\n", vfd->name, video_device_node_name(vfd));
+	return 0;
+}
+
+/* 注册回环输出节点，格式和帧时钟与采集节点共用 */
+static int up3d_register_loop(struct up3d_video_ctx *ctx)
+{
+	int erron;
+	struct video_device *vfd;
+	struct up3d_stream *stream = &ctx->loop;
+
+	stream->ctx = ctx;
+	stream->index = -2;
+	erron = up3d_loop_queue_init(stream);
+	if (erron) {
+		UP3D_DEBUG("up3d_loop_queue_init erron:%d ", erron);
+		return erron;
+	}
+
+	vfd					= &stream->vid_cap_dev;
+	vfd->fops			= &up3d_v4l2_fops;
+	vfd->ioctl_ops		= &up3d_loop_ioctl_ops;
+	vfd->device_caps	= (ctx->mplane ? V4L2_CAP_VIDEO_OUTPUT_MPLANE : V4L2_CAP_VIDEO_OUTPUT) | V4L2_CAP_STREAMING;
+	vfd->vfl_dir		= VFL_DIR_TX;
+	vfd->release		= video_device_release_empty;
+	vfd->v4l2_dev		= &ctx->v4l2_dev;
+	vfd->queue			= &stream->vb_queue;
+	vfd->lock			= &ctx->mutex;
+	snprintf(vfd->name, sizeof(vfd->name), "up3d-%03d-vid-out", ctx->inst);
+	video_set_drvdata(vfd, stream);
+	erron = video_register_device(vfd, VFL_TYPE_VIDEO, -1);
+	if (erron) {
+		UP3D_DEBUG("video_register_device erron:%d ", erron);
+		return erron;
+	}
+
+	v4l2_info(&ctx->v4l2_dev, "registered %s as %s\n", vfd->name, video_device_node_name(vfd));
+	return 0;
+}
+
+/* 创建一个完全独立的设备实例：各自的上下文、帧时钟、生产线程、序号和缓冲队列 */
+static int up3d_create_instance(struct platform_device *pdev, int inst)
+{
+    int ret;
+	int i;
+	struct up3d_video_ctx *ctx;
+
+	trace_in();
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->inst = inst;
+	ctx->dev = &pdev->dev;
+
+	// dma-contig/dma-sg需要设备有DMA掩码，虚拟平台设备默认没有
+	ctx->allocator = allocator[inst];
+	ctx->drop_policy = (drop_policy[inst] >= DROP_POLICY_NEWEST && drop_policy[inst] <= DROP_POLICY_BLOCK) ? 
+						drop_policy[inst] : DROP_POLICY_NEWEST;
+	// 交付最新帧的策略由驱动保留一个缓冲区，至少还要一个给使用者
+	ctx->min_buffers = clamp_t(uint, min_buffers[inst], ctx->drop_policy == DROP_POLICY_LATEST ? 2 : 1, VB2_MAX_FRAME);
+	ctx->max_buffers = clamp_t(uint, max_buffers[inst], ctx->min_buffers, VB2_MAX_FRAME);
+	ctx->read_buffers = clamp_t(uint, read_buffers[inst], max(2U, ctx->min_buffers), ctx->max_buffers);
+	ctx->mem_budget = (u64)mem_budget[inst] << 20;
+	ctx->line_align = line_align[inst];
+	if (!is_power_of_2(ctx->line_align) || ctx->line_align > PAGE_SIZE) {
+		dev_warn(&pdev->dev, "line_align %u is not a power of two up to %lu, using 1\n", 
+			ctx->line_align, PAGE_SIZE);
+		ctx->line_align = 1;
+	}
+	ctx->tstamp_src = tstamp_src[inst] == TSTAMP_SRC_EOF ? TSTAMP_SRC_EOF : TSTAMP_SRC_SOE;
+	ctx->tstamp_clock = (tstamp_clock[inst] >= TSTAMP_CLOCK_MONOTONIC && tstamp_clock[inst] <= TSTAMP_CLOCK_REALTIME) ?
+						tstamp_clock[inst] : TSTAMP_CLOCK_MONOTONIC;
+	if (ctx->allocator == ALLOCATOR_DMA_CONTIG || ctx->allocator == ALLOCATOR_DMA_SG) {
+		ret = dma_coerce_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+		if (ret) {
+			dev_warn(&pdev->dev, "no suitable DMA mask, falling back to vmalloc\n");
+			ctx->allocator = ALLOCATOR_VMALLOC;
+		}
+	} else if (ctx->allocator != ALLOCATOR_VMALLOC) {
+		ctx->allocator = ALLOCATOR_VMALLOC;
+	}
+    /* register v4l2_device */
+    snprintf(ctx->v4l2_dev.name, sizeof(ctx->v4l2_dev.name), "%s-%03d", VID_MODULE_NAME, inst);
+	ret = v4l2_device_register(&pdev->dev, &ctx->v4l2_dev);
+	if (ret < 0) {
+		UP3D_DEBUG("v4l2_device_register failed ret:%d ", ret);
+		kfree(ctx);
+		return ret;
+	}
+	ctx->v4l2_dev.release = my_v4l2_release;
+
+	// 缓冲池在节点注册之前建立，my_v4l2_release中销毁，此时所有队列都已释放
+	ret = up3d_pool_init(&ctx->pool, ctx->allocator == ALLOCATOR_VMALLOC ? pool_buffers[inst] : 0, 
+				(unsigned long)pool_size_kb[inst] << 10);
+	if (ret < 0) {
+		dev_err(&pdev->dev, "cannot preallocate %u pool buffers of %u KiB\n", pool_buffers[inst], pool_size_kb[inst]);
+		v4l2_device_put(&ctx->v4l2_dev);
+		trace_exit();
+		return ret;
+	}
+	
+	// capabilities信息
+	strcpy(ctx->cap.driver, "up3d_driver"); // 驱动名称
+	strcpy(ctx->cap.card, "up3d_device");   // 设备名称
+	snprintf(ctx->cap.bus_info, sizeof(ctx->cap.bus_info), "platform:%s", ctx->v4l2_dev.name);
+	ctx->cap.version = 0x0001;          // 版本号
+	ctx->mplane = mplane[inst];
+	ctx->cap.device_caps = (ctx->mplane ? V4L2_CAP_VIDEO_CAPTURE_MPLANE : V4L2_CAP_VIDEO_CAPTURE) 
+									| V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;    // 能力，捕获和流 
+	ctx->cap.capabilities =	ctx->cap.device_caps | V4L2_CAP_DEVICE_CAPS;
+	if (meta[inst])
+		ctx->cap.capabilities |= V4L2_CAP_META_CAPTURE;
+	if (loopback[inst])
+		ctx->cap.capabilities |= ctx->mplane ? V4L2_CAP_VIDEO_OUTPUT_MPLANE : V4L2_CAP_VIDEO_OUTPUT;
+	ctx->width_max = WIDTH_MAX;
+	ctx->height_max = HEIGHT_MAX;
+	ctx->width_def = WIDTH_DEF;
+	ctx->height_def = HEIGHT_DEF;
+	ctx->fmt_lists = &up3d_fmtdesc_lists[0];
+	ctx->fmt_lists_cnt = ARRAY_SIZE(up3d_fmtdesc_lists);
+	up3d_frame_clock_init(ctx);
+	ctx->producer_cpu = producer_cpu[inst];
+	ctx->producer_sched = producer_sched[inst];
+	ctx->producer_nice = clamp(producer_nice[inst], -20, 19);
+	ctx->pattern.type = (pattern[inst] >= 0 && pattern[inst] < PATTERN_TYPE_CNT) ? pattern[inst] : PATTERN_GRADIENT;
+	ctx->pattern.color = pattern_color[inst] & 0xffffff;
+	ctx->pattern.overlay = pattern_overlay[inst];
+
+	mutex_init(&ctx->mutex);
+	up3d_init_format(&ctx->cur_v4l2_format, ctx);
+	ctx->stream_cnt = 1 + min_t(uint, fanout[inst], UP3D_MAX_STREAMS - 1);
+
+	for (i = 0; i < ctx->stream_cnt; i++) {
+		ret = up3d_register_stream(ctx, i);
+		if (ret < 0)
+			goto unreg_dev;
+	}
+
+	if (meta[inst]) {
+		ret = up3d_register_meta(ctx);
+		if (ret < 0)
+			goto unreg_dev;
+	}
+
+	if (loopback[inst]) {
+		ret = up3d_register_loop(ctx);
+		if (ret < 0)
+			goto unreg_dev;
+	}
+
+	// 回放文件加载失败不影响驱动工作，退回测试图案
+	ctx->replay.rgb24 = replay_rgb24[inst];
+	if (replay_fw[inst] && *replay_fw[inst]) {
+		ret = up3d_replay_load_fw(&ctx->replay, &pdev->dev, replay_fw[inst]);
+		if (ret < 0)
+			dev_warn(&pdev->dev, "loading replay firmware %s failed: %d\n", replay_fw[inst], ret);
+	}
+
+	up3d_ctxs[inst] = ctx;
+	up3d_debugfs_init(ctx);
 
 	trace_exit();
 
     return 0;
 
 unreg_dev:
+	// 没有注册的节点video_unregister_device什么都不做
+	video_unregister_device(&ctx->meta.vid_cap_dev);
+	while (--i >= 0)
+		video_unregister_device(&ctx->streams[i].vid_cap_dev);
 
-    v4l2_device_put(&up3dvideo_ctx.v4l2_dev);
+	// 释放最后一个引用，my_v4l2_release中释放ctx
+    v4l2_device_put(&ctx->v4l2_dev);
 
 	trace_exit();
-    return -ENOMEM;
+    return ret;
 }
-static int up3d_video_pdrv_remove(struct platform_device *dev)
+
+static void up3d_destroy_instance(int inst)
+{
+	struct up3d_video_ctx *ctx = up3d_ctxs[inst];
+	int i;
+
+	if (!ctx)
+		return;
+
+	up3d_debugfs_exit(ctx);
+
+	// 还有文件句柄打开时，ctx在最后一次关闭后才由my_v4l2_release释放
+	for (i = 0; i < ctx->stream_cnt; i++)
+		video_unregister_device(&ctx->streams[i].vid_cap_dev);
+	video_unregister_device(&ctx->meta.vid_cap_dev);	// 没有注册时什么都不做
+	video_unregister_device(&ctx->loop.vid_cap_dev);
+    v4l2_device_put(&ctx->v4l2_dev);
+	up3d_ctxs[inst] = NULL;
+}
+
+static int up3d_video_pdrv_probe(struct platform_device *pdev)
+{
+	int inst;
+	int ret;
+	struct up3d_pattern bench_cfg = {
+		.type = PATTERN_GRADIENT,
+		.overlay = true,
+	};
+
+	trace_in();
+
+	if (pattern_bench)
+		up3d_pattern_bench(&bench_cfg);
+	if (handoff_bench)
+		up3d_handoff_bench();
+	if (convert_bench)
+		up3d_convert_bench();
+
+	for (inst = 0; inst < instances; inst++) {
+		ret = up3d_create_instance(pdev, inst);
+		if (ret < 0) {
+			UP3D_DEBUG("up3d_create_instance %d failed ret:%d", inst, ret);
+			while (--inst >= 0)
+				up3d_destroy_instance(inst);
+			trace_exit();
+			return ret;
+		}
+	}
+
+	trace_exit();
+	return 0;
+}
+
+static void up3d_video_pdrv_teardown(struct platform_device *dev)
 {
+	int inst;
+
     trace_in();
 
-    video_unregister_device(&up3dvideo_ctx.vid_cap_dev);
-    
-    v4l2_device_put(&up3dvideo_ctx.v4l2_dev);
+	for (inst = 0; inst < UP3D_MAX_INSTANCES; inst++)
+		up3d_destroy_instance(inst);
 	
 	trace_exit();
-    return 0;
 }
 
+// 6.11起platform_driver.remove返回void
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void up3d_video_pdrv_remove(struct platform_device *dev)
+{
+	up3d_video_pdrv_teardown(dev);
+}
+#else
+static int up3d_video_pdrv_remove(struct platform_device *dev)
+{
+	up3d_video_pdrv_teardown(dev);
+	return 0;
+}
+#endif
+
 static void up3d_video_pdev_release(struct device *dev)
 {
 	trace_in();
@@ -181,10 +641,18 @@ static int __init up3d_video_610_init(void)
 	int ret;
     trace_in();
 
+	if (instances < 1 || instances > UP3D_MAX_INSTANCES) {
+		pr_err("up3d: instances must be 1..%d\n", UP3D_MAX_INSTANCES);
+		return -EINVAL;
+	}
+
+	up3d_debugfs_root_init();
+
 	ret = platform_device_register(&up3d_video_pdev);
 	if (ret < 0)
 	{
 		UP3D_DEBUG("platform_device_register failed ret:%d", ret);
+		up3d_debugfs_root_exit();
 		return ret;
 	}
 		
@@ -193,6 +661,7 @@ static int __init up3d_video_610_init(void)
 	{
 		UP3D_DEBUG("platform_driver_register failed ret:%d", ret);
 		platform_device_unregister(&up3d_video_pdev);
+		up3d_debugfs_root_exit();
 	}
 
 	trace_exit();
@@ -204,6 +673,7 @@ static void __exit up3d_video_610_exit(void)
     trace_in();
 	platform_driver_unregister(&up3d_video_pdrv);
 	platform_device_unregister(&up3d_video_pdev);
+	up3d_debugfs_root_exit();
 	trace_exit();
 }
 
@@ -0,0 +1,226 @@
+#include "up3d_debugfs.h"
+#include "up3d.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+/**
+ * /sys/kernel/debug/up3d610/<实例名>/
+ *   stats	每个实例及其各节点的统计，只读
+ *   pool	缓冲池的使用情况，只读，启用了缓冲池时才有
+ *   reset	写入任意内容清零统计
+ *   replay	写入原始帧序列作为回放源，关闭文件时生效；写入空内容清除回放
+ */
+static struct dentry *up3d_debugfs_root;
+
+static void up3d_hist_show(struct seq_file *m, const char *name, const struct up3d_hist *h)
+{
+	u64 total = 0;
+	int b;
+
+	for (b = 0; b < UP3D_HIST_BUCKETS; b++)
+		total += h->count[b];
+
+	seq_printf(m, "  %s: count %llu, avg %llu us, max %llu us\n", name, total,
+		total ? div64_u64(h->sum_ns, total * NSEC_PER_USEC) : 0, div_u64(h->max_ns, NSEC_PER_USEC));
+
+	for (b = 0; b < UP3D_HIST_BUCKETS; b++) {
+		if (!h->count[b])
+			continue;
+		if (b == 0)
+			seq_printf(m, "    %8s %6u us: %llu\n", "<", 1, h->count[b]);
+		else if (b == UP3D_HIST_BUCKETS - 1)
+			seq_printf(m, "    %8s %6u us: %llu\n", ">=", 1U << (b - 1), h->count[b]);
+		else
+			seq_printf(m, "    %8u-%6u us: %llu\n", 1U << (b - 1), 1U << b, h->count[b]);
+	}
+}
+
+static int up3d_stats_show(struct seq_file *m, void *unused)
+{
+	struct up3d_video_ctx *ctx = m->private;
+	struct up3d_stream *stream;
+	int i;
+
+	// 生产线程在frame_lock下更新统计，这里拿到的是一帧边界上的一致快照
+	mutex_lock(&ctx->frame_lock);
+
+	seq_printf(m, "%s: %ux%u, frame period %lld ns, %d/%d nodes streaming\n",
+		ctx->v4l2_dev.name, ctx->cur_v4l2_format.fmt.pix.width, ctx->cur_v4l2_format.fmt.pix.height,
+		ktime_to_ns(ctx->frame_period), ctx->streaming_cnt, ctx->stream_cnt);
+	seq_printf(m, "  ticks %llu, missed ticks %llu, frames %llu\n",
+		ctx->stats.ticks, ctx->stats.missed_ticks, ctx->stats.frames);
+	up3d_hist_show(m, "fill time", &ctx->stats.fill_time);
+	up3d_hist_show(m, "timer lateness", &ctx->stats.lateness);
+	if (video_is_registered(&ctx->loop.vid_cap_dev))
+		seq_printf(m, "  loopback %s, underrun ticks %llu\n",
+			ctx->loop.streaming ? "streaming" : "idle", ctx->stats.loop_underruns);
+	if (ctx->replay.size)
+		seq_printf(m, "  replay %zu bytes, %u frames in the current format\n",
+			ctx->replay.size, up3d_replay_frames(&ctx->replay, &ctx->layout));
+
+	for (i = 0; i < ctx->stream_cnt; i++) {
+		stream = &ctx->streams[i];
+		seq_printf(m, "%s: %s\n", video_device_node_name(&stream->vid_cap_dev),
+			stream->streaming ? "streaming" : "idle");
+		seq_printf(m, "  delivered %llu, dropped %llu, sequence gaps %llu\n",
+			stream->stats.delivered, stream->stats.dropped, stream->stats.seq_gaps);
+		seq_printf(m, "  queue depth %u, max %u\n",
+			READ_ONCE(stream->stats.queue_depth), stream->stats.queue_depth_max);
+		up3d_hist_show(m, "qbuf to done", &stream->stats.qbuf_to_done);
+	}
+
+	mutex_unlock(&ctx->frame_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(up3d_stats);
+
+static ssize_t up3d_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct up3d_video_ctx *ctx = file->private_data;
+	struct up3d_stream_stats *st;
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&ctx->frame_lock);
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	for (i = 0; i < ctx->stream_cnt; i++) {
+		st = &ctx->streams[i].stats;
+		// 当前队列深度反映的是实际状态，保留
+		spin_lock_irqsave(&ctx->streams[i].vb_queue_lock, flags);
+		st->delivered = 0;
+		st->dropped = 0;
+		st->seq_gaps = 0;
+		st->queue_depth_max = st->queue_depth;
+		memset(&st->qbuf_to_done, 0, sizeof(st->qbuf_to_done));
+		spin_unlock_irqrestore(&ctx->streams[i].vb_queue_lock, flags);
+	}
+	mutex_unlock(&ctx->frame_lock);
+
+	return count;
+}
+
+static const struct file_operations up3d_reset_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.write	= up3d_reset_write,
+	.llseek	= noop_llseek,
+};
+
+/* 写入回放数据时的暂存缓冲区，关闭文件时整体替换回放源，生产线程不会看到写了一半的数据 */
+struct up3d_replay_upload {
+	struct up3d_video_ctx	*ctx;
+	void					*buf;
+	size_t					size;
+	size_t					cap;
+};
+
+static int up3d_replay_file_open(struct inode *inode, struct file *file)
+{
+	struct up3d_replay_upload *up;
+
+	up = kzalloc(sizeof(*up), GFP_KERNEL);
+	if (!up)
+		return -ENOMEM;
+
+	up->ctx = inode->i_private;
+	file->private_data = up;
+	return 0;
+}
+
+static ssize_t up3d_replay_file_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct up3d_replay_upload *up = file->private_data;
+	size_t end, cap;
+	void *p;
+
+	if (*ppos < 0 || *ppos > UP3D_REPLAY_SIZE_MAX || count > UP3D_REPLAY_SIZE_MAX - *ppos)
+		return -EFBIG;
+
+	// 缓冲区按倍数增长，一次写入的数据不多时避免频繁重新分配
+	end = *ppos + count;
+	if (end > up->cap) {
+		cap = min_t(size_t, max_t(size_t, max_t(size_t, up->cap * 2, end), SZ_1M), UP3D_REPLAY_SIZE_MAX);
+		p = kvzalloc(cap, GFP_KERNEL);
+		if (!p)
+			return -ENOMEM;
+		if (up->buf)
+			memcpy(p, up->buf, up->size);
+		kvfree(up->buf);
+		up->buf = p;
+		up->cap = cap;
+	}
+
+	if (copy_from_user(up->buf + *ppos, buf, count))
+		return -EFAULT;
+
+	up->size = max(up->size, end);
+	*ppos = end;
+	return count;
+}
+
+static int up3d_replay_file_release(struct inode *inode, struct file *file)
+{
+	struct up3d_replay_upload *up = file->private_data;
+	struct up3d_video_ctx *ctx = up->ctx;
+
+	// 只读打开时不改变回放源
+	if (file->f_mode & FMODE_WRITE) {
+		mutex_lock(&ctx->frame_lock);
+		up3d_replay_set_buf(&ctx->replay, up->buf, up->size);
+		mutex_unlock(&ctx->frame_lock);
+	} else {
+		kvfree(up->buf);
+	}
+
+	kfree(up);
+	return 0;
+}
+
+static const struct file_operations up3d_replay_fops = {
+	.owner		= THIS_MODULE,
+	.open		= up3d_replay_file_open,
+	.write		= up3d_replay_file_write,
+	.release	= up3d_replay_file_release,
+	.llseek		= noop_llseek,
+};
+
+static int up3d_pool_stats_show(struct seq_file *m, void *unused)
+{
+	struct up3d_video_ctx *ctx = m->private;
+
+	up3d_pool_show(&ctx->pool, m);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(up3d_pool_stats);
+
+void up3d_debugfs_root_init(void)
+{
+	up3d_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+}
+
+void up3d_debugfs_root_exit(void)
+{
+	debugfs_remove_recursive(up3d_debugfs_root);
+	up3d_debugfs_root = NULL;
+}
+
+/* debugfs失败不影响驱动工作，不检查返回值 */
+void up3d_debugfs_init(struct up3d_video_ctx *ctx)
+{
+	ctx->debugfs_dir = debugfs_create_dir(ctx->v4l2_dev.name, up3d_debugfs_root);
+	debugfs_create_file("stats", 0444, ctx->debugfs_dir, ctx, &up3d_stats_fops);
+	debugfs_create_file("reset", 0200, ctx->debugfs_dir, ctx, &up3d_reset_fops);
+	debugfs_create_file("replay", 0200, ctx->debugfs_dir, ctx, &up3d_replay_fops);
+	if (up3d_pool_enabled(&ctx->pool))
+		debugfs_create_file("pool", 0444, ctx->debugfs_dir, ctx, &up3d_pool_stats_fops);
+}
+
+void up3d_debugfs_exit(struct up3d_video_ctx *ctx)
+{
+	debugfs_remove_recursive(ctx->debugfs_dir);
+	ctx->debugfs_dir = NULL;
+}
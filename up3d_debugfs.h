@@ -0,0 +1,11 @@
+#ifndef __UP3D_DEBUGFS_H__
+#define __UP3D_DEBUGFS_H__
+
+struct up3d_video_ctx;
+
+extern void up3d_debugfs_root_init(void);
+extern void up3d_debugfs_root_exit(void);
+extern void up3d_debugfs_init(struct up3d_video_ctx *ctx);
+extern void up3d_debugfs_exit(struct up3d_video_ctx *ctx);
+
+#endif /*__UP3D_DEBUGFS_H__*/
@@ -1,37 +1,161 @@
 #include "up3d_ioctl.h"
+#include "up3d_vb2ops.h"
 #include "up3d.h"
-
-static const struct v4l2_frmsize_discrete rgb24_sizes[] = {
-	{  320, 180 },
-	{  640, 360 },
-	{  640, 480 },
-	{ 1280, 720 },
-	{ 1920, 1080 },
-	{ 3840, 2160 },
+#include <linux/math64.h>
+
+/* 支持的帧间隔，按帧率从高到低排列 */
+static const struct v4l2_fract up3d_frame_intervals[] = {
+	{ 1, 120 },
+	{ 1, 60 },
+	{ 1, 30 },
+	{ 1, 15 },
 };
 
+/* 帧时钟能承受的最大像素速率：4096x2160@30，1080p仍可到120 */
+#define PIXEL_RATE_MAX	(4096ULL * 2160 * 30)
+
+static struct up3d_fmtdesc *up3d_find_fmt(struct up3d_video_ctx *ctx, uint32_t pixelformat)
+{
+	int index;
+
+	for(index=0; index<ctx->fmt_lists_cnt; index++)
+	{
+		// 分量平面各自一块内存的格式只能通过多平面API使用
+		if (ctx->fmt_lists[index].mem_planes > 1 && !ctx->mplane)
+			continue;
+		if(pixelformat == ctx->fmt_lists[index].pixel_format)
+			return &ctx->fmt_lists[index];
+	}
+
+	return NULL;
+}
+
+/* 判断分辨率是否在VIDIOC_ENUM_FRAMESIZES列出的范围内 */
+static bool up3d_framesize_supported(struct up3d_video_ctx *ctx, struct up3d_fmtdesc *fmt, 
+						uint32_t width, uint32_t height)
+{
+	int i;
+
+	if (fmt->sizes) {
+		for (i = 0; i < fmt->sizes_cnt; i++) {
+			if (fmt->sizes[i].width == width && fmt->sizes[i].height == height)
+				return true;
+		}
+		return false;
+	}
+
+	return width >= WIDTH_MIN && width <= ctx->width_max && 
+		height >= HEIGHT_MIN && height <= ctx->height_max &&
+		!(width & ((1 << WIDTH_ALIGN) - 1)) && !(height & ((1 << fmt->height_align) - 1));
+}
+
+/* 整帧大小：所有缓冲区平面之和 */
+static u32 up3d_frame_size(const struct up3d_frame_layout *layout)
+{
+	u32 p, size = 0;
+
+	for (p = 0; p < layout->mem_planes; p++)
+		size += layout->sizeimage[p];
+
+	return size;
+}
+
+/* 按布局填写多平面格式，每个缓冲区平面的行跨度取其第一个分量平面 */
+static void up3d_fill_pix_mp(struct v4l2_pix_format_mplane *mp, const struct v4l2_pix_format *pix,
+						const struct up3d_frame_layout *layout)
+{
+	u32 p;
+
+	memset(mp, 0, sizeof(*mp));
+	mp->width = pix->width;
+	mp->height = pix->height;
+	mp->pixelformat = pix->pixelformat;
+	mp->field = pix->field;
+	mp->colorspace = pix->colorspace;
+	mp->ycbcr_enc = pix->ycbcr_enc;
+	mp->quantization = pix->quantization;
+	mp->xfer_func = pix->xfer_func;
+	mp->num_planes = layout->mem_planes;
+	for (p = 0; p < layout->mem_planes; p++) {
+		mp->plane_fmt[p].bytesperline = layout->bytesperline[layout->mem_planes > 1 ? p : 0];
+		mp->plane_fmt[p].sizeimage = layout->sizeimage[p];
+	}
+}
+
+static bool up3d_frame_interval_supported(uint32_t width, uint32_t height,
+						const struct v4l2_fract *ival)
+{
+	return (u64)width * height * ival->denominator <= PIXEL_RATE_MAX * ival->numerator;
+}
+
+static u64 up3d_fract_to_ns(const struct v4l2_fract *ival)
+{
+	return div_u64((u64)ival->numerator * NSEC_PER_SEC, ival->denominator);
+}
+
+/* 在当前分辨率允许的帧间隔中选出与请求值最接近的一个 */
+static const struct v4l2_fract *up3d_nearest_interval(uint32_t width, uint32_t height,
+						const struct v4l2_fract *want)
+{
+	const struct v4l2_fract *best = NULL;
+	u64 want_ns, ns, diff, best_diff = U64_MAX;
+	int i;
+
+	if (want->numerator == 0 || want->denominator == 0)
+		want_ns = NSEC_PER_SEC / FRAME_INTERVAL_DEN_DEF * FRAME_INTERVAL_NUM_DEF;
+	else
+		want_ns = up3d_fract_to_ns(want);
+
+	for(i=0; i<ARRAY_SIZE(up3d_frame_intervals); i++)
+	{
+		if (!up3d_frame_interval_supported(width, height, &up3d_frame_intervals[i]))
+			continue;
+
+		ns = up3d_fract_to_ns(&up3d_frame_intervals[i]);
+		diff = ns > want_ns ? ns - want_ns : want_ns - ns;
+		if (diff < best_diff) {
+			best_diff = diff;
+			best = &up3d_frame_intervals[i];
+		}
+	}
+
+	// 最低帧率在最大分辨率下也能满足
+	if (!best)
+		best = &up3d_frame_intervals[ARRAY_SIZE(up3d_frame_intervals) - 1];
+
+	return best;
+}
+
 
 /* 列举支持哪种格式 */
 static int up3d_enum_fmt_vid_cap(struct file *file, void *fh,struct v4l2_fmtdesc *f)
 {
-	struct up3d_video_ctx *ctx = video_drvdata(file);
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+	int index, n = 0;
 
 	trace_in();
-	
-	if (f->index >= ctx->fmt_lists_cnt)	
-		return -EINVAL;
 
-	strcpy(f->description, ctx->fmt_lists[f->index].description);
-	f->pixelformat = ctx->fmt_lists[f->index].pixel_format;
+	// 单平面节点跳过多平面格式，多平面节点两种都提供
+	for (index = 0; index < ctx->fmt_lists_cnt; index++) {
+		if (ctx->fmt_lists[index].mem_planes > 1 && !ctx->mplane)
+			continue;
+		if (n++ == f->index) {
+			strcpy(f->description, ctx->fmt_lists[index].description);
+			f->pixelformat = ctx->fmt_lists[index].pixel_format;
+			f->flags = ctx->fmt_lists[index].flags;
+			trace_exit();
+			return 0;
+		}
+	}
 
 	trace_exit();
-	return 0;
+	return -EINVAL;
 }
 
 /* 获取当前使用的格式 */
 static int up3d_g_fmt_vid_cap(struct file *file, void *fh,struct v4l2_format *f)
 {
-	struct up3d_video_ctx *ctx = video_drvdata(file);
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
 
 	trace_in();
 	memcpy(f, &ctx->cur_v4l2_format, sizeof(struct v4l2_format));
@@ -40,54 +164,192 @@ static int up3d_g_fmt_vid_cap(struct file *file, void *fh,struct v4l2_format *f)
 	return 0;
 }
 
+static int up3d_g_fmt_vid_cap_mplane(struct file *file, void *fh, struct v4l2_format *f)
+{
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
 
-/* 尝试是否支持某种格式 */
-static int up3d_try_fmt_vid_cap(struct file *file, void *fh,struct v4l2_format *f)
+	up3d_fill_pix_mp(&f->fmt.pix_mp, &ctx->cur_v4l2_format.fmt.pix, &ctx->layout);
+	return 0;
+}
+
+
+/**
+ * 第一个分量平面的行跨度：至少容纳一行像素，按line_align对齐。
+ * 色度平面的跨度按比例缩小，对齐量相应放大，保证每个平面的每一行都对齐。
+ * 使用者要求更大的跨度时按对齐后的值使用，最多为最大宽度一行的大小。
+ */
+static u32 up3d_bytesperline(struct up3d_video_ctx *ctx, struct up3d_fmtdesc *fmt, 
+						u32 width, u32 requested)
 {
-    enum v4l2_field field;
-	int index=0;
-	struct up3d_video_ctx *ctx = video_drvdata(file);
-	
-	trace_in();
+	u32 align = ctx->line_align * max_t(u32, fmt->stride_div, 1);
+	u32 min_bpl, max_bpl;
 
-	for(index=0; index<ctx->fmt_lists_cnt; index++)
-	{
-		if(f->fmt.pix.pixelformat == ctx->fmt_lists[index].pixel_format)
-			break;
+	if (!fmt->bits_per_pixel)
+		return 0;
+
+	min_bpl = ALIGN(DIV_ROUND_UP(width * fmt->bits_per_pixel, 8), align);
+	max_bpl = max(min_bpl, ALIGN(DIV_ROUND_UP(ctx->width_max * fmt->bits_per_pixel, 8), align));
+
+	return clamp(ALIGN(requested, align), min_bpl, max_bpl);
+}
+
+/**
+ * 色彩空间由驱动决定，不沿用使用者传入的值：图案和回放都按sRGB生成，
+ * YUV格式用BT.601系数转换、有限范围(up3d_convert.h中的rgb_to_y等)，MJPEG按JPEG全范围
+ */
+static void up3d_fill_colorspace(const struct up3d_fmtdesc *fmt, struct v4l2_pix_format *pix)
+{
+	pix->xfer_func = V4L2_XFER_FUNC_SRGB;
+
+	if (fmt->flags & V4L2_FMT_FLAG_COMPRESSED) {
+		pix->colorspace = V4L2_COLORSPACE_JPEG;
+		pix->ycbcr_enc = V4L2_YCBCR_ENC_601;
+		pix->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+		return;
+	}
+
+	pix->colorspace = V4L2_COLORSPACE_SRGB;
+	switch (fmt->pixel_format) {
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_RGB565:
+		pix->ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
+		pix->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+		break;
+	default:
+		pix->ycbcr_enc = V4L2_YCBCR_ENC_601;
+		pix->quantization = V4L2_QUANTIZATION_LIM_RANGE;
+		break;
 	}
+}
+
+/* 调整为支持的格式并计算各平面布局，单平面和多平面API共用 */
+int up3d_try_fmt(struct up3d_video_ctx *ctx, struct v4l2_pix_format *pix,
+						struct up3d_frame_layout *layout)
+{
+	struct up3d_fmtdesc *fmt;
 
-	if(index >= ctx->fmt_lists_cnt)
+	fmt = up3d_find_fmt(ctx, pix->pixelformat);
+	if(!fmt)
 		return -EINVAL;
 	
-	field = f->fmt.pix.field;
-	if (field == V4L2_FIELD_ANY) {
-		field = V4L2_FIELD_INTERLACED;
-	} else if (V4L2_FIELD_INTERLACED != field) {
-		return -EINVAL;
+	// 生产线程只产生逐行帧，不管要求的是什么场序都改为NONE
+	pix->field = V4L2_FIELD_NONE;
+
+	// 只支持离散分辨率的格式取最接近的一个，其余格式在步进范围内对齐
+	if (fmt->sizes) {
+		const struct v4l2_frmsize_discrete *size = v4l2_find_nearest_size(fmt->sizes, 
+						fmt->sizes_cnt, width, height, pix->width, pix->height);
+
+		pix->width = size->width;
+		pix->height = size->height;
+	} else {
+		v4l_bound_align_image(&pix->width, WIDTH_MIN, ctx->width_max, WIDTH_ALIGN, 
+					&pix->height, HEIGHT_MIN, ctx->height_max, fmt->height_align, 0);
 	}
+	pix->bytesperline = up3d_bytesperline(ctx, fmt, pix->width, pix->bytesperline);
+	up3d_pattern_layout(fmt->pixel_format, pix->width, pix->height, pix->bytesperline, layout);
+	pix->sizeimage = up3d_frame_size(layout);
+	up3d_fill_colorspace(fmt, pix);
 
-	v4l_bound_align_image(&f->fmt.pix.width, 48, ctx->width_max, 2,	&f->fmt.pix.height, 32, ctx->height_max, 0, 0);
-	f->fmt.pix.bytesperline =	f->fmt.pix.width * ctx->fmt_lists[index].bytes_per_pixel;
-	f->fmt.pix.sizeimage 	=	f->fmt.pix.height * f->fmt.pix.bytesperline;
+	return 0;
+}
+UP3D_EXPORT_FOR_TESTS(up3d_try_fmt);
 
+/* 尝试是否支持某种格式 */
+static int up3d_try_fmt_vid_cap(struct file *file, void *fh,struct v4l2_format *f)
+{
+	int ret;
+	struct up3d_frame_layout layout;
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+	
+	trace_in();
+	ret = up3d_try_fmt(ctx, &f->fmt.pix, &layout);
 	trace_exit();
+	return ret;
+}
+
+static int up3d_try_fmt_vid_cap_mplane(struct file *file, void *fh, struct v4l2_format *f)
+{
+	int ret;
+	struct up3d_frame_layout layout;
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+	struct v4l2_pix_format pix = {
+		.width = f->fmt.pix_mp.width,
+		.height = f->fmt.pix_mp.height,
+		.pixelformat = f->fmt.pix_mp.pixelformat,
+		.field = f->fmt.pix_mp.field,
+		.bytesperline = f->fmt.pix_mp.plane_fmt[0].bytesperline,
+	};
+
+	ret = up3d_try_fmt(ctx, &pix, &layout);
+	if (ret < 0)
+		return ret;
+
+	up3d_fill_pix_mp(&f->fmt.pix_mp, &pix, &layout);
+	return 0;
+}
+
+/* 格式由所有节点共享：任何一个节点(包括回环输出节点)已经分配了缓冲区(或正在采集)时都不能修改 */
+static int up3d_set_fmt(struct up3d_video_ctx *ctx, const struct v4l2_pix_format *pix,
+						const struct up3d_frame_layout *layout)
+{
+	int i;
+
+	for (i = 0; i < ctx->stream_cnt; i++)
+		if (vb2_is_busy(&ctx->streams[i].vb_queue))
+			return -EBUSY;
+	if (vb2_is_busy(&ctx->loop.vb_queue))
+		return -EBUSY;
+
+	ctx->cur_v4l2_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ctx->cur_v4l2_format.fmt.pix = *pix;
+	ctx->layout = *layout;
+
+	// 新分辨率下当前帧率可能超出像素速率上限，重新选择最接近的帧间隔
+	up3d_frame_clock_set_interval(ctx, up3d_nearest_interval(pix->width, 
+				pix->height, &ctx->timeperframe));
 	return 0;
 }
 
 static int up3d_s_fmt_vid_cap(struct file *file, void *fh,struct v4l2_format *f)
 {
 	int ret;
-	struct up3d_video_ctx *ctx = video_drvdata(file);
+	struct up3d_frame_layout layout;
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
 
 	trace_in();
-	ret = up3d_try_fmt_vid_cap(file, NULL, f);
+	ret = up3d_try_fmt(ctx, &f->fmt.pix, &layout);
 	if (ret < 0)
 		return ret;
 
-    memcpy(&ctx->cur_v4l2_format, f, sizeof(struct v4l2_format));
-	
+	ret = up3d_set_fmt(ctx, &f->fmt.pix, &layout);
 	trace_exit();
-	return 0;
+	return ret;
+}
+
+static int up3d_s_fmt_vid_cap_mplane(struct file *file, void *fh, struct v4l2_format *f)
+{
+	int ret;
+	struct up3d_frame_layout layout;
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+	struct v4l2_pix_format pix = {
+		.width = f->fmt.pix_mp.width,
+		.height = f->fmt.pix_mp.height,
+		.pixelformat = f->fmt.pix_mp.pixelformat,
+		.field = f->fmt.pix_mp.field,
+		.bytesperline = f->fmt.pix_mp.plane_fmt[0].bytesperline,
+	};
+
+	trace_in();
+	ret = up3d_try_fmt(ctx, &pix, &layout);
+	if (ret < 0)
+		return ret;
+
+	ret = up3d_set_fmt(ctx, &pix, &layout);
+	if (ret == 0)
+		up3d_fill_pix_mp(&f->fmt.pix_mp, &pix, &layout);
+	trace_exit();
+	return ret;
 }
 
 /* 枚举支持的输入设备 */
@@ -131,12 +393,14 @@ static int up3d_s_input(struct file *file, void *fh, unsigned int i)
 }
 
 
-static int up3d_querycap(struct file *file, void *fh, struct v4l2_capability *cap)
+/* 采集节点和元数据节点共用，device_caps取各自节点的 */
+int up3d_querycap(struct file *file, void *fh, struct v4l2_capability *cap)
 {
-	struct up3d_video_ctx *ctx = video_drvdata(file);
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
 
 	trace_in();
 	memcpy(cap, &ctx->cap, sizeof(struct v4l2_capability));	
+	cap->device_caps = video_devdata(file)->device_caps;
 	trace_exit();
 	
 	return 0;
@@ -145,59 +409,118 @@ static int up3d_querycap(struct file *file, void *fh, struct v4l2_capability *ca
 static int up3d_enum_frameintervals(struct file *file, void *fh,
 					  struct v4l2_frmivalenum *fival)
 {
+	int i, n = 0;
+	struct up3d_fmtdesc *fmt;
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+
+	trace_in();
+
+	fmt = up3d_find_fmt(ctx, fival->pixel_format);
+	if (!fmt || !up3d_framesize_supported(ctx, fmt, fival->width, fival->height))
+		return -EINVAL;
+
+	for(i=0; i<ARRAY_SIZE(up3d_frame_intervals); i++)
+	{
+		if (!up3d_frame_interval_supported(fival->width, fival->height, &up3d_frame_intervals[i]))
+			continue;
+
+		if (n++ == fival->index) {
+			fival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+			fival->discrete = up3d_frame_intervals[i];
+			trace_exit();
+			return 0;
+		}
+	}
+
+	trace_exit();
+	return -EINVAL;
+}
+
+/* 获取帧率 */
+static int up3d_g_parm(struct file *file, void *fh, struct v4l2_streamparm *parm)
+{
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+
 	trace_in();
+
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE && parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+		return -EINVAL;
+
+	parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+	parm->parm.capture.timeperframe = ctx->timeperframe;
+	parm->parm.capture.readbuffers = ctx->read_buffers;
+
 	trace_exit();
 	return 0;
 }
 
-static int up3d_enum_framesizes(struct file *file, void *fh,
-				      struct v4l2_frmsizeenum *fsize)
+/* 设置帧率：选取当前分辨率下支持的最接近的帧间隔，并回填实际值 */
+static int up3d_s_parm(struct file *file, void *fh, struct v4l2_streamparm *parm)
 {
-	int index = 0;
-	struct up3d_video_ctx *ctx = video_drvdata(file);
-	
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+
 	trace_in();
-	
-	UP3D_DEBUG("index:%d fsize->pixel_format:0x%x type:0x%x", 
-			fsize->index, fsize->pixel_format, fsize->type);
 
-	for(index=0; index<ctx->fmt_lists_cnt; index++)
-	{
-		if(fsize->pixel_format == ctx->fmt_lists[index].pixel_format)
-			break;
-	}
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE && parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+		return -EINVAL;
+
+	up3d_frame_clock_set_interval(ctx, up3d_nearest_interval(ctx->cur_v4l2_format.fmt.pix.width, 
+				ctx->cur_v4l2_format.fmt.pix.height, &parm->parm.capture.timeperframe));
 
-	if(index >= ctx->fmt_lists_cnt)
+	trace_exit();
+	return up3d_g_parm(file, fh, parm);
+}
+
+/* 列出一个格式支持的分辨率：离散格式每项一个分辨率，其余格式只有一项步进范围 */
+int up3d_framesizes(struct up3d_video_ctx *ctx, struct v4l2_frmsizeenum *fsize)
+{
+	struct up3d_fmtdesc *fmt;
+
+	fmt = up3d_find_fmt(ctx, fsize->pixel_format);
+	if(!fmt)
 	{
 		UP3D_DEBUG("index:%d ctx->fmt_lists_cnt:%d fsize->pixel_format:0x%x", 
 			fsize->index, ctx->fmt_lists_cnt, fsize->pixel_format);
 		return -EINVAL;
 	}
 
-	switch(ctx->fmt_lists[index].pixel_format)
-	{
-		case V4L2_PIX_FMT_RGB24:
-			if(fsize->index >= ARRAY_SIZE(rgb24_sizes))
-				return -EINVAL;
-			fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;	// 这个用于区分联合体的类型 discrete、stepwise
-			fsize->discrete = rgb24_sizes[fsize->index];	// c99支持这种结构体赋值方式
-			break;
-		case V4L2_PIX_FMT_RGB565:
-		case V4L2_PIX_FMT_YUYV:
-			if (fsize->index > 0)	// 目前每种格式只支持一种分辨率
-				return -EINVAL;
-			fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;	// 这个用于区分联合体的类型 discrete、stepwise
-			fsize->discrete.width = ctx->fmt_lists[index].framesize.width;
-			fsize->discrete.height = ctx->fmt_lists[index].framesize.height;
-			break;
-		default:
+	if (fmt->sizes) {
+		if(fsize->index >= fmt->sizes_cnt)
 			return -EINVAL;
-			break;
+		fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;	// 这个用于区分联合体的类型 discrete、stepwise
+		fsize->discrete = fmt->sizes[fsize->index];	// c99支持这种结构体赋值方式
+	} else {
+		if (fsize->index > 0)	// 步进范围只有一项
+			return -EINVAL;
+		fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+		fsize->stepwise.min_width = WIDTH_MIN;
+		fsize->stepwise.max_width = ctx->width_max;
+		fsize->stepwise.step_width = 1 << WIDTH_ALIGN;
+		fsize->stepwise.min_height = HEIGHT_MIN;
+		fsize->stepwise.max_height = ctx->height_max;
+		fsize->stepwise.step_height = 1 << fmt->height_align;
 	}
 
+	return 0;
+}
+UP3D_EXPORT_FOR_TESTS(up3d_framesizes);
+
+static int up3d_enum_framesizes(struct file *file, void *fh,
+				      struct v4l2_frmsizeenum *fsize)
+{
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+	int ret;
+	
+	trace_in();
+	
+	UP3D_DEBUG("index:%d fsize->pixel_format:0x%x type:0x%x", 
+			fsize->index, fsize->pixel_format, fsize->type);
+
+	ret = up3d_framesizes(ctx, fsize);
+
 	trace_exit();
 
-	return 0;
+	return ret;
 }
 
 struct v4l2_ioctl_ops up3d_v4l2_ioctl_ops =
@@ -210,6 +533,10 @@ struct v4l2_ioctl_ops up3d_v4l2_ioctl_ops =
     .vidioc_g_fmt_vid_cap     = up3d_g_fmt_vid_cap,
     .vidioc_try_fmt_vid_cap   = up3d_try_fmt_vid_cap,
     .vidioc_s_fmt_vid_cap     = up3d_s_fmt_vid_cap,
+	/* 多平面节点，枚举仍然走vidioc_enum_fmt_vid_cap */
+    .vidioc_g_fmt_vid_cap_mplane	= up3d_g_fmt_vid_cap_mplane,
+    .vidioc_try_fmt_vid_cap_mplane	= up3d_try_fmt_vid_cap_mplane,
+    .vidioc_s_fmt_vid_cap_mplane	= up3d_s_fmt_vid_cap_mplane,
     
     /* 缓冲区操作: 申请/查询/放入队列/取出队列 使用videobuffer2提供的函数 */
 	.vidioc_reqbufs			= vb2_ioctl_reqbufs,
@@ -232,6 +559,99 @@ struct v4l2_ioctl_ops up3d_v4l2_ioctl_ops =
 	.vidioc_enum_input		= up3d_enum_input,
 	.vidioc_g_input			= up3d_g_input,
 	.vidioc_s_input			= up3d_s_input,
-	// .vidioc_enum_frameintervals = up3d_enum_frameintervals,		// 枚举特定格式下的帧率
+	.vidioc_enum_frameintervals = up3d_enum_frameintervals,		// 枚举特定格式、分辨率下的帧率
 	.vidioc_enum_framesizes = up3d_enum_framesizes, 			// 枚举特定格式下的
+
+	/* 帧率 */
+	.vidioc_g_parm			= up3d_g_parm,
+	.vidioc_s_parm			= up3d_s_parm,
+};
+
+/**
+ * 回环输出节点：格式、分辨率和帧间隔与采集节点共用同一份，任何一边设置都对两边生效，
+ * 输出的帧按帧时钟的节拍被消耗。
+ */
+static int up3d_g_fmt_vid_out(struct file *file, void *fh, struct v4l2_format *f)
+{
+	up3d_g_fmt_vid_cap(file, fh, f);
+	f->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	return 0;
+}
+
+static int up3d_enum_output(struct file *file, void *fh, struct v4l2_output *out)
+{
+	if (out->index > 0)
+		return -EINVAL;
+
+	out->type = V4L2_OUTPUT_TYPE_ANALOG;
+	strscpy(out->name, "Loopback", sizeof(out->name));
+	return 0;
+}
+
+static int up3d_g_output(struct file *file, void *fh, unsigned int *i)
+{
+	*i = 0;
+	return 0;
+}
+
+static int up3d_s_output(struct file *file, void *fh, unsigned int i)
+{
+	return i > 0 ? -EINVAL : 0;
+}
+
+static int up3d_g_parm_out(struct file *file, void *fh, struct v4l2_streamparm *parm)
+{
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_OUTPUT && parm->type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return -EINVAL;
+
+	parm->parm.output.capability = V4L2_CAP_TIMEPERFRAME;
+	parm->parm.output.timeperframe = ctx->timeperframe;
+	return 0;
+}
+
+static int up3d_s_parm_out(struct file *file, void *fh, struct v4l2_streamparm *parm)
+{
+	struct up3d_video_ctx *ctx = up3d_file_ctx(file);
+
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_OUTPUT && parm->type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return -EINVAL;
+
+	up3d_frame_clock_set_interval(ctx, up3d_nearest_interval(ctx->cur_v4l2_format.fmt.pix.width, 
+				ctx->cur_v4l2_format.fmt.pix.height, &parm->parm.output.timeperframe));
+
+	return up3d_g_parm_out(file, fh, parm);
+}
+
+const struct v4l2_ioctl_ops up3d_loop_ioctl_ops =
+{
+	.vidioc_querycap				= up3d_querycap,
+
+	/* 与采集节点相同的格式，多平面的G/TRY/S_FMT不涉及缓冲区类型，直接共用 */
+	.vidioc_enum_fmt_vid_out		= up3d_enum_fmt_vid_cap,
+	.vidioc_g_fmt_vid_out			= up3d_g_fmt_vid_out,
+	.vidioc_try_fmt_vid_out			= up3d_try_fmt_vid_cap,
+	.vidioc_s_fmt_vid_out			= up3d_s_fmt_vid_cap,
+	.vidioc_g_fmt_vid_out_mplane	= up3d_g_fmt_vid_cap_mplane,
+	.vidioc_try_fmt_vid_out_mplane	= up3d_try_fmt_vid_cap_mplane,
+	.vidioc_s_fmt_vid_out_mplane	= up3d_s_fmt_vid_cap_mplane,
+
+	.vidioc_reqbufs					= vb2_ioctl_reqbufs,
+	.vidioc_create_bufs				= vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf				= vb2_ioctl_prepare_buf,
+	.vidioc_querybuf				= vb2_ioctl_querybuf,
+	.vidioc_qbuf					= vb2_ioctl_qbuf,
+	.vidioc_dqbuf					= vb2_ioctl_dqbuf,
+	.vidioc_expbuf					= vb2_ioctl_expbuf,
+	.vidioc_streamon				= vb2_ioctl_streamon,
+	.vidioc_streamoff				= vb2_ioctl_streamoff,
+
+	.vidioc_enum_output				= up3d_enum_output,
+	.vidioc_g_output				= up3d_g_output,
+	.vidioc_s_output				= up3d_s_output,
+	.vidioc_enum_framesizes			= up3d_enum_framesizes,
+	.vidioc_enum_frameintervals		= up3d_enum_frameintervals,
+	.vidioc_g_parm					= up3d_g_parm_out,
+	.vidioc_s_parm					= up3d_s_parm_out,
 };
@@ -3,5 +3,13 @@
 
 #include <media/v4l2-ioctl.h>
 extern struct v4l2_ioctl_ops up3d_v4l2_ioctl_ops;
+extern const struct v4l2_ioctl_ops up3d_loop_ioctl_ops;
+
+struct up3d_video_ctx;
+struct up3d_frame_layout;
+extern int up3d_querycap(struct file *file, void *fh, struct v4l2_capability *cap);
+extern int up3d_try_fmt(struct up3d_video_ctx *ctx, struct v4l2_pix_format *pix,
+						struct up3d_frame_layout *layout);
+extern int up3d_framesizes(struct up3d_video_ctx *ctx, struct v4l2_frmsizeenum *fsize);
 
 #endif /*__UP3D_IOCTL_H__*/
\ No newline at end of file
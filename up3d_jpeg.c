@@ -0,0 +1,460 @@
+#include "up3d_jpeg.h"
+#include "up3d.h"
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+
+/**
+ * 每个块最多8个非零系数：DC(码长≤11加11位幅值)和7个AC(码长≤16加10位幅值)，
+ * 再加一个ZRL和EOB，不超过28字节，0xFF填充字节最多翻倍，按64字节估算。
+ */
+#define JPEG_BLOCK_MAX		64
+#define JPEG_BLOCKS_PER_MCU	4		// Y0 Y1 Cb Cr
+
+/* 标准量化表(ITU-T T.81 附录K)，自然顺序 */
+static const u8 std_quant[2][64] = {
+	{
+		16,  11,  10,  16,  24,  40,  51,  61,
+		12,  12,  14,  19,  26,  58,  60,  55,
+		14,  13,  16,  24,  40,  57,  69,  56,
+		14,  17,  22,  29,  51,  87,  80,  62,
+		18,  22,  37,  56,  68, 109, 103,  77,
+		24,  35,  55,  64,  81, 104, 113,  92,
+		49,  64,  78,  87, 103, 121, 120, 101,
+		72,  92,  95,  98, 112, 100, 103,  99,
+	},
+	{
+		17,  18,  24,  47,  99,  99,  99,  99,
+		18,  21,  26,  66,  99,  99,  99,  99,
+		24,  26,  56,  99,  99,  99,  99,  99,
+		47,  66,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+	},
+};
+
+/* 之字形扫描第k个系数在自然顺序中的位置 */
+static const u8 zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* 第一行系数(u,0)在之字形扫描中的位置 */
+static const u8 row0_zigzag[8] = { 0, 1, 5, 6, 14, 15, 27, 28 };
+
+/**
+ * 垂直方向不变的8x8块：F(u,0) = k(u) * Σx f(x) * cos((2x+1)uπ/16)，
+ * k(0)=1，k(u)=√2，乘以4096
+ */
+static const s16 dct_row[8][8] = {
+	{  4096,  4096,  4096,  4096,  4096,  4096,  4096,  4096 },
+	{  5681,  4816,  3218,  1130, -1130, -3218, -4816, -5681 },
+	{  5352,  2217, -2217, -5352, -5352, -2217,  2217,  5352 },
+	{  4816, -1130, -5681, -3218,  3218,  5681,  1130, -4816 },
+	{  4096, -4096, -4096,  4096,  4096, -4096, -4096,  4096 },
+	{  3218, -5681,  1130,  4816, -4816, -1130,  5681, -3218 },
+	{  2217, -5352,  5352, -2217, -2217,  5352, -5352,  2217 },
+	{  1130, -3218,  4816, -5681,  5681, -4816,  3218, -1130 },
+};
+
+/* 标准Huffman表(ITU-T T.81 附录K.3)：每种码长的码字个数和符号 */
+static const u8 dc_bits[2][16] = {
+	{ 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+};
+
+static const u8 dc_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const u8 ac_bits[2][16] = {
+	{ 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+	{ 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+};
+
+static const u8 ac_vals[2][162] = {
+	{
+		0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+		0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+		0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+		0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+		0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+		0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+		0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+		0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+		0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+		0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+		0xf9, 0xfa,
+	},
+	{
+		0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+		0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+		0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+		0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+		0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+		0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+		0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+		0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+		0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+		0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+		0xf9, 0xfa,
+	},
+};
+
+/* 熵编码输出，自动插入0xFF后的填充字节 */
+struct up3d_jpeg_bits {
+	u8		*buf;
+	u32		pos;
+	u32		cap;
+	u32		acc;
+	int		nbits;
+	bool	overflow;
+};
+
+static inline void up3d_jpeg_put_byte(struct up3d_jpeg_bits *bw, u8 byte)
+{
+	if (bw->pos + 2 > bw->cap) {
+		bw->overflow = true;
+		return;
+	}
+	bw->buf[bw->pos++] = byte;
+	if (byte == 0xff)
+		bw->buf[bw->pos++] = 0;
+}
+
+static inline void up3d_jpeg_put_bits(struct up3d_jpeg_bits *bw, u32 code, int len)
+{
+	bw->acc = (bw->acc << len) | (code & ((1U << len) - 1));
+	bw->nbits += len;
+	while (bw->nbits >= 8) {
+		bw->nbits -= 8;
+		up3d_jpeg_put_byte(bw, bw->acc >> bw->nbits);
+	}
+	bw->acc &= (1U << bw->nbits) - 1;
+}
+
+/* 段结束：不足一个字节的部分用1填充 */
+static void up3d_jpeg_flush_bits(struct up3d_jpeg_bits *bw)
+{
+	if (bw->nbits)
+		up3d_jpeg_put_bits(bw, 0x7f, 8 - bw->nbits);
+}
+
+/* 按码长表生成每个符号的码字(T.81 附录C) */
+static void up3d_jpeg_build_huff(struct up3d_jpeg_huff *h, const u8 *bits, const u8 *vals)
+{
+	u32 code = 0, k = 0;
+	int len, i;
+
+	memset(h, 0, sizeof(*h));
+	for (len = 1; len <= 16; len++) {
+		for (i = 0; i < bits[len - 1]; i++) {
+			h->code[vals[k]] = code++;
+			h->size[vals[k]] = len;
+			k++;
+		}
+		code <<= 1;
+	}
+}
+
+/* 幅值类别：表示|v|所需的位数 */
+static inline int up3d_jpeg_category(int v)
+{
+	return v ? fls(abs(v)) : 0;
+}
+
+static inline void up3d_jpeg_put_value(struct up3d_jpeg_bits *bw, int v, int cat)
+{
+	// 负数写v-1的低cat位
+	if (cat)
+		up3d_jpeg_put_bits(bw, v < 0 ? v - 1 : v, cat);
+}
+
+/**
+ * 编码一个垂直方向不变的块：samples是一行8个已减128的采样值，
+ * *pred为该分量上一个块的DC，comp为0表示亮度，1表示色度
+ */
+static void up3d_jpeg_encode_block(struct up3d_jpeg *jpg, struct up3d_jpeg_bits *bw,
+						const int *samples, int *pred, int comp)
+{
+	const struct up3d_jpeg_huff *dc = &jpg->dc[comp], *ac = &jpg->ac[comp];
+	int coef[8];
+	int u, x, q, sum, diff, cat, run, k, last;
+
+	for (u = 0; u < 8; u++) {
+		sum = 0;
+		for (x = 0; x < 8; x++)
+			sum += samples[x] * dct_row[u][x];
+		sum = DIV_ROUND_CLOSEST(sum, 4096);
+
+		q = jpg->quant[comp][u];
+		coef[u] = clamp(DIV_ROUND_CLOSEST(sum, q), u ? -1023 : -2047, u ? 1023 : 2047);
+	}
+
+	diff = clamp(coef[0] - *pred, -2047, 2047);
+	*pred = coef[0];
+	cat = up3d_jpeg_category(diff);
+	up3d_jpeg_put_bits(bw, dc->code[cat], dc->size[cat]);
+	up3d_jpeg_put_value(bw, diff, cat);
+
+	// 只有第一行系数可能非零，它们在之字形扫描中的位置相隔较远，游程超过15时先写ZRL
+	for (last = 7; last > 0 && !coef[last]; last--)
+		;
+	for (u = 1, k = 0; u <= last; u++) {
+		if (!coef[u])
+			continue;
+		run = row0_zigzag[u] - k - 1;
+		k = row0_zigzag[u];
+		for (; run > 15; run -= 16)
+			up3d_jpeg_put_bits(bw, ac->code[0xf0], ac->size[0xf0]);
+		cat = up3d_jpeg_category(coef[u]);
+		up3d_jpeg_put_bits(bw, ac->code[(run << 4) | cat], ac->size[(run << 4) | cat]);
+		up3d_jpeg_put_value(bw, coef[u], cat);
+	}
+	if (k != 63)
+		up3d_jpeg_put_bits(bw, ac->code[0x00], ac->size[0x00]);	// EOB
+}
+
+/* JFIF全范围YCbCr */
+static inline int up3d_jpeg_y(u32 rgb)
+{
+	return (19595 * (rgb >> 16 & 0xff) + 38470 * (rgb >> 8 & 0xff) + 7471 * (rgb & 0xff) + 32768) >> 16;
+}
+
+static inline int up3d_jpeg_cb(u32 r, u32 g, u32 b)
+{
+	return (-11059 * (int)r - 21709 * (int)g + 32768 * (int)b + (128 << 16) + 32768) >> 16;
+}
+
+static inline int up3d_jpeg_cr(u32 r, u32 g, u32 b)
+{
+	return (32768 * (int)r - 27439 * (int)g - 5329 * (int)b + (128 << 16) + 32768) >> 16;
+}
+
+/**
+ * 编码一个MCU行，这一行的8行像素都是rgb，前overlay_len个像素取overlay。
+ * 超出宽度的部分重复最后一个像素。在生产线程中调用，不睡眠。
+ */
+int up3d_jpeg_encode_row(struct up3d_jpeg *jpg, enum up3d_jpeg_row row, const u32 *rgb,
+						const u32 *overlay, u32 overlay_len)
+{
+	struct up3d_jpeg_bits bw = {
+		.buf = jpg->seg[row],
+		.cap = jpg->seg_max,
+	};
+	int y[UP3D_JPEG_MCU_WIDTH], cb[8], cr[8];
+	int pred[3] = { 0 };
+	u32 mcu, i, x, r, g, b, c[2];
+
+	for (mcu = 0; mcu < jpg->mcus; mcu++) {
+		for (i = 0; i < UP3D_JPEG_MCU_WIDTH; i++) {
+			x = min(mcu * UP3D_JPEG_MCU_WIDTH + i, jpg->width - 1);
+			c[i & 1] = x < overlay_len ? overlay[x] : rgb[x];
+			y[i] = up3d_jpeg_y(c[i & 1]) - 128;
+
+			// 色度水平方向2:1下采样，取相邻两个像素的平均
+			if (i & 1) {
+				r = ((c[0] >> 16 & 0xff) + (c[1] >> 16 & 0xff)) / 2;
+				g = ((c[0] >> 8 & 0xff) + (c[1] >> 8 & 0xff)) / 2;
+				b = ((c[0] & 0xff) + (c[1] & 0xff)) / 2;
+				cb[i / 2] = up3d_jpeg_cb(r, g, b) - 128;
+				cr[i / 2] = up3d_jpeg_cr(r, g, b) - 128;
+			}
+		}
+
+		up3d_jpeg_encode_block(jpg, &bw, &y[0], &pred[0], 0);
+		up3d_jpeg_encode_block(jpg, &bw, &y[8], &pred[0], 0);
+		up3d_jpeg_encode_block(jpg, &bw, cb, &pred[1], 1);
+		up3d_jpeg_encode_block(jpg, &bw, cr, &pred[2], 1);
+	}
+	up3d_jpeg_flush_bits(&bw);
+
+	if (bw.overflow) {
+		jpg->seg_len[row] = 0;
+		return -ENOSPC;
+	}
+
+	jpg->seg_len[row] = bw.pos;
+	return 0;
+}
+
+static u8 *up3d_jpeg_put16(u8 *p, u16 v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+/* SOI、APP0(JFIF)、DQT、SOF0、DHT、DRI、SOS，格式确定后每帧都相同 */
+static void up3d_jpeg_write_header(struct up3d_jpeg *jpg)
+{
+	static const u8 jfif[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+	u8 *p = jpg->header;
+	int t, k, n;
+
+	p = up3d_jpeg_put16(p, 0xffd8);
+
+	p = up3d_jpeg_put16(p, 0xffe0);
+	p = up3d_jpeg_put16(p, 2 + sizeof(jfif));
+	memcpy(p, jfif, sizeof(jfif));
+	p += sizeof(jfif);
+
+	// 量化表按之字形顺序写入
+	p = up3d_jpeg_put16(p, 0xffdb);
+	p = up3d_jpeg_put16(p, 2 + 2 * 65);
+	for (t = 0; t < 2; t++) {
+		*p++ = t;
+		for (k = 0; k < 64; k++)
+			*p++ = jpg->quant[t][zigzag[k]];
+	}
+
+	// Y的采样因子为2x1，Cb、Cr为1x1，即4:2:2
+	p = up3d_jpeg_put16(p, 0xffc0);
+	p = up3d_jpeg_put16(p, 17);
+	*p++ = 8;
+	p = up3d_jpeg_put16(p, jpg->height);
+	p = up3d_jpeg_put16(p, jpg->width);
+	*p++ = 3;
+	*p++ = 1; *p++ = 0x21; *p++ = 0;
+	*p++ = 2; *p++ = 0x11; *p++ = 1;
+	*p++ = 3; *p++ = 0x11; *p++ = 1;
+
+	p = up3d_jpeg_put16(p, 0xffc4);
+	p = up3d_jpeg_put16(p, 2 + 2 * (17 + sizeof(dc_vals)) + 2 * (17 + sizeof(ac_vals[0])));
+	for (t = 0; t < 2; t++) {
+		*p++ = 0x00 | t;
+		memcpy(p, dc_bits[t], 16);
+		p += 16;
+		for (k = 0, n = 0; k < 16; k++)
+			n += dc_bits[t][k];
+		memcpy(p, dc_vals, n);
+		p += n;
+
+		*p++ = 0x10 | t;
+		memcpy(p, ac_bits[t], 16);
+		p += 16;
+		for (k = 0, n = 0; k < 16; k++)
+			n += ac_bits[t][k];
+		memcpy(p, ac_vals[t], n);
+		p += n;
+	}
+
+	// 每个MCU行一个重启间隔
+	p = up3d_jpeg_put16(p, 0xffdd);
+	p = up3d_jpeg_put16(p, 4);
+	p = up3d_jpeg_put16(p, jpg->mcus);
+
+	p = up3d_jpeg_put16(p, 0xffda);
+	p = up3d_jpeg_put16(p, 12);
+	*p++ = 3;
+	*p++ = 1; *p++ = 0x00;
+	*p++ = 2; *p++ = 0x11;
+	*p++ = 3; *p++ = 0x11;
+	*p++ = 0; *p++ = 63; *p++ = 0;
+
+	jpg->header_len = p - jpg->header;
+}
+
+/* 一帧编码后的最大长度，用作sizeimage */
+unsigned long up3d_jpeg_max_size(u32 width, u32 height)
+{
+	unsigned long mcus = DIV_ROUND_UP(width, UP3D_JPEG_MCU_WIDTH);
+	unsigned long rows = DIV_ROUND_UP(height, UP3D_JPEG_MCU_HEIGHT);
+
+	// 每个MCU行后跟一个2字节的RST标记，最后是EOI
+	return UP3D_JPEG_HEADER_MAX + rows * (mcus * JPEG_BLOCKS_PER_MCU * JPEG_BLOCK_MAX + 2) + 2;
+}
+UP3D_EXPORT_FOR_TESTS(up3d_jpeg_max_size);
+
+/**
+ * 按分辨率创建编码器，在开始采集时调用(可睡眠)
+ */
+struct up3d_jpeg *up3d_jpeg_create(u32 width, u32 height)
+{
+	struct up3d_jpeg *jpg;
+	int scale = UP3D_JPEG_QUALITY < 50 ? 5000 / UP3D_JPEG_QUALITY : 200 - 2 * UP3D_JPEG_QUALITY;
+	int t, k, r;
+
+	if (!width || !height || width > 0xffff || height > 0xffff)
+		return NULL;
+
+	jpg = kzalloc(sizeof(*jpg), GFP_KERNEL);
+	if (!jpg)
+		return NULL;
+
+	jpg->width = width;
+	jpg->height = height;
+	jpg->mcus = DIV_ROUND_UP(width, UP3D_JPEG_MCU_WIDTH);
+	jpg->rows = DIV_ROUND_UP(height, UP3D_JPEG_MCU_HEIGHT);
+	jpg->seg_max = jpg->mcus * JPEG_BLOCKS_PER_MCU * JPEG_BLOCK_MAX;
+
+	for (r = 0; r < UP3D_JPEG_ROW_CNT; r++) {
+		jpg->seg[r] = kvmalloc(jpg->seg_max, GFP_KERNEL);
+		if (!jpg->seg[r]) {
+			up3d_jpeg_destroy(jpg);
+			return NULL;
+		}
+	}
+
+	for (t = 0; t < 2; t++) {
+		for (k = 0; k < 64; k++)
+			jpg->quant[t][k] = clamp((std_quant[t][k] * scale + 50) / 100, 1, 255);
+		up3d_jpeg_build_huff(&jpg->dc[t], dc_bits[t], dc_vals);
+		up3d_jpeg_build_huff(&jpg->ac[t], ac_bits[t], ac_vals[t]);
+	}
+
+	up3d_jpeg_write_header(jpg);
+	return jpg;
+}
+
+void up3d_jpeg_destroy(struct up3d_jpeg *jpg)
+{
+	int r;
+
+	if (!jpg)
+		return;
+
+	for (r = 0; r < UP3D_JPEG_ROW_CNT; r++)
+		kvfree(jpg->seg[r]);
+	kfree(jpg);
+}
+
+/**
+ * 组装一帧：头部 + 每个MCU行的编码数据(行间插入RST0~RST7) + EOI。
+ * overlay为真时第一个MCU行使用叠加行。返回帧长度，dst放不下时返回0。
+ */
+unsigned long up3d_jpeg_assemble(struct up3d_jpeg *jpg, void *dst, unsigned long size, bool overlay)
+{
+	u8 *p = dst;
+	unsigned long len;
+	u32 r, seg;
+
+	len = jpg->header_len + 2;
+	for (r = 0; r < jpg->rows; r++) {
+		seg = (r == 0 && overlay) ? UP3D_JPEG_ROW_OVERLAY : UP3D_JPEG_ROW_PLAIN;
+		if (!jpg->seg_len[seg])
+			return 0;
+		len += jpg->seg_len[seg] + (r + 1 < jpg->rows ? 2 : 0);
+	}
+	if (len > size)
+		return 0;
+
+	memcpy(p, jpg->header, jpg->header_len);
+	p += jpg->header_len;
+	for (r = 0; r < jpg->rows; r++) {
+		seg = (r == 0 && overlay) ? UP3D_JPEG_ROW_OVERLAY : UP3D_JPEG_ROW_PLAIN;
+		memcpy(p, jpg->seg[seg], jpg->seg_len[seg]);
+		p += jpg->seg_len[seg];
+		if (r + 1 < jpg->rows) {
+			*p++ = 0xff;
+			*p++ = 0xd0 + (r & 7);
+		}
+	}
+	*p++ = 0xff;
+	*p++ = 0xd9;
+
+	return len;
+}
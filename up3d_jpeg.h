@@ -0,0 +1,56 @@
+#ifndef __UP3D_JPEG_H__
+#define __UP3D_JPEG_H__
+
+#include <linux/types.h>
+
+/**
+ * 测试图案的基线JPEG编码器(YCbCr 4:2:2，MCU为16x8)。
+ * 图案每一行都相同，只有左上角的叠加区域不同，因此每个MCU行的8行像素也都相同：
+ * 每个8x8块只有第一行DCT系数非零，一维DCT就够了。
+ * 码流按MCU行设置重启间隔(DRI)，每个MCU行是一段独立的熵编码数据，
+ * 内容相同的MCU行只编码一次，组装一帧时逐段复制，中间插入RSTn标记。
+ */
+#define UP3D_JPEG_MCU_WIDTH		16
+#define UP3D_JPEG_MCU_HEIGHT	8
+#define UP3D_JPEG_QUALITY		85		// IJG质量系数
+#define UP3D_JPEG_HEADER_MAX	1024
+
+// 预编码的MCU行
+enum up3d_jpeg_row {
+	UP3D_JPEG_ROW_PLAIN = 0,		// 图案行
+	UP3D_JPEG_ROW_OVERLAY,			// 叠加了帧序号/时间戳方块的第一个MCU行
+	UP3D_JPEG_ROW_CNT,
+};
+
+struct up3d_jpeg_huff {
+	u16		code[256];
+	u8		size[256];
+};
+
+struct up3d_jpeg {
+	u32		width;
+	u32		height;
+	u32		mcus;				// 每个MCU行的MCU数
+	u32		rows;				// MCU行数
+
+	u8		quant[2][64];		// 亮度、色度量化表，自然顺序
+	struct up3d_jpeg_huff	dc[2];
+	struct up3d_jpeg_huff	ac[2];
+
+	u8		header[UP3D_JPEG_HEADER_MAX];	// SOI到SOS
+	u32		header_len;
+
+	u8		*seg[UP3D_JPEG_ROW_CNT];		// 每种MCU行的熵编码数据，不含RST标记
+	u32		seg_len[UP3D_JPEG_ROW_CNT];
+	u32		seg_max;
+};
+
+extern unsigned long up3d_jpeg_max_size(u32 width, u32 height);
+extern struct up3d_jpeg *up3d_jpeg_create(u32 width, u32 height);
+extern void up3d_jpeg_destroy(struct up3d_jpeg *jpg);
+extern int up3d_jpeg_encode_row(struct up3d_jpeg *jpg, enum up3d_jpeg_row row, const u32 *rgb,
+						const u32 *overlay, u32 overlay_len);
+extern unsigned long up3d_jpeg_assemble(struct up3d_jpeg *jpg, void *dst, unsigned long size,
+						bool overlay);
+
+#endif /*__UP3D_JPEG_H__*/
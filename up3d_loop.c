@@ -0,0 +1,121 @@
+#include "up3d_loop.h"
+#include "up3d_vb2ops.h"
+#include "up3d_v4l2_fops.h"
+#include "up3d.h"
+
+#include <media/v4l2-ioctl.h>
+
+/**
+ * 回环输出节点：使用者写入的帧在帧时钟节拍上依次交给所有正在采集的节点，代替测试图案。
+ * 采集缓冲区与输出缓冲区引用同一块内存(两边导入同一个DMABUF，或采集节点导入
+ * 输出节点VIDIOC_EXPBUF导出的DMABUF)时直接完成，不拷贝；否则每个采集节点拷贝一次。
+ * 节拍到达时输出队列为空则这个节拍不产生帧，序号只随交付的帧增加。
+ * 输出缓冲区在采集节点的缓冲区都写好之后返还给使用者，时间戳保留使用者填写的值。
+ */
+
+static int up3d_loop_buf_prepare(struct vb2_buffer *vb)
+{
+	struct up3d_stream *stream = vb2_get_drv_priv(vb->vb2_queue);
+	struct up3d_video_ctx *ctx = stream->ctx;
+	unsigned int p;
+
+	if (vb->num_planes != ctx->layout.mem_planes) {
+		dev_err(ctx->dev, "%s buffer has %u planes, format needs %u\n",
+			__func__, vb->num_planes, ctx->layout.mem_planes);
+		return -EINVAL;
+	}
+
+	for (p = 0; p < vb->num_planes; p++) {
+		// 采集节点按自己的格式检查缓冲区大小，有效数据不能超过一帧
+		if (vb2_get_plane_payload(vb, p) > ctx->layout.sizeimage[p]) {
+			dev_err(ctx->dev, "%s plane %u carries %lu bytes, more than a frame (%u)\n",
+				__func__, p, vb2_get_plane_payload(vb, p), ctx->layout.sizeimage[p]);
+			return -EINVAL;
+		}
+
+		// 不共享内存的采集节点要从这里拷贝
+		if (!vb2_plane_vaddr(vb, p)) {
+			dev_err(ctx->dev, "%s buffer %u plane %u has no kernel mapping\n",
+				__func__, vb->index, p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static void up3d_loop_buf_queue(struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct up3d_vb2_buf *buf = container_of(vbuf, struct up3d_vb2_buf, vb);
+	struct up3d_stream *stream = vb2_get_drv_priv(vb->vb2_queue);
+
+	trace_up3d_buf_queue(stream->ctx->inst, stream->index, vb->index, vbuf->sequence);
+	buf->qbuf_ns = ktime_get_ns();
+	up3d_handoff_put(stream, buf);
+}
+
+static int up3d_loop_start_streaming(struct vb2_queue *q, unsigned int count)
+{
+	struct up3d_stream *stream = vb2_get_drv_priv(q);
+	struct up3d_video_ctx *ctx = stream->ctx;
+	int ret;
+
+	ret = up3d_streaming_get(ctx);
+	if (ret < 0) {
+		up3d_return_all_buffers(stream, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	mutex_lock(&ctx->frame_lock);
+	stream->streaming = true;
+	mutex_unlock(&ctx->frame_lock);
+
+	return 0;
+}
+
+static void up3d_loop_stop_streaming(struct vb2_queue *q)
+{
+	struct up3d_stream *stream = vb2_get_drv_priv(q);
+	struct up3d_video_ctx *ctx = stream->ctx;
+
+	// 等待正在生产的帧完成，之后生产线程不会再取输出缓冲区
+	mutex_lock(&ctx->frame_lock);
+	stream->streaming = false;
+	mutex_unlock(&ctx->frame_lock);
+
+	up3d_return_all_buffers(stream, VB2_BUF_STATE_ERROR);
+	up3d_streaming_put(ctx);
+}
+
+static const struct vb2_ops up3d_loop_vb2_ops = {
+	.queue_setup		= up3d_queue_setup,
+	.buf_prepare		= up3d_loop_buf_prepare,
+	.buf_queue			= up3d_loop_buf_queue,
+	.start_streaming	= up3d_loop_start_streaming,
+	.stop_streaming		= up3d_loop_stop_streaming,
+	UP3D_VB2_WAIT_OPS
+};
+
+/* 初始化回环输出节点的缓冲队列，分配器与采集节点相同，导出的DMABUF可以直接被采集节点导入 */
+int up3d_loop_queue_init(struct up3d_stream *stream)
+{
+	struct up3d_video_ctx *ctx = stream->ctx;
+	struct vb2_queue *q = &stream->vb_queue;
+
+	q->type					= ctx->mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	q->io_modes				= VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
+	q->buf_struct_size		= sizeof(struct up3d_vb2_buf);
+	q->ops					= &up3d_loop_vb2_ops;
+	q->mem_ops				= up3d_vb_mem_ops(ctx);
+	q->dev					= ctx->dev;
+	q->timestamp_flags		= V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	up3d_vb2_min_queued(q)	= 1;
+	q->lock					= &ctx->mutex;
+	q->drv_priv				= stream;
+
+	spin_lock_init(&stream->vb_queue_lock);
+	INIT_LIST_HEAD(&stream->vb_queue_active);
+
+	return vb2_queue_init(q);
+}
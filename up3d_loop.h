@@ -0,0 +1,7 @@
+#ifndef __UP3D_LOOP_H__
+#define __UP3D_LOOP_H__
+
+struct up3d_stream;
+extern int up3d_loop_queue_init(struct up3d_stream *stream);
+
+#endif /*__UP3D_LOOP_H__*/
@@ -0,0 +1,181 @@
+#include "up3d_meta.h"
+#include "up3d_vb2ops.h"
+#include "up3d_ioctl.h"
+#include "up3d.h"
+
+#include <media/videobuf2-vmalloc.h>
+#include <media/v4l2-ioctl.h>
+
+/**
+ * 元数据节点：格式固定为V4L2_META_FMT_UP3D，每个缓冲区一条up3d_meta_record。
+ * 缓冲区由生产线程在生产每一帧时填写，节点开始采集时同样会启动帧时钟。
+ */
+
+static void up3d_meta_fill_fmt(struct v4l2_format *f)
+{
+	f->fmt.meta.dataformat = V4L2_META_FMT_UP3D;
+	f->fmt.meta.buffersize = sizeof(struct up3d_meta_record);
+}
+
+static int up3d_meta_enum_fmt(struct file *file, void *fh, struct v4l2_fmtdesc *f)
+{
+	if (f->index > 0)
+		return -EINVAL;
+
+	strscpy(f->description, "up3d frame metadata", sizeof(f->description));
+	f->pixelformat = V4L2_META_FMT_UP3D;
+	return 0;
+}
+
+/* 格式只有一种，G/S/TRY_FMT都返回它 */
+static int up3d_meta_g_fmt(struct file *file, void *fh, struct v4l2_format *f)
+{
+	up3d_meta_fill_fmt(f);
+	return 0;
+}
+
+const struct v4l2_ioctl_ops up3d_meta_ioctl_ops = {
+	.vidioc_querycap			= up3d_querycap,
+
+	.vidioc_enum_fmt_meta_cap	= up3d_meta_enum_fmt,
+	.vidioc_g_fmt_meta_cap		= up3d_meta_g_fmt,
+	.vidioc_try_fmt_meta_cap	= up3d_meta_g_fmt,
+	.vidioc_s_fmt_meta_cap		= up3d_meta_g_fmt,
+
+	.vidioc_reqbufs				= vb2_ioctl_reqbufs,
+	.vidioc_create_bufs			= vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf			= vb2_ioctl_prepare_buf,
+	.vidioc_querybuf			= vb2_ioctl_querybuf,
+	.vidioc_qbuf				= vb2_ioctl_qbuf,
+	.vidioc_dqbuf				= vb2_ioctl_dqbuf,
+	.vidioc_expbuf				= vb2_ioctl_expbuf,
+	.vidioc_streamon			= vb2_ioctl_streamon,
+	.vidioc_streamoff			= vb2_ioctl_streamoff,
+};
+
+static int up3d_meta_queue_setup(struct vb2_queue *q,
+			   unsigned int *num_buffers, unsigned int *num_planes,
+			   unsigned int sizes[], struct device *alloc_devs[])
+{
+	// VIDIOC_CREATE_BUFS指定了大小时只检查能否放下一条记录
+	if (*num_planes)
+		return sizes[0] < sizeof(struct up3d_meta_record) ? -EINVAL : 0;
+
+	*num_planes = 1;
+	sizes[0] = sizeof(struct up3d_meta_record);
+	return 0;
+}
+
+static int up3d_meta_buf_prepare(struct vb2_buffer *vb)
+{
+	if (vb2_plane_size(vb, 0) < sizeof(struct up3d_meta_record))
+		return -EINVAL;
+
+	vb2_set_plane_payload(vb, 0, sizeof(struct up3d_meta_record));
+	return 0;
+}
+
+static void up3d_meta_buf_queue(struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct up3d_vb2_buf *buf = container_of(vbuf, struct up3d_vb2_buf, vb);
+	struct up3d_stream *stream = vb2_get_drv_priv(vb->vb2_queue);
+
+	buf->qbuf_ns = ktime_get_ns();
+	up3d_handoff_put(stream, buf);
+}
+
+static int up3d_meta_start_streaming(struct vb2_queue *q, unsigned int count)
+{
+	struct up3d_stream *stream = vb2_get_drv_priv(q);
+	struct up3d_video_ctx *ctx = stream->ctx;
+	int ret, i;
+
+	ret = up3d_streaming_get(ctx);
+	if (ret < 0) {
+		up3d_return_all_buffers(stream, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	// 丢帧数从开始采集时算起
+	mutex_lock(&ctx->frame_lock);
+	ctx->meta_dropped = 0;
+	for (i = 0; i < ctx->stream_cnt; i++)
+		ctx->meta_dropped += ctx->streams[i].stats.dropped;
+	stream->streaming = true;
+	mutex_unlock(&ctx->frame_lock);
+
+	return 0;
+}
+
+static void up3d_meta_stop_streaming(struct vb2_queue *q)
+{
+	struct up3d_stream *stream = vb2_get_drv_priv(q);
+	struct up3d_video_ctx *ctx = stream->ctx;
+
+	mutex_lock(&ctx->frame_lock);
+	stream->streaming = false;
+	mutex_unlock(&ctx->frame_lock);
+
+	up3d_return_all_buffers(stream, VB2_BUF_STATE_ERROR);
+	up3d_streaming_put(ctx);
+}
+
+static const struct vb2_ops up3d_meta_vb2_ops = {
+	.queue_setup		= up3d_meta_queue_setup,
+	.buf_prepare		= up3d_meta_buf_prepare,
+	.buf_queue			= up3d_meta_buf_queue,
+	.start_streaming	= up3d_meta_start_streaming,
+	.stop_streaming		= up3d_meta_stop_streaming,
+	UP3D_VB2_WAIT_OPS
+};
+
+/* 初始化元数据节点的缓冲队列，记录很小，总是使用vmalloc */
+int up3d_meta_queue_init(struct up3d_stream *stream)
+{
+	struct up3d_video_ctx *ctx = stream->ctx;
+	struct vb2_queue *q = &stream->vb_queue;
+
+	q->type					= V4L2_BUF_TYPE_META_CAPTURE;
+	q->io_modes				= VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_READ;
+	q->buf_struct_size		= sizeof(struct up3d_vb2_buf);
+	q->ops					= &up3d_meta_vb2_ops;
+	q->mem_ops				= &vb2_vmalloc_memops;
+	q->dev					= ctx->dev;
+	q->timestamp_flags		= V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | up3d_tstamp_src_flag(ctx);
+	up3d_vb2_min_queued(q)	= 1;
+	q->lock					= &ctx->mutex;
+	q->drv_priv				= stream;
+
+	spin_lock_init(&stream->vb_queue_lock);
+	INIT_LIST_HEAD(&stream->vb_queue_active);
+
+	return vb2_queue_init(q);
+}
+
+/* 在生产线程中、持有frame_lock时调用：取一个缓冲区写入记录，没有空闲缓冲区时丢掉这条记录 */
+void up3d_meta_emit(struct up3d_video_ctx *ctx, const struct up3d_meta_record *rec, u64 timestamp)
+{
+	struct up3d_stream *stream = &ctx->meta;
+	struct up3d_vb2_buf *buf;
+	void *vaddr;
+
+	buf = up3d_handoff_take(stream);
+	if (!buf) {
+		stream->stats.dropped++;
+		return;
+	}
+
+	vaddr = vb2_plane_vaddr(&buf->vb.vb2_buf, 0);
+	if (!vaddr) {
+		vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_ERROR);
+		return;
+	}
+
+	memcpy(vaddr, rec, sizeof(*rec));
+	buf->vb.vb2_buf.timestamp = timestamp;
+	buf->vb.field = V4L2_FIELD_NONE;
+	buf->vb.sequence = rec->sequence;
+	stream->stats.delivered++;
+	vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+}
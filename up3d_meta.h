@@ -0,0 +1,46 @@
+#ifndef __UP3D_META_H__
+#define __UP3D_META_H__
+
+/**
+ * 元数据节点的数据格式，驱动和用户空间共用。
+ * 每个帧时钟节拍生产一次，输出一条记录，序号和时间戳与同一帧的视频缓冲区相同，
+ * 使用者按sequence把记录和帧对应起来。记录中的时间均为CLOCK_MONOTONIC纳秒，
+ * 与缓冲区时间戳使用的时钟(tstamp_clock)无关。
+ */
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+#define V4L2_META_FMT_UP3D		v4l2_fourcc('U', 'P', '3', 'M')
+
+#define UP3D_META_PATTERN_OVERLAY	(1 << 0)	// 左上角叠加了帧序号/时间戳
+#define UP3D_META_PATTERN_REPLAY	(1 << 1)	// 这一帧来自回放数据，不是测试图案
+#define UP3D_META_PATTERN_LOOPBACK	(1 << 2)	// 这一帧来自回环输出节点
+
+struct up3d_meta_record {
+	__u32	sequence;
+	__u32	ticks;			// 这一帧消耗的帧时钟节拍，大于1表示生产线程错过了节拍
+	__u64	deadline_ns;	// 帧时钟截止时间
+	__u64	fill_start_ns;	// 生产线程开始填充
+	__u64	fill_end_ns;	// 填充(含扇出拷贝)结束，tstamp_src=1时也是缓冲区的时间戳
+	__u32	producer_cpu;	// 生产线程所在的CPU
+	__u32	dropped;		// 上一条记录以来所有采集节点丢掉的帧数
+	__u32	delivered;		// 拿到这一帧的采集节点数
+	__u32	pixelformat;
+	__u32	width;
+	__u32	height;
+	__u16	pattern;		// 测试图案类型
+	__u16	pattern_flags;	// UP3D_META_PATTERN_*
+	__u32	pattern_color;	// 纯色图案的颜色，0xRRGGBB
+};
+
+#ifdef __KERNEL__
+#include <media/v4l2-ioctl.h>
+
+struct up3d_stream;
+struct up3d_video_ctx;
+extern const struct v4l2_ioctl_ops up3d_meta_ioctl_ops;
+extern int up3d_meta_queue_init(struct up3d_stream *stream);
+extern void up3d_meta_emit(struct up3d_video_ctx *ctx, const struct up3d_meta_record *rec, u64 timestamp);
+#endif
+
+#endif /*__UP3D_META_H__*/
@@ -0,0 +1,455 @@
+#include "up3d_pattern.h"
+#include "up3d_convert.h"
+#include "up3d.h"
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+// 基准测试每种格式、分辨率产生的帧数
+#define PATTERN_BENCH_FRAMES	30
+
+/* 75%彩条：白、黄、青、绿、品红、红、蓝、黑 */
+static const u32 colorbars[] = {
+	0xbfbfbf, 0xbfbf00, 0x00bfbf, 0x00bf00, 0xbf00bf, 0xbf0000, 0x0000bf, 0x000000,
+};
+
+/* 第一个分量平面(打包格式或亮度)每个像素的字节数，压缩格式返回0 */
+int up3d_pattern_bytes_per_pixel(u32 pixelformat)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_RGB24:
+		return 3;
+	case V4L2_PIX_FMT_RGB565:
+	case V4L2_PIX_FMT_YUYV:		// 两个像素共用4字节
+		return 2;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV16M:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YUV420M:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * 按像素格式计算一帧的布局。bytesperline是第一个分量平面的行跨度，
+ * 色度平面的行跨度按V4L2对这些格式的约定由它推出：NV12/NV16的UV平面与Y相同，
+ * YUV420的U、V平面为一半。
+ */
+int up3d_pattern_layout(u32 pixelformat, u32 width, u32 height, u32 bytesperline,
+						struct up3d_frame_layout *l)
+{
+	u32 c, vsub = 1, cbpl = bytesperline;
+
+	memset(l, 0, sizeof(*l));
+	l->pixelformat = pixelformat;
+	l->width = width;
+	l->height = height;
+
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_RGB565:
+	case V4L2_PIX_FMT_YUYV:
+		l->comp_planes = 1;
+		l->mem_planes = 1;
+		break;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV16:
+		l->comp_planes = 2;
+		l->mem_planes = 1;
+		vsub = pixelformat == V4L2_PIX_FMT_NV12 ? 2 : 1;
+		break;
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV16M:
+		l->comp_planes = 2;
+		l->mem_planes = 2;
+		vsub = pixelformat == V4L2_PIX_FMT_NV12M ? 2 : 1;
+		break;
+	case V4L2_PIX_FMT_YUV420:
+		l->comp_planes = 3;
+		l->mem_planes = 1;
+		vsub = 2;
+		cbpl = bytesperline / 2;
+		break;
+	case V4L2_PIX_FMT_YUV420M:
+		l->comp_planes = 3;
+		l->mem_planes = 3;
+		vsub = 2;
+		cbpl = bytesperline / 2;
+		break;
+	case V4L2_PIX_FMT_MJPEG:
+		// 压缩格式没有行跨度，按编码器的最大输出分配，每帧的实际长度由bytesused给出
+		l->comp_planes = 1;
+		l->mem_planes = 1;
+		l->lines[0] = height;
+		l->sizeimage[0] = up3d_jpeg_max_size(width, height);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+
+	for (c = 0; c < l->comp_planes; c++) {
+		l->bytesperline[c] = c ? cbpl : bytesperline;
+		l->lines[c] = c ? height / vsub : height;
+
+		// 连续格式的分量平面依次排在同一个缓冲区平面里
+		l->mem_plane[c] = l->mem_planes > 1 ? c : 0;
+		l->offset[c] = l->sizeimage[l->mem_plane[c]];
+		l->sizeimage[l->mem_plane[c]] += l->bytesperline[c] * l->lines[c];
+	}
+
+	return 0;
+}
+
+/* 一行中相邻两个像素的平均颜色，用于水平方向下采样的色度 */
+static inline void up3d_pattern_avg2(const u32 *rgb, u32 *r, u32 *g, u32 *b)
+{
+	*r = ((rgb[0] >> 16 & 0xff) + (rgb[1] >> 16 & 0xff)) / 2;
+	*g = ((rgb[0] >> 8 & 0xff) + (rgb[1] >> 8 & 0xff)) / 2;
+	*b = ((rgb[0] & 0xff) + (rgb[1] & 0xff)) / 2;
+}
+
+/* 平面YUV格式：comp为0时输出亮度，否则输出第comp个色度平面 */
+static void up3d_pattern_pack_planar(u8 *dst, const u32 *rgb, u32 width, u32 pixelformat, u32 comp)
+{
+	u32 x, r, g, b;
+
+	if (comp == 0) {
+		for (x = 0; x < width; x++)
+			*dst++ = rgb_to_y(rgb[x] >> 16 & 0xff, rgb[x] >> 8 & 0xff, rgb[x] & 0xff);
+		return;
+	}
+
+	for (x = 0; x + 1 < width; x += 2) {
+		up3d_pattern_avg2(&rgb[x], &r, &g, &b);
+		switch (pixelformat) {
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YUV420M:	// U、V各自一个平面
+			*dst++ = comp == 1 ? rgb_to_u(r, g, b) : rgb_to_v(r, g, b);
+			break;
+		default:					// NV12/NV16: UV交错
+			*dst++ = rgb_to_u(r, g, b);
+			*dst++ = rgb_to_v(r, g, b);
+			break;
+		}
+	}
+}
+
+/* 把一行0xRRGGBB颜色按像素格式打包成第comp个分量平面的一行，width个像素 */
+static void up3d_pattern_pack_line(u8 *dst, const u32 *rgb, u32 width, u32 pixelformat, u32 comp)
+{
+	u32 x, r, g, b;
+	u16 v;
+
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_RGB24:
+		for (x = 0; x < width; x++) {
+			*dst++ = rgb[x] >> 16;
+			*dst++ = rgb[x] >> 8;
+			*dst++ = rgb[x];
+		}
+		break;
+	case V4L2_PIX_FMT_RGB565:	// 小端，R在高5位
+		for (x = 0; x < width; x++) {
+			v = ((rgb[x] >> 8) & 0xf800) | ((rgb[x] >> 5) & 0x07e0) | ((rgb[x] >> 3) & 0x001f);
+			*dst++ = v;
+			*dst++ = v >> 8;
+		}
+		break;
+	case V4L2_PIX_FMT_YUYV:		// Y0 U Y1 V，色度取两个像素的平均值
+		for (x = 0; x + 1 < width; x += 2) {
+			up3d_pattern_avg2(&rgb[x], &r, &g, &b);
+			*dst++ = rgb_to_y(rgb[x] >> 16 & 0xff, rgb[x] >> 8 & 0xff, rgb[x] & 0xff);
+			*dst++ = rgb_to_u(r, g, b);
+			*dst++ = rgb_to_y(rgb[x + 1] >> 16 & 0xff, rgb[x + 1] >> 8 & 0xff, rgb[x + 1] & 0xff);
+			*dst++ = rgb_to_v(r, g, b);
+		}
+		break;
+	default:
+		up3d_pattern_pack_planar(dst, rgb, width, pixelformat, comp);
+		break;
+	}
+}
+
+/* 生成一行图案的规范颜色 */
+static void up3d_pattern_render_rgb(struct up3d_pattern *pat, u32 sequence)
+{
+	u32 x, w = pat->width;
+
+	switch (pat->type) {
+	case PATTERN_COLORBARS:
+		for (x = 0; x < w; x++)
+			pat->rgb[x] = colorbars[x * ARRAY_SIZE(colorbars) / w];
+		break;
+	case PATTERN_GRADIENT:		// 绿色渐变，每帧左移4个灰阶
+		for (x = 0; x < w; x++)
+			pat->rgb[x] = ((x * 256 / w + sequence * 4) & 0xff) << 8;
+		break;
+	default:
+		for (x = 0; x < w; x++)
+			pat->rgb[x] = pat->color;
+		break;
+	}
+}
+
+/* 生成帧序号和时间戳方块的颜色，返回叠加区域的宽度 */
+static u32 up3d_pattern_render_overlay_rgb(struct up3d_pattern *pat, u32 sequence, u64 timestamp_ns)
+{
+	u64 bits = ((u64)sequence << 32) | (u32)div_u64(timestamp_ns, NSEC_PER_MSEC);
+	u32 x, n = min_t(u32, pat->width, PATTERN_OVERLAY_BITS * PATTERN_OVERLAY_BLOCK);
+
+	for (x = 0; x < n; x++) {
+		if (bits & (1ULL << (PATTERN_OVERLAY_BITS - 1 - x / PATTERN_OVERLAY_BLOCK)))
+			pat->overlay_rgb[x] = 0xffffff;
+		else
+			pat->overlay_rgb[x] = 0x000000;
+	}
+
+	return n;
+}
+
+/* 在图案行的基础上画出帧序号和时间戳方块 */
+static void up3d_pattern_render_overlay(struct up3d_pattern *pat, u32 sequence, u64 timestamp_ns)
+{
+	u32 c, n = up3d_pattern_render_overlay_rgb(pat, sequence, timestamp_ns);
+
+	for (c = 0; c < pat->comp_planes; c++) {
+		memcpy(pat->overlay_line[c], pat->line[c], pat->line_bytes[c]);
+		up3d_pattern_pack_line(pat->overlay_line[c], pat->overlay_rgb, n, pat->pixelformat, c);
+	}
+}
+
+/* 第comp个分量平面一行有效像素的字节数 */
+static u32 up3d_pattern_line_bytes(u32 pixelformat, u32 width, u32 comp)
+{
+	if (comp == 0)
+		return width * up3d_pattern_bytes_per_pixel(pixelformat);
+
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YUV420M:
+		return width / 2;
+	default:
+		return width / 2 * 2;		// UV交错，每两个像素一对
+	}
+}
+
+/**
+ * 按当前格式分配行缓冲，在开始采集时调用(可睡眠)
+ */
+int up3d_pattern_prepare(struct up3d_pattern *pat, const struct up3d_frame_layout *layout)
+{
+	u32 c;
+
+	up3d_pattern_release(pat);
+
+	if ((!up3d_pattern_bytes_per_pixel(layout->pixelformat) && 
+		layout->pixelformat != V4L2_PIX_FMT_MJPEG) || !layout->width)
+		return -EINVAL;
+
+	pat->pixelformat = layout->pixelformat;
+	pat->width = layout->width;
+	pat->comp_planes = layout->comp_planes;
+	pat->rgb = kmalloc_array(layout->width, sizeof(*pat->rgb), GFP_KERNEL);
+	pat->overlay_rgb = kmalloc_array(PATTERN_OVERLAY_BITS * PATTERN_OVERLAY_BLOCK,
+						sizeof(*pat->overlay_rgb), GFP_KERNEL);
+	if (!pat->rgb || !pat->overlay_rgb)
+		goto nomem;
+
+	// MJPEG不需要打包后的扫描行，编码器直接使用规范颜色
+	if (pat->pixelformat == V4L2_PIX_FMT_MJPEG) {
+		pat->jpeg = up3d_jpeg_create(layout->width, layout->height);
+		if (!pat->jpeg)
+			goto nomem;
+		return 0;
+	}
+
+	for (c = 0; c < pat->comp_planes; c++) {
+		pat->line_bytes[c] = up3d_pattern_line_bytes(pat->pixelformat, pat->width, c);
+		pat->line[c] = kmalloc(pat->line_bytes[c], GFP_KERNEL);
+		pat->overlay_line[c] = kmalloc(pat->line_bytes[c], GFP_KERNEL);
+		if (!pat->line[c] || !pat->overlay_line[c])
+			goto nomem;
+	}
+
+	return 0;
+
+nomem:
+	up3d_pattern_release(pat);
+	return -ENOMEM;
+}
+UP3D_EXPORT_FOR_TESTS(up3d_pattern_prepare);
+
+void up3d_pattern_release(struct up3d_pattern *pat)
+{
+	u32 c;
+
+	kfree(pat->rgb);
+	kfree(pat->overlay_rgb);
+	pat->rgb = NULL;
+	pat->overlay_rgb = NULL;
+	for (c = 0; c < UP3D_MAX_PLANES; c++) {
+		kfree(pat->line[c]);
+		kfree(pat->overlay_line[c]);
+		pat->line[c] = NULL;
+		pat->overlay_line[c] = NULL;
+	}
+	up3d_jpeg_destroy(pat->jpeg);
+	pat->jpeg = NULL;
+	pat->comp_planes = 0;
+	pat->line_valid = false;
+}
+UP3D_EXPORT_FOR_TESTS(up3d_pattern_release);
+
+/**
+ * MJPEG：图案行和叠加行各编码一个MCU行，整帧由它们拼接而成。
+ * 静态图案的图案行只编码一次，之后每帧只编码叠加行和复制编码后的数据。
+ */
+static void up3d_pattern_fill_jpeg(struct up3d_pattern *pat, void *vaddr, unsigned long size,
+						u32 sequence, u64 timestamp_ns, unsigned long *payload)
+{
+	u32 n;
+
+	BUILD_BUG_ON(PATTERN_OVERLAY_ROWS != UP3D_JPEG_MCU_HEIGHT);
+
+	if (!pat->line_valid) {
+		up3d_pattern_render_rgb(pat, sequence);
+		up3d_jpeg_encode_row(pat->jpeg, UP3D_JPEG_ROW_PLAIN, pat->rgb, NULL, 0);
+		pat->line_valid = pat->type != PATTERN_GRADIENT;
+	}
+
+	if (pat->overlay) {
+		n = up3d_pattern_render_overlay_rgb(pat, sequence, timestamp_ns);
+		up3d_jpeg_encode_row(pat->jpeg, UP3D_JPEG_ROW_OVERLAY, pat->rgb, pat->overlay_rgb, n);
+	}
+
+	*payload = vaddr ? up3d_jpeg_assemble(pat->jpeg, vaddr, size, pat->overlay) : 0;
+}
+
+/**
+ * 填充一帧：每个分量平面只生成一行图案，然后按行(row-major)整行复制到每一行的起始位置，
+ * 行间距使用bytesperline，对齐填充部分不写。vaddr/size为每个缓冲区平面的地址和大小，不会越界。
+ * payload返回每个缓冲区平面的有效数据长度，未压缩格式为sizeimage，MJPEG为编码后的长度。
+ */
+void up3d_pattern_fill(struct up3d_pattern *pat, const struct up3d_frame_layout *layout,
+						void * const vaddr[], const unsigned long size[], u32 sequence, u64 timestamp_ns,
+						unsigned long payload[])
+{
+	u8 *dst;
+	u32 c, y, rows, overlay_rows, line_bytes, bpl, mem;
+	unsigned long avail;
+
+	for (mem = 0; mem < layout->mem_planes; mem++)
+		payload[mem] = 0;
+
+	// 格式与prepare时不一致，不能使用预生成的行
+	if (!pat->comp_planes || layout->pixelformat != pat->pixelformat || layout->width != pat->width)
+		return;
+
+	if (pat->jpeg) {
+		up3d_pattern_fill_jpeg(pat, vaddr[0], size[0], sequence, timestamp_ns, &payload[0]);
+		return;
+	}
+
+	for (mem = 0; mem < layout->mem_planes; mem++)
+		payload[mem] = min_t(unsigned long, layout->sizeimage[mem], size[mem]);
+
+	// 静态图案只需生成一次，移动渐变每帧重画一行
+	if (!pat->line_valid) {
+		up3d_pattern_render_rgb(pat, sequence);
+		for (c = 0; c < pat->comp_planes; c++)
+			up3d_pattern_pack_line(pat->line[c], pat->rgb, pat->width, pat->pixelformat, c);
+		pat->line_valid = pat->type != PATTERN_GRADIENT;
+	}
+
+	if (pat->overlay)
+		up3d_pattern_render_overlay(pat, sequence, timestamp_ns);
+
+	for (c = 0; c < pat->comp_planes; c++) {
+		mem = layout->mem_plane[c];
+		bpl = layout->bytesperline[c];
+		if (!vaddr[mem] || !bpl || size[mem] <= layout->offset[c])
+			continue;
+
+		dst = (u8 *)vaddr[mem] + layout->offset[c];
+		avail = size[mem] - layout->offset[c];
+		line_bytes = min(pat->line_bytes[c], bpl);
+		rows = min_t(u32, layout->lines[c], avail / bpl);
+		// 垂直下采样的色度平面，叠加区域的行数按比例缩小
+		overlay_rows = pat->overlay ? PATTERN_OVERLAY_ROWS * layout->lines[c] / layout->height : 0;
+
+		for (y = 0; y < min(rows, overlay_rows); y++)
+			memcpy(dst + (size_t)y * bpl, pat->overlay_line[c], line_bytes);
+		for (; y < rows; y++)
+			memcpy(dst + (size_t)y * bpl, pat->line[c], line_bytes);
+	}
+}
+UP3D_EXPORT_FOR_TESTS(up3d_pattern_fill);
+
+/**
+ * 每种格式、分辨率的填充吞吐量，结果输出到内核日志。
+ * 填充前先预热一帧，排除首次访问缓冲区的缺页开销。
+ */
+void up3d_pattern_bench(struct up3d_pattern *cfg)
+{
+	static const u32 formats[] = {
+		V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_RGB565, V4L2_PIX_FMT_YUYV,
+		V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_NV16, V4L2_PIX_FMT_YUV420,
+		V4L2_PIX_FMT_MJPEG,
+	};
+	static const struct v4l2_frmsize_discrete sizes[] = {
+		{  640,  360 },
+		{ 1920, 1080 },
+		{ 3840, 2160 },
+	};
+	struct up3d_pattern pat;
+	struct up3d_frame_layout layout;
+	void *buf;
+	unsigned long size, payload;
+	u64 start, ns;
+	int i, j, n;
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+			memset(&pat, 0, sizeof(pat));
+			pat.type = cfg->type;
+			pat.color = cfg->color;
+			pat.overlay = cfg->overlay;
+
+			// 测试的都是连续格式，整帧在一个缓冲区平面里
+			up3d_pattern_layout(formats[i], sizes[j].width, sizes[j].height,
+				sizes[j].width * up3d_pattern_bytes_per_pixel(formats[i]), &layout);
+			size = layout.sizeimage[0];
+
+			buf = vmalloc(size);
+			if (!buf || up3d_pattern_prepare(&pat, &layout) < 0) {
+				pr_err("up3d: pattern bench: out of memory\n");
+				vfree(buf);
+				return;
+			}
+
+			up3d_pattern_fill(&pat, &layout, &buf, &size, 0, 0, &payload);
+
+			start = ktime_get_ns();
+			for (n = 0; n < PATTERN_BENCH_FRAMES; n++)
+				up3d_pattern_fill(&pat, &layout, &buf, &size, n, ktime_get_ns(), &payload);
+			ns = max_t(u64, ktime_get_ns() - start, 1);
+
+			// 吞吐量按实际写入的字节数(bytesused)计算
+			pr_info("up3d: pattern bench %c%c%c%c %ux%u: %llu us/frame, %lu bytes/frame, %llu MB/s\n",
+				formats[i] & 0xff, (formats[i] >> 8) & 0xff,
+				(formats[i] >> 16) & 0xff, (formats[i] >> 24) & 0xff,
+				layout.width, layout.height,
+				div_u64(ns, PATTERN_BENCH_FRAMES * NSEC_PER_USEC), payload,
+				div64_u64((u64)payload * PATTERN_BENCH_FRAMES * 1000, ns));
+
+			up3d_pattern_release(&pat);
+			vfree(buf);
+		}
+	}
+}
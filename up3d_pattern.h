@@ -0,0 +1,72 @@
+#ifndef __UP3D_PATTERN_H__
+#define __UP3D_PATTERN_H__
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+#include "up3d_jpeg.h"
+
+// 测试图案类型
+enum up3d_pattern_type {
+	PATTERN_SOLID = 0,		// 纯色，颜色由color指定
+	PATTERN_COLORBARS,		// 75%彩条
+	PATTERN_GRADIENT,		// 随帧移动的水平渐变
+	PATTERN_TYPE_CNT,
+};
+
+// 叠加区域：左上角一行64个方块，依次为帧序号和毫秒时间戳的二进制位(高位在前)，白1黑0
+#define PATTERN_OVERLAY_BITS	64
+#define PATTERN_OVERLAY_BLOCK	8		// 每个方块的宽度(像素)
+#define PATTERN_OVERLAY_ROWS	8		// 叠加区域的高度(行)
+
+// 一帧最多的平面数(YUV420为Y、U、V三个)
+#define UP3D_MAX_PLANES		3
+
+/**
+ * 一帧在内存中的布局。分量平面是像素数据的逻辑平面(打包格式1个，NV12/NV16为Y和UV，
+ * YUV420为Y、U、V)；缓冲区平面是videobuf2的plane，连续格式所有分量放在一个缓冲区平面里，
+ * 多平面格式(NV12M等)每个分量单独一个。
+ */
+struct up3d_frame_layout {
+	u32		pixelformat;
+	u32		width;
+	u32		height;
+	u32		comp_planes;						// 分量平面数
+	u32		mem_planes;							// 缓冲区平面数
+	u32		bytesperline[UP3D_MAX_PLANES];		// 每个分量平面的行跨度
+	u32		lines[UP3D_MAX_PLANES];				// 每个分量平面的行数
+	u32		mem_plane[UP3D_MAX_PLANES];			// 分量平面所在的缓冲区平面
+	u32		offset[UP3D_MAX_PLANES];			// 分量平面在缓冲区平面中的偏移
+	u32		sizeimage[UP3D_MAX_PLANES];			// 每个缓冲区平面的大小
+};
+
+struct up3d_pattern {
+	/* 配置 */
+	int			type;			// enum up3d_pattern_type
+	u32			color;			// PATTERN_SOLID使用的颜色，0xRRGGBB
+	bool		overlay;		// 是否叠加帧序号/时间戳
+
+	/* 运行时：按当前格式为每个分量平面预生成的扫描行，每帧只生成一行然后逐行复制 */
+	u32			pixelformat;
+	u32			width;
+	u32			comp_planes;
+	u32			line_bytes[UP3D_MAX_PLANES];	// 一行有效像素占用的字节数(不含对齐填充)
+	u32			*rgb;			// 一行的规范颜色，0xRRGGBB
+	u32			*overlay_rgb;	// 叠加方块的颜色
+	u8			*line[UP3D_MAX_PLANES];			// 按pixelformat打包后的图案行
+	u8			*overlay_line[UP3D_MAX_PLANES];	// 叠加了方块后的行
+	bool		line_valid;		// 静态图案的行已生成，无需每帧重画
+	struct up3d_jpeg	*jpeg;		// MJPEG格式的编码器，缓存编码好的MCU行
+};
+
+extern int up3d_pattern_bytes_per_pixel(u32 pixelformat);
+extern int up3d_pattern_layout(u32 pixelformat, u32 width, u32 height, u32 bytesperline,
+						struct up3d_frame_layout *layout);
+extern int up3d_pattern_prepare(struct up3d_pattern *pat, const struct up3d_frame_layout *layout);
+extern void up3d_pattern_release(struct up3d_pattern *pat);
+extern void up3d_pattern_fill(struct up3d_pattern *pat, const struct up3d_frame_layout *layout,
+						void * const vaddr[], const unsigned long size[], u32 sequence, u64 timestamp_ns,
+						unsigned long payload[]);
+extern void up3d_pattern_bench(struct up3d_pattern *pat);
+
+#endif /*__UP3D_PATTERN_H__*/
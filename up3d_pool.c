@@ -0,0 +1,325 @@
+#include "up3d_pool.h"
+#include "up3d.h"
+#include <linux/dma-mapping.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <media/v4l2-dev.h>
+
+/**
+ * 常驻缓冲池：vmalloc分配器之上的一层，每个实例一个。
+ * 采集缓冲区释放(REQBUFS(0)、队列所有者关闭)时不还给vmalloc，而是留在池中，
+ * 下次申请大小不超过它的缓冲区时直接复用，使用者频繁重启时不用再分配、清零几十MB的内存。
+ * vmalloc_user分配时页已经全部分配并清零，mmap时remap_vmalloc_range一次建好全部页表，
+ * 所以池中的缓冲区拿来就能用，不会在第一次填充或访问时缺页。
+ * 缓冲区记录上一次是哪个节点在用：同一个节点重新申请时原样复用；换了节点时先清零，
+ * 里面可能是回环转发的别的使用者的图像，不能交给新的使用者。预分配的缓冲区本来就是零。
+ * 缓冲区本身仍是vb2_vmalloc_memops的，除alloc/put外的操作都直接用它的实现；
+ * 只池化采集方向(DMA_FROM_DEVICE)的缓冲区，回环输出节点照常分配和释放。
+ * 复用的缓冲区最多是申请大小的UP3D_POOL_SLACK倍，大缓冲区不会被小格式占用；
+ * 内存预算按池中缓冲区的实际大小计算(up3d_pool_buf_size)。
+ *
+ * vb2_mem_ops.alloc只带一个设备指针，采集节点的queue_setup把节点自己的video_device
+ * 作为分配设备(vmalloc不使用它)，在所有池所属实例的节点中比较这个地址，找到节点和实例的池，
+ * 找不到的直接用vmalloc分配，不进池；put只带缓冲区，在所有池中查找。
+ */
+
+struct up3d_pool_entry {
+	struct list_head	list;
+	void				*priv;		// vb2_vmalloc_memops.alloc返回的缓冲区
+	unsigned long		size;		// 页对齐后的大小
+	bool				in_use;
+	struct up3d_stream	*owner;		// 最后使用它的采集节点，NULL表示内容为零
+};
+
+// 复用的缓冲区最多比申请的大这么多倍，实际占用最多超出内存预算这么多倍
+#define UP3D_POOL_SLACK		2
+
+// 保护所有池及其链表，只在分配/释放缓冲区时持有，不在帧路径上
+static DEFINE_MUTEX(up3d_pool_lock);
+static LIST_HEAD(up3d_pools);
+
+static struct vb2_mem_ops up3d_pool_memops;
+
+/* 在池中登记一个缓冲区，池已满时返回false，调用时持有锁 */
+static bool up3d_pool_adopt(struct up3d_pool *pool, void *priv, unsigned long size, 
+				struct up3d_stream *owner)
+{
+	struct up3d_pool_entry *entry;
+
+	if (pool->count >= pool->max)
+		return false;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return false;
+
+	entry->priv = priv;
+	entry->size = size;
+	entry->in_use = owner != NULL;
+	entry->owner = owner;
+	list_add_tail(&entry->list, &pool->entries);
+	pool->count++;
+	return true;
+}
+
+/**
+ * 按分配设备找到启用了缓冲池的实例中的节点，调用时持有锁。
+ * 只比较地址，不把dev当作video_device转换：没有把节点设备作为分配设备的队列
+ * (例如alloc_devs保持q->dev)在这里找不到，照常用vmalloc分配。
+ */
+static struct up3d_stream *up3d_pool_stream(struct device *dev)
+{
+	struct up3d_video_ctx *ctx;
+	struct up3d_pool *pool;
+	int i;
+
+	list_for_each_entry(pool, &up3d_pools, node) {
+		ctx = container_of(pool, struct up3d_video_ctx, pool);
+		for (i = 0; i < ctx->stream_cnt; i++) {
+			if (dev == &ctx->streams[i].vid_cap_dev.dev)
+				return &ctx->streams[i];
+		}
+		if (dev == &ctx->meta.vid_cap_dev.dev)
+			return &ctx->meta;
+		if (dev == &ctx->loop.vid_cap_dev.dev)
+			return &ctx->loop;
+	}
+
+	return NULL;
+}
+
+/**
+ * 取池中能放下size、又不超过UP3D_POOL_SLACK倍的最小的空闲缓冲区，
+ * 没有则新分配，池未满时新分配的也登记进池。
+ * 5.16起alloc/vaddr带vb2_buffer参数，dma_dir和gfp从vb->vb2_queue取。
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define up3d_vmalloc_alloc(dev, size)	vb2_vmalloc_memops.alloc(vb, dev, size)
+#define up3d_vmalloc_vaddr(priv)		vb2_vmalloc_memops.vaddr(vb, priv)
+
+static void *up3d_pool_alloc(struct vb2_buffer *vb, struct device *dev, unsigned long size)
+{
+	enum dma_data_direction dma_dir = vb->vb2_queue->dma_dir;
+#else
+#define up3d_vmalloc_alloc(dev, size)	vb2_vmalloc_memops.alloc(dev, attrs, size, dma_dir, gfp_flags)
+#define up3d_vmalloc_vaddr(priv)		vb2_vmalloc_memops.vaddr(priv)
+
+static void *up3d_pool_alloc(struct device *dev, unsigned long attrs, unsigned long size,
+				enum dma_data_direction dma_dir, gfp_t gfp_flags)
+{
+#endif
+	struct up3d_pool_entry *entry, *best = NULL;
+	struct up3d_stream *stream;
+	struct up3d_pool *pool;
+	bool clear;
+	void *priv;
+
+	if (dma_dir != DMA_FROM_DEVICE)
+		return up3d_vmalloc_alloc(dev, size);
+
+	mutex_lock(&up3d_pool_lock);
+	stream = up3d_pool_stream(dev);
+	if (!stream) {
+		mutex_unlock(&up3d_pool_lock);
+		return up3d_vmalloc_alloc(dev, size);
+	}
+	pool = &stream->ctx->pool;
+	size = PAGE_ALIGN(size);
+
+	list_for_each_entry(entry, &pool->entries, list) {
+		if (entry->in_use || entry->size < size || entry->size > size * UP3D_POOL_SLACK)
+			continue;
+		if (!best || entry->size < best->size)
+			best = entry;
+	}
+	if (best) {
+		clear = best->owner && best->owner != stream;
+		best->in_use = true;
+		best->owner = stream;
+		pool->hits++;
+		mutex_unlock(&up3d_pool_lock);
+
+		// 缓冲区已经标记为使用中，清零时不用持有锁
+		if (clear)
+			memset(up3d_vmalloc_vaddr(best->priv), 0, best->size);
+		return best->priv;
+	}
+	pool->misses++;
+	mutex_unlock(&up3d_pool_lock);
+
+	priv = up3d_vmalloc_alloc(dev, size);
+	if (IS_ERR_OR_NULL(priv))
+		return priv;
+
+	mutex_lock(&up3d_pool_lock);
+	up3d_pool_adopt(pool, priv, size, stream);
+	mutex_unlock(&up3d_pool_lock);
+
+	return priv;
+}
+
+/* 预分配池中的缓冲区：采集方向，没有队列，也就没有额外的gfp标志 */
+static void *up3d_pool_prealloc(unsigned long size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	// vmalloc分配器只从vb->vb2_queue读取dma_dir和gfp_flags，不保留vb
+	struct vb2_queue *q = kzalloc(sizeof(*q), GFP_KERNEL);
+	struct vb2_buffer *vb = kzalloc(sizeof(*vb), GFP_KERNEL);
+	void *priv = NULL;
+
+	if (q && vb) {
+		q->dma_dir = DMA_FROM_DEVICE;
+		vb->vb2_queue = q;
+		priv = vb2_vmalloc_memops.alloc(vb, NULL, size);
+	}
+	kfree(vb);
+	kfree(q);
+	return priv;
+#else
+	return vb2_vmalloc_memops.alloc(NULL, 0, size, DMA_FROM_DEVICE, 0);
+#endif
+}
+
+/**
+ * 池中的缓冲区放回池里。导出的DMABUF还没关闭时(引用数大于1)内存不能复用，
+ * 把它从池中移除，交给vmalloc在最后一个引用释放时回收。
+ */
+static void up3d_pool_put(void *buf_priv)
+{
+	struct up3d_pool_entry *entry, *found = NULL;
+	struct up3d_pool *pool;
+
+	mutex_lock(&up3d_pool_lock);
+	list_for_each_entry(pool, &up3d_pools, node) {
+		list_for_each_entry(entry, &pool->entries, list) {
+			if (entry->priv == buf_priv) {
+				found = entry;
+				break;
+			}
+		}
+		if (found)
+			break;
+	}
+	if (found && vb2_vmalloc_memops.num_users(buf_priv) <= 1) {
+		found->in_use = false;
+		mutex_unlock(&up3d_pool_lock);
+		return;
+	}
+	if (found) {
+		list_del(&found->list);
+		pool->count--;
+		kfree(found);
+	}
+	mutex_unlock(&up3d_pool_lock);
+
+	vb2_vmalloc_memops.put(buf_priv);
+}
+
+/**
+ * 创建实例时调用，buffers为池最多保留的缓冲区数，为0时不启用。
+ * size不为0时立即分配buffers个这么大的缓冲区，否则池随使用者释放的缓冲区逐渐填满。
+ */
+int up3d_pool_init(struct up3d_pool *pool, unsigned int buffers, unsigned long size)
+{
+	void *priv;
+	unsigned int i;
+
+	INIT_LIST_HEAD(&pool->node);
+	INIT_LIST_HEAD(&pool->entries);
+	pool->max = min_t(unsigned int, buffers, UP3D_MAX_STREAMS * VB2_MAX_FRAME);
+	if (!pool->max)
+		return 0;
+
+	mutex_lock(&up3d_pool_lock);
+	up3d_pool_memops = vb2_vmalloc_memops;
+	up3d_pool_memops.alloc = up3d_pool_alloc;
+	up3d_pool_memops.put = up3d_pool_put;
+	list_add_tail(&pool->node, &up3d_pools);
+	mutex_unlock(&up3d_pool_lock);
+
+	if (!size)
+		return 0;
+
+	size = PAGE_ALIGN(size);
+	for (i = 0; i < pool->max; i++) {
+		priv = up3d_pool_prealloc(size);
+		mutex_lock(&up3d_pool_lock);
+		if (IS_ERR_OR_NULL(priv) || !up3d_pool_adopt(pool, priv, size, NULL)) {
+			mutex_unlock(&up3d_pool_lock);
+			if (!IS_ERR_OR_NULL(priv))
+				vb2_vmalloc_memops.put(priv);
+			up3d_pool_exit(pool);
+			return -ENOMEM;
+		}
+		mutex_unlock(&up3d_pool_lock);
+	}
+
+	return 0;
+}
+
+/* 释放实例时调用，此时实例所有的队列都已释放，池中的缓冲区都是空闲的 */
+void up3d_pool_exit(struct up3d_pool *pool)
+{
+	struct up3d_pool_entry *entry, *tmp;
+
+	mutex_lock(&up3d_pool_lock);
+	list_for_each_entry_safe(entry, tmp, &pool->entries, list) {
+		WARN_ON(entry->in_use);
+		list_del(&entry->list);
+		vb2_vmalloc_memops.put(entry->priv);
+		kfree(entry);
+	}
+	list_del_init(&pool->node);
+	pool->count = 0;
+	pool->max = 0;
+	mutex_unlock(&up3d_pool_lock);
+}
+
+/* 缓冲区在池中时返回它实际占用的大小，不是池中的缓冲区返回0 */
+unsigned long up3d_pool_buf_size(struct up3d_pool *pool, void *buf_priv)
+{
+	struct up3d_pool_entry *entry;
+	unsigned long size = 0;
+
+	if (!up3d_pool_enabled(pool))
+		return 0;
+
+	mutex_lock(&up3d_pool_lock);
+	list_for_each_entry(entry, &pool->entries, list) {
+		if (entry->priv == buf_priv) {
+			size = entry->size;
+			break;
+		}
+	}
+	mutex_unlock(&up3d_pool_lock);
+
+	return size;
+}
+
+bool up3d_pool_enabled(const struct up3d_pool *pool)
+{
+	return pool->max != 0;
+}
+
+const struct vb2_mem_ops *up3d_pool_mem_ops(void)
+{
+	return &up3d_pool_memops;
+}
+
+void up3d_pool_show(struct up3d_pool *pool, struct seq_file *m)
+{
+	struct up3d_pool_entry *entry;
+	unsigned int used = 0;
+	u64 bytes = 0;
+
+	mutex_lock(&up3d_pool_lock);
+	list_for_each_entry(entry, &pool->entries, list) {
+		used += entry->in_use;
+		bytes += entry->size;
+	}
+	seq_printf(m, "buffers %u/%u, in use %u, %llu KiB, hits %llu, misses %llu\n",
+		pool->count, pool->max, used, bytes >> 10, pool->hits, pool->misses);
+	mutex_unlock(&up3d_pool_lock);
+}
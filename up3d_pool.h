@@ -0,0 +1,30 @@
+#ifndef __UP3D_POOL_H__
+#define __UP3D_POOL_H__
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+struct vb2_mem_ops;
+struct seq_file;
+
+/**
+ * 常驻缓冲池：每个实例一个，参数pool_buffers/pool_size_kb在创建实例时确定。
+ * 池中的缓冲区挂在entries链表上，所有实例的池共用一把锁(up3d_pool.c)。
+ */
+struct up3d_pool {
+	struct list_head	node;		// 挂在所有池的链表上，释放缓冲区时据此找到所属的池
+	struct list_head	entries;
+	unsigned int		count;		// 池中的缓冲区数，包括正在使用的
+	unsigned int		max;		// 最多保留的缓冲区数，0表示不启用
+	u64					hits;		// 从池中取得的次数
+	u64					misses;		// 池中没有合适的缓冲区，新分配的次数
+};
+
+extern int up3d_pool_init(struct up3d_pool *pool, unsigned int buffers, unsigned long size);
+extern void up3d_pool_exit(struct up3d_pool *pool);
+extern bool up3d_pool_enabled(const struct up3d_pool *pool);
+extern unsigned long up3d_pool_buf_size(struct up3d_pool *pool, void *buf_priv);
+extern const struct vb2_mem_ops *up3d_pool_mem_ops(void);
+extern void up3d_pool_show(struct up3d_pool *pool, struct seq_file *m);
+
+#endif /*__UP3D_POOL_H__*/
@@ -0,0 +1,110 @@
+#include "up3d_replay.h"
+#include "up3d_convert.h"
+
+#include <linux/firmware.h>
+#include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+/**
+ * 回放数据按当前格式的布局首尾相接，每帧依次为各缓冲区平面的sizeimage字节，
+ * 即与单平面节点的一帧、或多平面节点各平面依次拼接的内容相同(含行跨度的对齐填充)。
+ * 第sequence帧取序列中的第sequence % 帧数帧，丢掉的节拍同样跳过对应的帧，
+ * 同一个序号总是得到同样的内容。每个缓冲区平面只做一次整块拷贝，不叠加帧序号/时间戳。
+ * rgb24为true时数据是当前分辨率的RGB24帧，同一份数据可用于所有未压缩格式，每帧转换一次。
+ */
+
+/* 加载固件文件作为回放数据，创建实例时调用，还没有生产线程在读取 */
+int up3d_replay_load_fw(struct up3d_replay *rp, struct device *dev, const char *name)
+{
+	const struct firmware *fw;
+	int ret;
+
+	ret = request_firmware(&fw, name, dev);
+	if (ret < 0)
+		return ret;
+
+	up3d_replay_release(rp);
+	rp->fw = fw;
+	rp->data = fw->data;
+	rp->size = fw->size;
+	return 0;
+}
+
+/* 用kvmalloc的缓冲区替换回放数据，size为0时清除回放，调用时持有frame_lock */
+void up3d_replay_set_buf(struct up3d_replay *rp, void *buf, size_t size)
+{
+	up3d_replay_release(rp);
+	if (!size) {
+		kvfree(buf);
+		return;
+	}
+
+	rp->buf = buf;
+	rp->data = buf;
+	rp->size = size;
+}
+
+void up3d_replay_release(struct up3d_replay *rp)
+{
+	release_firmware(rp->fw);
+	kvfree(rp->buf);
+	rp->fw = NULL;
+	rp->buf = NULL;
+	rp->data = NULL;
+	rp->size = 0;
+}
+
+/* 按layout一帧的大小，回放数据包含的完整帧数；压缩格式没有固定的帧大小，不支持回放 */
+u32 up3d_replay_frames(const struct up3d_replay *rp, const struct up3d_frame_layout *layout)
+{
+	size_t frame = 0;
+	u32 mem;
+
+	if (!rp->size || !up3d_pattern_bytes_per_pixel(layout->pixelformat))
+		return 0;
+
+	if (rp->rgb24)
+		frame = (size_t)layout->width * layout->height * 3;
+	for (mem = 0; !rp->rgb24 && mem < layout->mem_planes; mem++)
+		frame += layout->sizeimage[mem];
+
+	return frame ? rp->size / frame : 0;
+}
+
+/**
+ * 用回放数据填充一帧，没有可用的回放数据时返回false，由图案引擎填充。
+ * payload返回每个缓冲区平面的有效数据长度。
+ */
+bool up3d_replay_fill(const struct up3d_replay *rp, const struct up3d_frame_layout *layout,
+						void * const vaddr[], const unsigned long size[], u32 sequence,
+						unsigned long payload[])
+{
+	const u8 *src;
+	size_t frame = 0;
+	u32 frames, mem;
+
+	frames = up3d_replay_frames(rp, layout);
+	if (!frames)
+		return false;
+
+	if (rp->rgb24) {
+		frame = (size_t)layout->width * layout->height * 3;
+		src = rp->data + (size_t)(sequence % frames) * frame;
+		up3d_convert_frame(src, layout->width * 3, layout, vaddr, size, payload, true);
+		return true;
+	}
+
+	for (mem = 0; mem < layout->mem_planes; mem++)
+		frame += layout->sizeimage[mem];
+	src = rp->data + (size_t)(sequence % frames) * frame;
+
+	for (mem = 0; mem < layout->mem_planes; mem++) {
+		payload[mem] = min_t(unsigned long, layout->sizeimage[mem], size[mem]);
+		if (vaddr[mem])
+			memcpy(vaddr[mem], src, payload[mem]);
+		src += layout->sizeimage[mem];
+	}
+
+	return true;
+}
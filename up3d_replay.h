@@ -0,0 +1,34 @@
+#ifndef __UP3D_REPLAY_H__
+#define __UP3D_REPLAY_H__
+
+#include <linux/types.h>
+
+#include "up3d_pattern.h"
+
+// 通过debugfs写入的回放数据的上限
+#define UP3D_REPLAY_SIZE_MAX	(512UL << 20)
+
+struct firmware;
+struct device;
+
+/**
+ * 回放源：常驻内存的一段原始帧序列，来自request_firmware或debugfs写入，
+ * 二者只保留一个。受ctx->frame_lock保护，生产线程在持有该锁时读取。
+ */
+struct up3d_replay {
+	const struct firmware	*fw;		// request_firmware加载时持有，数据不再拷贝
+	void					*buf;		// debugfs写入时为kvmalloc的缓冲区
+	const u8				*data;
+	size_t					size;
+	bool					rgb24;		// 数据为RGB24(行跨度为宽度*3)，每帧转换为当前格式
+};
+
+extern int up3d_replay_load_fw(struct up3d_replay *rp, struct device *dev, const char *name);
+extern void up3d_replay_set_buf(struct up3d_replay *rp, void *buf, size_t size);
+extern void up3d_replay_release(struct up3d_replay *rp);
+extern u32 up3d_replay_frames(const struct up3d_replay *rp, const struct up3d_frame_layout *layout);
+extern bool up3d_replay_fill(const struct up3d_replay *rp, const struct up3d_frame_layout *layout,
+						void * const vaddr[], const unsigned long size[], u32 sequence,
+						unsigned long payload[]);
+
+#endif /*__UP3D_REPLAY_H__*/
@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: GPL-2.0
+/**
+ * KUnit测试：格式协商(行跨度、帧大小)、分辨率枚举、缓冲区交接和每种格式的图案填充。
+ * 单独编译成up3d610_test.ko，默认不构建：树外构建用make CONFIG_UP3D610_KUNIT_TEST=m，
+ * 树内由Kconfig决定(见Makefile和Kconfig)。加载up3d610_test.ko时运行，结果在内核日志和
+ * /sys/kernel/debug/kunit/up3d610/results中，也可以用kunit.py运行(.kunitconfig)。
+ * 驱动本身不依赖kunit。
+ */
+#include <kunit/test.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+
+#include "up3d.h"
+#include "up3d_ioctl.h"
+#include "up3d_vb2ops.h"
+
+// 检查的bytesperline对齐量：默认值1、常见的DMA对齐和整页
+static const u32 up3d_test_aligns[] = { 1, 2, 16, 64, 256, PAGE_SIZE };
+
+/* 每种格式整帧大小相对于 bytesperline*height 的倍数(以1/4为单位)，MJPEG没有行跨度 */
+static const struct {
+	u32		fourcc;
+	u32		quarters;
+} up3d_test_frame_ratio[] = {
+	{ V4L2_PIX_FMT_RGB24,	4 },
+	{ V4L2_PIX_FMT_RGB565,	4 },
+	{ V4L2_PIX_FMT_YUYV,	4 },
+	{ V4L2_PIX_FMT_NV12,	6 },
+	{ V4L2_PIX_FMT_NV16,	8 },
+	{ V4L2_PIX_FMT_YUV420,	6 },
+	{ V4L2_PIX_FMT_NV12M,	6 },
+	{ V4L2_PIX_FMT_NV16M,	8 },
+	{ V4L2_PIX_FMT_YUV420M,	6 },
+};
+
+/* 只填写格式协商用到的字段，不注册任何设备 */
+static struct up3d_video_ctx *up3d_test_ctx(struct kunit *test, bool mplane, u32 line_align)
+{
+	struct up3d_video_ctx *ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx);
+	ctx->mplane = mplane;
+	ctx->line_align = line_align;
+	ctx->width_max = WIDTH_MAX;
+	ctx->height_max = HEIGHT_MAX;
+	ctx->fmt_lists = up3d_fmtdesc_lists;
+	ctx->fmt_lists_cnt = up3d_fmtdesc_lists_cnt;
+	return ctx;
+}
+
+static u32 up3d_test_quarters(u32 fourcc)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(up3d_test_frame_ratio); i++)
+		if (up3d_test_frame_ratio[i].fourcc == fourcc)
+			return up3d_test_frame_ratio[i].quarters;
+	return 0;
+}
+
+/* 每种格式 × 每种对齐：bytesperline是最小行跨度按对齐量取整，sizeimage与之一致 */
+static void up3d_test_try_fmt_stride(struct kunit *test)
+{
+	struct up3d_frame_layout layout;
+	struct v4l2_pix_format pix;
+	struct up3d_video_ctx *ctx;
+	struct up3d_fmtdesc *fmt;
+	u32 align, min_bpl, total, c;
+	int a, i;
+
+	for (a = 0; a < ARRAY_SIZE(up3d_test_aligns); a++) {
+		ctx = up3d_test_ctx(test, true, up3d_test_aligns[a]);
+
+		for (i = 0; i < ctx->fmt_lists_cnt; i++) {
+			fmt = &ctx->fmt_lists[i];
+			memset(&pix, 0, sizeof(pix));
+			pix.pixelformat = fmt->pixel_format;
+			pix.width = 641;		// 不满足对齐，由try_fmt调整
+			pix.height = 361;
+			pix.field = V4L2_FIELD_INTERLACED;
+			pix.colorspace = V4L2_COLORSPACE_BT2020;		// 使用者传入的色彩空间不被沿用
+			pix.quantization = V4L2_QUANTIZATION_DEFAULT;
+
+			KUNIT_ASSERT_EQ_MSG(test, up3d_try_fmt(ctx, &pix, &layout), 0,
+				"%s line_align %u", fmt->description, ctx->line_align);
+			KUNIT_EXPECT_EQ(test, pix.field, (u32)V4L2_FIELD_NONE);
+			KUNIT_EXPECT_EQ(test, pix.colorspace, (u32)(fmt->flags & V4L2_FMT_FLAG_COMPRESSED ? 
+				V4L2_COLORSPACE_JPEG : V4L2_COLORSPACE_SRGB));
+			KUNIT_EXPECT_NE(test, pix.quantization, (u32)V4L2_QUANTIZATION_DEFAULT);
+			KUNIT_EXPECT_EQ(test, pix.xfer_func, (u32)V4L2_XFER_FUNC_SRGB);
+			KUNIT_EXPECT_EQ(test, pix.pixelformat, fmt->pixel_format);
+			KUNIT_EXPECT_EQ(test, pix.width % (1U << WIDTH_ALIGN), 0U);
+			KUNIT_EXPECT_EQ(test, pix.height % (1U << fmt->height_align), 0U);
+			KUNIT_EXPECT_EQ(test, layout.mem_planes, (u32)fmt->mem_planes);
+
+			if (fmt->flags & V4L2_FMT_FLAG_COMPRESSED) {
+				KUNIT_EXPECT_EQ(test, pix.bytesperline, 0U);
+				KUNIT_EXPECT_EQ(test, (unsigned long)pix.sizeimage,
+					up3d_jpeg_max_size(pix.width, pix.height));
+				continue;
+			}
+
+			// 色度平面跨度为亮度的1/stride_div，对齐量相应放大，每个平面的行都对齐
+			align = ctx->line_align * max_t(u32, fmt->stride_div, 1);
+			min_bpl = DIV_ROUND_UP(pix.width * fmt->bits_per_pixel, 8);
+			KUNIT_EXPECT_EQ_MSG(test, pix.bytesperline, ALIGN(min_bpl, align),
+				"%s line_align %u", fmt->description, ctx->line_align);
+
+			total = 0;
+			for (c = 0; c < layout.comp_planes; c++) {
+				KUNIT_EXPECT_EQ_MSG(test, layout.bytesperline[c] % ctx->line_align, 0U,
+					"%s plane %u line_align %u", fmt->description, c, ctx->line_align);
+				total += layout.bytesperline[c] * layout.lines[c];
+			}
+			KUNIT_EXPECT_EQ(test, pix.sizeimage, total);
+			KUNIT_EXPECT_EQ_MSG(test, pix.sizeimage,
+				pix.bytesperline * pix.height * up3d_test_quarters(fmt->pixel_format) / 4,
+				"%s line_align %u", fmt->description, ctx->line_align);
+		}
+	}
+}
+
+/* 使用者要求的行跨度：按对齐量向上取整，最大为最大宽度一行的大小 */
+static void up3d_test_try_fmt_requested_stride(struct kunit *test)
+{
+	struct up3d_video_ctx *ctx = up3d_test_ctx(test, false, 64);
+	struct up3d_frame_layout layout;
+	struct v4l2_pix_format pix = {
+		.pixelformat = V4L2_PIX_FMT_YUYV,
+		.width = 640,
+		.height = 360,
+		.bytesperline = 1300,
+	};
+
+	KUNIT_ASSERT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), 0);
+	KUNIT_EXPECT_EQ(test, pix.bytesperline, 1344U);
+	KUNIT_EXPECT_EQ(test, pix.sizeimage, 1344U * 360);
+
+	pix.bytesperline = U32_MAX / 2;
+	KUNIT_ASSERT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), 0);
+	KUNIT_EXPECT_EQ(test, pix.bytesperline, (u32)ALIGN(WIDTH_MAX * 2, 64));
+}
+
+/* 超出范围的分辨率被限制到边界，离散格式取最接近的一个 */
+static void up3d_test_try_fmt_bounds(struct kunit *test)
+{
+	struct up3d_video_ctx *ctx = up3d_test_ctx(test, false, 1);
+	struct up3d_frame_layout layout;
+	struct v4l2_pix_format pix = {
+		.pixelformat = V4L2_PIX_FMT_NV12,
+		.width = 1,
+		.height = 1,
+	};
+
+	KUNIT_ASSERT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), 0);
+	KUNIT_EXPECT_EQ(test, pix.width, (u32)WIDTH_MIN);
+	KUNIT_EXPECT_EQ(test, pix.height, (u32)HEIGHT_MIN);
+
+	pix.width = 100000;
+	pix.height = 100000;
+	KUNIT_ASSERT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), 0);
+	KUNIT_EXPECT_EQ(test, pix.width, (u32)WIDTH_MAX);
+	KUNIT_EXPECT_EQ(test, pix.height, (u32)HEIGHT_MAX);
+
+	pix.pixelformat = V4L2_PIX_FMT_RGB24;
+	pix.width = 1900;
+	pix.height = 1000;
+	KUNIT_ASSERT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), 0);
+	KUNIT_EXPECT_EQ(test, pix.width, 1920U);
+	KUNIT_EXPECT_EQ(test, pix.height, 1080U);
+}
+
+/* 不支持的格式被拒绝，多平面格式只在多平面节点上提供 */
+static void up3d_test_try_fmt_unsupported(struct kunit *test)
+{
+	struct up3d_video_ctx *ctx = up3d_test_ctx(test, false, 1);
+	struct up3d_frame_layout layout;
+	struct v4l2_pix_format pix = {
+		.pixelformat = V4L2_PIX_FMT_NV12M,
+		.width = 640,
+		.height = 360,
+	};
+
+	KUNIT_EXPECT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), -EINVAL);
+
+	pix.pixelformat = v4l2_fourcc('X', 'X', 'X', 'X');
+	KUNIT_EXPECT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), -EINVAL);
+}
+
+/* 离散格式逐项列出且每项都能原样通过try_fmt，其余格式只有一项步进范围 */
+static void up3d_test_enum_framesizes(struct kunit *test)
+{
+	struct up3d_video_ctx *ctx = up3d_test_ctx(test, true, 1);
+	struct up3d_frame_layout layout;
+	struct v4l2_frmsizeenum fsize;
+	struct v4l2_pix_format pix;
+	struct up3d_fmtdesc *fmt;
+	u32 n;
+	int i;
+
+	for (i = 0; i < ctx->fmt_lists_cnt; i++) {
+		fmt = &ctx->fmt_lists[i];
+
+		for (n = 0; ; n++) {
+			memset(&fsize, 0, sizeof(fsize));
+			fsize.index = n;
+			fsize.pixel_format = fmt->pixel_format;
+			if (up3d_framesizes(ctx, &fsize) < 0)
+				break;
+
+			if (fsize.type == V4L2_FRMSIZE_TYPE_STEPWISE) {
+				KUNIT_EXPECT_EQ(test, n, 0U);
+				KUNIT_EXPECT_EQ(test, fsize.stepwise.min_width, (u32)WIDTH_MIN);
+				KUNIT_EXPECT_EQ(test, fsize.stepwise.max_width, (u32)WIDTH_MAX);
+				KUNIT_EXPECT_EQ(test, fsize.stepwise.step_width, 1U << WIDTH_ALIGN);
+				KUNIT_EXPECT_EQ(test, fsize.stepwise.min_height, (u32)HEIGHT_MIN);
+				KUNIT_EXPECT_EQ(test, fsize.stepwise.max_height, (u32)HEIGHT_MAX);
+				KUNIT_EXPECT_EQ(test, fsize.stepwise.step_height, 1U << fmt->height_align);
+				continue;
+			}
+
+			KUNIT_ASSERT_EQ(test, fsize.type, (u32)V4L2_FRMSIZE_TYPE_DISCRETE);
+			KUNIT_EXPECT_GE(test, fsize.discrete.width, (u32)WIDTH_MIN);
+			KUNIT_EXPECT_LE(test, fsize.discrete.width, (u32)WIDTH_MAX);
+			KUNIT_EXPECT_GE(test, fsize.discrete.height, (u32)HEIGHT_MIN);
+			KUNIT_EXPECT_LE(test, fsize.discrete.height, (u32)HEIGHT_MAX);
+
+			memset(&pix, 0, sizeof(pix));
+			pix.pixelformat = fmt->pixel_format;
+			pix.width = fsize.discrete.width;
+			pix.height = fsize.discrete.height;
+			KUNIT_ASSERT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), 0);
+			KUNIT_EXPECT_EQ(test, pix.width, fsize.discrete.width);
+			KUNIT_EXPECT_EQ(test, pix.height, fsize.discrete.height);
+		}
+
+		KUNIT_EXPECT_EQ_MSG(test, n, fmt->sizes ? fmt->sizes_cnt : 1U, "%s", fmt->description);
+	}
+
+	memset(&fsize, 0, sizeof(fsize));
+	fsize.pixel_format = v4l2_fourcc('X', 'X', 'X', 'X');
+	KUNIT_EXPECT_EQ(test, up3d_framesizes(ctx, &fsize), -EINVAL);
+}
+
+/* 只初始化交接用到的链表和锁，节点和缓冲区都较大，不放在栈上 */
+static struct up3d_stream *up3d_test_stream(struct kunit *test)
+{
+	struct up3d_stream *stream = kunit_kzalloc(test, sizeof(*stream), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stream);
+	spin_lock_init(&stream->vb_queue_lock);
+	INIT_LIST_HEAD(&stream->vb_queue_active);
+	return stream;
+}
+
+#define UP3D_TEST_HANDOFF_BUFS	8
+
+/* 单线程交接：先入先出，取走的缓冲区已从链表摘下，队列深度随之变化 */
+static void up3d_test_handoff_fifo(struct kunit *test)
+{
+	struct up3d_stream *stream = up3d_test_stream(test);
+	struct up3d_vb2_buf *bufs, *buf;
+	int i;
+
+	bufs = kunit_kcalloc(test, UP3D_TEST_HANDOFF_BUFS, sizeof(*bufs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bufs);
+	for (i = 0; i < UP3D_TEST_HANDOFF_BUFS; i++)
+		INIT_LIST_HEAD(&bufs[i].list);
+
+	KUNIT_EXPECT_PTR_EQ(test, up3d_handoff_take(stream), (struct up3d_vb2_buf *)NULL);
+
+	for (i = 0; i < UP3D_TEST_HANDOFF_BUFS; i++)
+		up3d_handoff_put(stream, &bufs[i]);
+	KUNIT_EXPECT_EQ(test, stream->stats.queue_depth, (u32)UP3D_TEST_HANDOFF_BUFS);
+	KUNIT_EXPECT_EQ(test, stream->stats.queue_depth_max, (u32)UP3D_TEST_HANDOFF_BUFS);
+
+	for (i = 0; i < UP3D_TEST_HANDOFF_BUFS; i++) {
+		buf = up3d_handoff_take(stream);
+		KUNIT_ASSERT_PTR_EQ(test, buf, &bufs[i]);
+		KUNIT_EXPECT_TRUE(test, list_empty(&buf->list));
+		KUNIT_EXPECT_EQ(test, stream->stats.queue_depth, (u32)(UP3D_TEST_HANDOFF_BUFS - i - 1));
+	}
+
+	KUNIT_EXPECT_PTR_EQ(test, up3d_handoff_take(stream), (struct up3d_vb2_buf *)NULL);
+	KUNIT_EXPECT_TRUE(test, list_empty(&stream->vb_queue_active));
+	KUNIT_EXPECT_EQ(test, stream->stats.queue_depth_max, (u32)UP3D_TEST_HANDOFF_BUFS);
+
+	// 取走后再入队的缓冲区排在后面
+	up3d_handoff_put(stream, &bufs[0]);
+	up3d_handoff_put(stream, &bufs[1]);
+	KUNIT_EXPECT_PTR_EQ(test, up3d_handoff_take(stream), &bufs[0]);
+	up3d_handoff_put(stream, &bufs[0]);
+	KUNIT_EXPECT_PTR_EQ(test, up3d_handoff_take(stream), &bufs[1]);
+	KUNIT_EXPECT_PTR_EQ(test, up3d_handoff_take(stream), &bufs[0]);
+	KUNIT_EXPECT_EQ(test, stream->stats.queue_depth, 0U);
+}
+
+/* 多个线程同时入队、一个线程取走：每次入队都被取走一次，没有丢失或重复 */
+static void up3d_test_handoff_stress(struct kunit *test)
+{
+	struct up3d_handoff_result res;
+
+	KUNIT_ASSERT_EQ(test, up3d_handoff_stress(&res), 0);
+	KUNIT_ASSERT_GT(test, res.queuers, 0);
+	KUNIT_EXPECT_EQ(test, res.puts, (u64)res.queuers * HANDOFF_BENCH_OPS);
+	KUNIT_EXPECT_EQ(test, res.takes, res.puts);
+	KUNIT_EXPECT_EQ(test, res.errors, 0);
+	KUNIT_EXPECT_EQ(test, res.depth, 0U);
+	kunit_info(test, "%d queuers: %llu buffers in %llu us\n", res.queuers, res.takes,
+		div_u64(res.ns, NSEC_PER_USEC));
+}
+
+#define UP3D_TEST_FILL_FRAMES	16
+
+/* 每种格式填充几帧：有效数据覆盖整个缓冲区平面(MJPEG不超过缓冲区)，并记录每帧耗时 */
+static void up3d_test_pattern_fill(struct kunit *test)
+{
+	struct up3d_video_ctx *ctx = up3d_test_ctx(test, true, 64);
+	struct up3d_pattern pat = {
+		.type = PATTERN_GRADIENT,
+		.overlay = true,
+	};
+	void *vaddr[UP3D_MAX_PLANES];
+	unsigned long size[UP3D_MAX_PLANES], payload[UP3D_MAX_PLANES];
+	struct up3d_frame_layout layout;
+	struct v4l2_pix_format pix;
+	struct up3d_fmtdesc *fmt;
+	u64 start, ns;
+	u32 p, n;
+	int i;
+
+	for (i = 0; i < ctx->fmt_lists_cnt; i++) {
+		fmt = &ctx->fmt_lists[i];
+		memset(&pix, 0, sizeof(pix));
+		pix.pixelformat = fmt->pixel_format;
+		pix.width = 640;
+		pix.height = 360;
+		KUNIT_ASSERT_EQ(test, up3d_try_fmt(ctx, &pix, &layout), 0);
+		KUNIT_ASSERT_EQ_MSG(test, up3d_pattern_prepare(&pat, &layout), 0, "%s", fmt->description);
+
+		for (p = 0; p < layout.mem_planes; p++) {
+			size[p] = layout.sizeimage[p];
+			vaddr[p] = vmalloc(size[p]);
+			KUNIT_ASSERT_NOT_ERR_OR_NULL(test, vaddr[p]);
+		}
+
+		start = ktime_get_ns();
+		for (n = 0; n < UP3D_TEST_FILL_FRAMES; n++) {
+			memset(payload, 0, sizeof(payload));
+			up3d_pattern_fill(&pat, &layout, vaddr, size, n, start, payload);
+		}
+		ns = ktime_get_ns() - start;
+
+		for (p = 0; p < layout.mem_planes; p++) {
+			if (fmt->flags & V4L2_FMT_FLAG_COMPRESSED) {
+				KUNIT_EXPECT_GT(test, payload[p], 0UL);
+				KUNIT_EXPECT_LE(test, payload[p], size[p]);
+			} else {
+				KUNIT_EXPECT_EQ_MSG(test, payload[p], size[p], "%s plane %u", fmt->description, p);
+			}
+			vfree(vaddr[p]);
+		}
+		up3d_pattern_release(&pat);
+
+		kunit_info(test, "%-24s %llu us/frame\n", fmt->description,
+			div_u64(ns, UP3D_TEST_FILL_FRAMES * NSEC_PER_USEC));
+	}
+}
+
+static struct kunit_case up3d_test_cases[] = {
+	KUNIT_CASE(up3d_test_try_fmt_stride),
+	KUNIT_CASE(up3d_test_try_fmt_requested_stride),
+	KUNIT_CASE(up3d_test_try_fmt_bounds),
+	KUNIT_CASE(up3d_test_try_fmt_unsupported),
+	KUNIT_CASE(up3d_test_enum_framesizes),
+	KUNIT_CASE(up3d_test_handoff_fifo),
+	KUNIT_CASE(up3d_test_handoff_stress),
+	KUNIT_CASE(up3d_test_pattern_fill),
+	{}
+};
+
+static struct kunit_suite up3d_test_suite = {
+	.name = "up3d610",
+	.test_cases = up3d_test_cases,
+};
+
+kunit_test_suite(up3d_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the Up3d 610 Video Driver");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * up3d的ftrace跟踪点。未启用时每个跟踪点只是一个静态键跳转，不产生开销。
+ * 启用：echo 1 > /sys/kernel/tracing/events/up3d/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM up3d
+
+#if !defined(__UP3D_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __UP3D_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+// 6.10起__assign_str只带目标字段，源字符串取自__string的声明
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define up3d_assign_func()	__assign_str(func)
+#else
+#define up3d_assign_func()	__assign_str(func, func)
+#endif
+
+/**
+ * 控制路径(open/ioctl/queue_setup/start/stop)的函数进入/退出，替代原来的printk，
+ * 用function_graph时可以关掉。函数名拷贝进环形缓冲区，卸载模块后读取也不会访问已释放的内存。
+ * 帧路径上不使用，那里有下面的帧级跟踪点。
+ */
+DECLARE_EVENT_CLASS(up3d_func,
+	TP_PROTO(const char *func),
+	TP_ARGS(func),
+	TP_STRUCT__entry(
+		__string(func, func)
+	),
+	TP_fast_assign(
+		up3d_assign_func();
+	),
+	TP_printk("%s", __get_str(func))
+);
+
+DEFINE_EVENT(up3d_func, up3d_func_entry,
+	TP_PROTO(const char *func),
+	TP_ARGS(func)
+);
+
+DEFINE_EVENT(up3d_func, up3d_func_exit,
+	TP_PROTO(const char *func),
+	TP_ARGS(func)
+);
+
+/* 生产线程被帧时钟唤醒，ticks大于1表示错过了节拍 */
+TRACE_EVENT(up3d_frame_start,
+	TP_PROTO(int inst, u32 sequence, int ticks),
+	TP_ARGS(inst, sequence, ticks),
+	TP_STRUCT__entry(
+		__field(int, inst)
+		__field(u32, sequence)
+		__field(int, ticks)
+	),
+	TP_fast_assign(
+		__entry->inst = inst;
+		__entry->sequence = sequence;
+		__entry->ticks = ticks;
+	),
+	TP_printk("inst=%d seq=%u ticks=%d", __entry->inst, __entry->sequence, __entry->ticks)
+);
+
+/* 一帧填充(及扇出拷贝)完成 */
+TRACE_EVENT(up3d_fill_done,
+	TP_PROTO(int inst, u32 sequence, u64 fill_ns, int copies),
+	TP_ARGS(inst, sequence, fill_ns, copies),
+	TP_STRUCT__entry(
+		__field(int, inst)
+		__field(u32, sequence)
+		__field(u64, fill_ns)
+		__field(int, copies)
+	),
+	TP_fast_assign(
+		__entry->inst = inst;
+		__entry->sequence = sequence;
+		__entry->fill_ns = fill_ns;
+		__entry->copies = copies;
+	),
+	TP_printk("inst=%d seq=%u fill=%lluns copies=%d", __entry->inst, __entry->sequence,
+		__entry->fill_ns, __entry->copies)
+);
+
+DECLARE_EVENT_CLASS(up3d_buf,
+	TP_PROTO(int inst, int stream, u32 index, u32 sequence),
+	TP_ARGS(inst, stream, index, sequence),
+	TP_STRUCT__entry(
+		__field(int, inst)
+		__field(int, stream)
+		__field(u32, index)
+		__field(u32, sequence)
+	),
+	TP_fast_assign(
+		__entry->inst = inst;
+		__entry->stream = stream;
+		__entry->index = index;
+		__entry->sequence = sequence;
+	),
+	TP_printk("inst=%d stream=%d index=%u seq=%u", __entry->inst, __entry->stream,
+		__entry->index, __entry->sequence)
+);
+
+/* 使用者把缓冲区交给驱动(buf_queue) */
+DEFINE_EVENT(up3d_buf, up3d_buf_queue,
+	TP_PROTO(int inst, int stream, u32 index, u32 sequence),
+	TP_ARGS(inst, stream, index, sequence)
+);
+
+/* 驱动完成缓冲区(vb2_buffer_done) */
+DEFINE_EVENT(up3d_buf, up3d_buf_done,
+	TP_PROTO(int inst, int stream, u32 index, u32 sequence),
+	TP_ARGS(inst, stream, index, sequence)
+);
+
+/* 使用者取走缓冲区(buf_finish，DQBUF或read) */
+DEFINE_EVENT(up3d_buf, up3d_buf_dequeue,
+	TP_PROTO(int inst, int stream, u32 index, u32 sequence),
+	TP_ARGS(inst, stream, index, sequence)
+);
+
+/* 节点没有空闲缓冲区，丢掉这一帧 */
+TRACE_EVENT(up3d_drop,
+	TP_PROTO(int inst, int stream, u32 sequence),
+	TP_ARGS(inst, stream, sequence),
+	TP_STRUCT__entry(
+		__field(int, inst)
+		__field(int, stream)
+		__field(u32, sequence)
+	),
+	TP_fast_assign(
+		__entry->inst = inst;
+		__entry->stream = stream;
+		__entry->sequence = sequence;
+	),
+	TP_printk("inst=%d stream=%d seq=%u", __entry->inst, __entry->stream, __entry->sequence)
+);
+
+#endif /*__UP3D_TRACE_H__*/
+
+/* 必须在保护宏之外 */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE up3d_trace
+#include <trace/define_trace.h>
@@ -1,8 +1,5 @@
-#include "up3d.h"
-#include <linux/ktime.h>
+#include <linux/module.h>
 
-u64 get_current_timestamp() {
-    ktime_t now = ktime_get_real(); // 获取当前时间
-    u64 timestamp = ktime_to_ns(now); // 将ktime_t转换为纳秒
-    return timestamp;
-}
\ No newline at end of file
+// 跟踪点只在这里实例化一次
+#define CREATE_TRACE_POINTS
+#include "up3d.h"
@@ -1,82 +1,103 @@
 #include "up3d_v4l2_fops.h"
 #include "up3d_vb2ops.h"
+#include "up3d_ioctl.h"
 #include "up3d.h"
 
 #include <linux/videodev2.h>
 #include <media/videobuf2-core.h>
 #include <media/videobuf2-vmalloc.h>
+#include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-dma-sg.h>
 #include <media/v4l2-ioctl.h>
 
-static int _vb_queue_init(struct vb2_queue *q, struct up3d_video_ctx *ctx)
+/* allocator参数选择的内存分配器，采集节点和回环输出节点共用，启用了缓冲池时vmalloc经由缓冲池 */
+const struct vb2_mem_ops *up3d_vb_mem_ops(struct up3d_video_ctx *ctx)
 {
+	switch (ctx->allocator) {
+	case ALLOCATOR_DMA_CONTIG:
+		return &vb2_dma_contig_memops;		// videobuf2-dma-contig.h
+	case ALLOCATOR_DMA_SG:
+		return &vb2_dma_sg_memops;			// videobuf2-dma-sg.h
+	default:
+		if (up3d_pool_enabled(&ctx->pool))
+			return up3d_pool_mem_ops();		// up3d_pool.c
+		return &vb2_vmalloc_memops;			// videobuf2_vmalloc.h
+	}
+}
+
+/* 初始化一个节点的缓冲队列，创建实例时调用一次，之后所有打开该节点的句柄共用 */
+int up3d_vb_queue_init(struct up3d_stream *stream)
+{
+	struct up3d_video_ctx *ctx = stream->ctx;
+	struct vb2_queue *q = &stream->vb_queue;
+
 	trace_in();
 
-    q->type 				= V4L2_BUF_TYPE_VIDEO_CAPTURE;  		// 类型是视频捕获设备
-    q->io_modes 			= VB2_MMAP; 							// 仅支持应用层做mmap映射的方式
+    q->type 				= ctx->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;  		// 类型是视频捕获设备
+    q->io_modes 			= VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_READ; 	// mmap映射、用户指针、导入DMABUF，后两者由生产线程直接写入使用者的内存；read()由videobuf2内部的缓冲区环实现
     q->buf_struct_size 		= sizeof(struct up3d_vb2_buf);
     q->ops 					= &up3d_vb2_ops,   				
 	// 缓存驱对应的内存分配器操作函数，这里vb2_vmalloc_memops不止一种。vb2_dma_contig_memops\vb2_dma_sg_memops\vb2_vmalloc_memops\或者自定义
 	// 详细见https://cloud.tencent.com/developer/article/2320146 "缓冲区的I/O模式"
-    q->mem_ops 				= &vb2_vmalloc_memops;   				// videobuf2_vmalloc.h
-    q->timestamp_flags 		= V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC; 	// 时间戳是线性增加的
-    q->min_buffers_needed 	= 2;
+	// 具体使用哪一种由allocator模块参数在probe时决定
+    q->mem_ops 				= up3d_vb_mem_ops(ctx);
+    q->dev 					= ctx->dev;						// dma-contig/dma-sg用这个设备做DMA映射
+    q->timestamp_flags 		= V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | up3d_tstamp_src_flag(ctx); 	// 时间戳是线性增加的
+    up3d_vb2_min_queued(q) 	= ctx->min_buffers;				// 开始采集前至少要入队的缓冲区个数
     q->lock 				= &ctx->mutex;					// 保护struct vb2_queue的互斥锁，使缓冲队列的操作串行化，若驱动实有互斥锁，则可设置为NULL，videobuf2核心层API不使用此锁
-	q->drv_priv				= ctx;
+	q->drv_priv				= stream;
 
-	spin_lock_init(&ctx->vb_queue_lock);
-	INIT_LIST_HEAD(&ctx->vb_queue_active);
+	spin_lock_init(&stream->vb_queue_lock);
+	INIT_LIST_HEAD(&stream->vb_queue_active);
 
 	trace_exit();
     return vb2_queue_init(q);
 }
 
 
-static int _init_format(struct v4l2_format *f, struct up3d_video_ctx *ctx)
+int up3d_init_format(struct v4l2_format *f, struct up3d_video_ctx *ctx)
 {
 	trace_in();
+	memset(f, 0, sizeof(*f));
 	f->fmt.pix.width = ctx->width_def;
 	f->fmt.pix.height = ctx->height_def;
 	f->fmt.pix.pixelformat = ctx->fmt_lists[0].pixel_format;
-	f->fmt.pix.bytesperline = f->fmt.pix.width * ctx->fmt_lists[0].bytes_per_pixel;	
-	f->fmt.pix.sizeimage = f->fmt.pix.bytesperline * f->fmt.pix.height;
+	f->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	// 行跨度、各平面布局与VIDIOC_S_FMT使用同一套计算
+	up3d_try_fmt(ctx, &f->fmt.pix, &ctx->layout);
 	trace_exit();
 	return 0;
 }
 
+/**
+ * 队列和格式在创建实例时已经初始化，这里只建立文件句柄：
+ * 同一节点可以被多个句柄打开，第一个申请缓冲区的句柄成为队列的所有者，
+ * 其他使用者通过扇出节点获得同一路帧。
+ */
 static int up3d_open(struct file *file)
 {
 	int ret= -1;
 	
-    struct up3d_video_ctx *ctx = video_drvdata(file);
 	trace_in();
 
 	ret = v4l2_fh_open(file);
 	if (ret < 0)
-	{
 		UP3D_DEBUG("v4l2_fh_open failed ret:%d\n", ret);
-		return ret;
-	}
 
-	_init_format(&ctx->cur_v4l2_format, ctx);
 	trace_exit();
-    return _vb_queue_init(&ctx->vb_queue, ctx);
+    return ret;
 }
 
+/* 只有队列所有者关闭时vb2_fop_release才会停止采集并释放缓冲区，其他句柄关闭不影响正在采集的使用者 */
 static int up3d_release(struct file *file)
 {
 	int ret;
 
-	struct up3d_video_ctx *ctx = video_drvdata(file);
     trace_in();
 
-	vb2_queue_release(&ctx->vb_queue);
-
 	ret = vb2_fop_release(file);
 	UP3D_DEBUG("ret:%d", ret);
 
-	ret = v4l2_fh_release(file);
-	UP3D_DEBUG("ret:%d", ret);
-
 	trace_exit();
     return ret;
 }
@@ -92,6 +113,22 @@ static unsigned int up3d_poll(struct file *file, struct poll_table_struct *ptabl
     return ret;
 }
 
+/**
+ * read()：videobuf2在第一次read时内部申请read_buffers个缓冲区并全部入队开始采集，
+ * 之后每读完一帧就把该缓冲区重新入队，生产线程在两次read之间持续填充其余缓冲区。
+ * 支持部分读取：帧数据直接从缓冲区copy_to_user，只拷贝一次。
+ */
+static ssize_t up3d_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	ret = vb2_fop_read(file, buf, count, ppos);
+	if (ret < 0)
+		UP3D_DEBUG("ret:%zd", ret);
+
+	return ret;
+}
+
 static int up3d_mmap(struct file *file, struct vm_area_struct * vma)
 {
 	int ret = 0;
@@ -108,8 +145,8 @@ const struct v4l2_file_operations up3d_v4l2_fops = {
 	.owner			= THIS_MODULE,
 	.open           = up3d_open,
 	.release        = up3d_release,
-	// .read           = up3d_read,		// 本驱动只支持MMAP 所以这里不提供read/wirte方式的接口
-	// .write          = up3d_write,
+	.read           = up3d_read,
+	// .write          = up3d_write,	// 采集设备，不提供write
 	.poll			= up3d_poll,
 	.mmap           = up3d_mmap,
 	// ioctl -> unlocked_ioctl -> video_ioctl2 -> my_v4l2_ioctl_ops(函数集) 相当于通过video_ioctl2中转了一次
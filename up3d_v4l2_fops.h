@@ -4,4 +4,11 @@
 #include <media/v4l2-dev.h>
 extern const struct v4l2_file_operations up3d_v4l2_fops;
 
+struct up3d_stream;
+struct up3d_video_ctx;
+struct vb2_mem_ops;
+extern const struct vb2_mem_ops *up3d_vb_mem_ops(struct up3d_video_ctx *ctx);
+extern int up3d_vb_queue_init(struct up3d_stream *stream);
+extern int up3d_init_format(struct v4l2_format *f, struct up3d_video_ctx *ctx);
+
 #endif /*__UP3D_V4L2_FOPS_H__*/
\ No newline at end of file
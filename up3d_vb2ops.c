@@ -1,85 +1,797 @@
 #include "up3d_vb2ops.h"
+#include "up3d_meta.h"
 #include "up3d.h"
-#include <linux/timer.h>
-#include <media/videobuf-core.h>
-#include <media/videobuf-vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/task.h>
+#include <linux/math64.h>
+#include <linux/highmem.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
+#include <linux/slab.h>
 
-static struct timer_list up3d_timer;
-static struct up3d_video_ctx *_g_ctx;
-static int up3d_timer_stop = 0;
+/**
+ * dma-sg的页是可缓存的，内核映射是vm_map_ram建立的别名：CPU写入的数据要先写回内存，
+ * 否则完成时videobuf2按DMA_FROM_DEVICE做的cache同步(无效化)会把它丢掉。
+ * dma-contig分配的是一致性内存，vmalloc不做DMA同步，都不需要处理。
+ */
+static void up3d_buf_sync_cpu_writes(struct up3d_video_ctx *ctx, struct vb2_buffer *vb, 
+				void * const vaddr[])
+{
+	struct sg_table *sgt;
+	unsigned int p;
+
+	if (ctx->allocator != ALLOCATOR_DMA_SG)
+		return;
+
+	for (p = 0; p < vb->num_planes; p++) {
+		flush_kernel_vmap_range(vaddr[p], vb2_plane_size(vb, p));
+		sgt = vb2_dma_sg_plane_desc(vb, p);
+		if (sgt)
+			dma_sync_sg_for_device(ctx->dev, sgt->sgl, sgt->orig_nents, DMA_TO_DEVICE);
+	}
+}
+
+/* 取出每个缓冲区平面的内核地址和大小，有平面没有映射时返回false */
+static bool up3d_buf_planes(struct vb2_buffer *vb, void *vaddr[], unsigned long size[])
+{
+	unsigned int p;
+
+	for (p = 0; p < vb->num_planes; p++) {
+		vaddr[p] = vb2_plane_vaddr(vb, p);
+		size[p] = vb2_plane_size(vb, p);
+		if (!vaddr[p])
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * 两个平面是否引用同一块内存：导入了同一个dma_buf，或者一个导入的正是另一个
+ * (MMAP缓冲区经VIDIOC_EXPBUF)导出的dma_buf，videobuf2导出时dma_buf->priv就是mem_priv。
+ */
+static bool up3d_plane_same_memory(struct vb2_buffer *a, struct vb2_buffer *b, unsigned int p)
+{
+	struct dma_buf *da = a->memory == VB2_MEMORY_DMABUF ? a->planes[p].dbuf : NULL;
+	struct dma_buf *db = b->memory == VB2_MEMORY_DMABUF ? b->planes[p].dbuf : NULL;
+
+	if (da && da == db)
+		return true;
+	if (db && db->priv == a->planes[p].mem_priv)
+		return true;
+	if (da && da->priv == b->planes[p].mem_priv)
+		return true;
+	return false;
+}
+
+/* 两个缓冲区的每个平面都引用同一块内存 */
+static bool up3d_buf_same_memory(struct vb2_buffer *a, struct vb2_buffer *b)
+{
+	unsigned int p;
+
+	if (a->num_planes != b->num_planes)
+		return false;
+
+	for (p = 0; p < a->num_planes; p++)
+		if (!up3d_plane_same_memory(a, b, p))
+			return false;
+
+	return true;
+}
+
+/**
+ * 这块内存是否还被其他节点的使用者持有(已完成但未出队，或出队后还没重新入队)，
+ * 持有期间不能写入，否则会改写对方正在读取的帧。
+ * 回环输出节点已入队的缓冲区是使用者写好还没输出的帧，同样不能写入。
+ */
+static bool up3d_stream_holds(struct up3d_stream *stream, struct vb2_buffer *vb)
+{
+	struct vb2_buffer *other;
+	bool pending = stream == &stream->ctx->loop;
+	unsigned int i;
+
+	for (i = 0; i < up3d_vb2_buf_slots(&stream->vb_queue); i++) {
+		other = vb2_get_buffer(&stream->vb_queue, i);
+		if (!other)
+			continue;
+		if (other->state != VB2_BUF_STATE_DONE && other->state != VB2_BUF_STATE_DEQUEUED &&
+			!(pending && (other->state == VB2_BUF_STATE_QUEUED || other->state == VB2_BUF_STATE_ACTIVE)))
+			continue;
+		if (up3d_buf_same_memory(vb, other))
+			return true;
+	}
+
+	return false;
+}
+
+static bool up3d_buf_held_elsewhere(struct up3d_video_ctx *ctx, struct up3d_stream *self, 
+				struct vb2_buffer *vb)
+{
+	struct up3d_stream *stream;
+	int s;
+
+	for (s = 0; s < ctx->stream_cnt; s++) {
+		stream = &ctx->streams[s];
+		if (stream == self || !stream->streaming)
+			continue;
+		if (up3d_stream_holds(stream, vb))
+			return true;
+	}
+
+	// 回环输出节点的使用者正在写入的缓冲区同样不能写
+	return ctx->loop.streaming && up3d_stream_holds(&ctx->loop, vb);
+}
+
+/**
+ * 缓冲区交接：buf_queue把缓冲区挂到节点链表尾部，生产线程从头部取走。
+ * 链表锁只在挂入/摘下时持有，关中断，以后在硬件中断里完成缓冲区也是安全的；
+ * 缓冲区总是先从链表摘下再交给vb2_buffer_done，不会在完成后还留在链表里。
+ */
+void up3d_handoff_put(struct up3d_stream *stream, struct up3d_vb2_buf *buf)
+{
+	unsigned long flags;
 
-static void up3d_timer_function(struct timer_list *timer)
+	spin_lock_irqsave(&stream->vb_queue_lock, flags);
+	list_add_tail(&buf->list, &stream->vb_queue_active);
+	if (++stream->stats.queue_depth > stream->stats.queue_depth_max)
+		stream->stats.queue_depth_max = stream->stats.queue_depth;
+	spin_unlock_irqrestore(&stream->vb_queue_lock, flags);
+}
+UP3D_EXPORT_FOR_TESTS(up3d_handoff_put);
+
+/* O(1)取出最早入队的缓冲区，没有则返回NULL */
+struct up3d_vb2_buf *up3d_handoff_take(struct up3d_stream *stream)
+{
+	struct up3d_vb2_buf *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->vb_queue_lock, flags);
+	buf = list_first_entry_or_null(&stream->vb_queue_active, struct up3d_vb2_buf, list);
+	if (buf) {
+		list_del_init(&buf->list);
+		stream->stats.queue_depth--;
+	}
+	spin_unlock_irqrestore(&stream->vb_queue_lock, flags);
+
+	return buf;
+}
+UP3D_EXPORT_FOR_TESTS(up3d_handoff_take);
+
+/**
+ * 扇出时从节点的待填充链表中取出一个缓冲区：share不为空时优先取与它共享内存的
+ * 缓冲区(零拷贝)，否则取第一个可以写入的缓冲区。*shared返回是否与share共享内存。
+ * 只有多个节点同时采集时才需要遍历，单个节点直接用up3d_handoff_take。
+ *
+ * 检查其他节点是否持有一块内存要遍历它们所有的缓冲区，不在关中断的链表锁内进行：
+ * 锁内只取第skip个缓冲区作为候选，放开锁检查，再加锁确认它仍在链表上才摘下。
+ * 只有生产线程从链表摘缓冲区，候选一般不会在检查期间被拿走，被拿走时从头再找。
+ */
+static struct up3d_vb2_buf *up3d_take_buf(struct up3d_video_ctx *ctx, struct up3d_stream *stream, 
+				struct up3d_vb2_buf *share, bool *shared)
 {
-	int x,y;
-	uint8_t *p;
-    struct up3d_vb2_buf *up3d_vb;
-	// int flags;
-	static uint32_t sequence = 0;
+	struct up3d_vb2_buf *buf, *found = NULL;
+	unsigned long flags;
+	bool taken;
+	int skip, i;
+
+	*shared = false;
+
+	// 与share共享内存的缓冲区只和share比较，可以在锁内完成
+	spin_lock_irqsave(&stream->vb_queue_lock, flags);
+	if (share) {
+		list_for_each_entry(buf, &stream->vb_queue_active, list) {
+			if (up3d_buf_same_memory(&buf->vb.vb2_buf, &share->vb.vb2_buf)) {
+				found = buf;
+				*shared = true;
+				list_del_init(&found->list);
+				stream->stats.queue_depth--;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&stream->vb_queue_lock, flags);
+	if (found)
+		return found;
+
+	for (skip = 0; ; skip++) {
+		found = NULL;
+		i = 0;
+		spin_lock_irqsave(&stream->vb_queue_lock, flags);
+		list_for_each_entry(buf, &stream->vb_queue_active, list) {
+			if (i++ == skip) {
+				found = buf;
+				break;
+			}
+		}
+		spin_unlock_irqrestore(&stream->vb_queue_lock, flags);
+		if (!found)
+			return NULL;
+
+		// 缓冲区在停止采集、生产线程退出之前不会释放，放开锁后仍可访问
+		if (up3d_buf_held_elsewhere(ctx, stream, &found->vb.vb2_buf))
+			continue;
+
+		spin_lock_irqsave(&stream->vb_queue_lock, flags);
+		taken = list_empty(&found->list);
+		if (!taken) {
+			list_del_init(&found->list);
+			stream->stats.queue_depth--;
+		}
+		spin_unlock_irqrestore(&stream->vb_queue_lock, flags);
+		if (!taken)
+			return found;
+
+		skip = -1;
+	}
+}
+
+/* 记录一个节点交付的帧：入队到完成的延迟和序号间隔 */
+static void up3d_stream_account(struct up3d_stream *stream, struct up3d_vb2_buf *buf, 
+				u32 sequence, u64 now)
+{
+	struct up3d_stream_stats *st = &stream->stats;
+
+	st->delivered++;
+	if (now > buf->qbuf_ns)
+		up3d_hist_add(&st->qbuf_to_done, now - buf->qbuf_ns);
+	if (st->seq_valid && sequence != st->last_seq + 1)
+		st->seq_gaps += sequence - st->last_seq - 1;
+	st->last_seq = sequence;
+	st->seq_valid = true;
+}
+
+/* 完成一个缓冲区，序号、时间戳等在填充时已经设置好 */
+static void up3d_buf_complete(struct up3d_video_ctx *ctx, struct up3d_stream *stream, 
+				struct up3d_vb2_buf *buf, enum vb2_buffer_state state)
+{
+	trace_up3d_buf_done(ctx->inst, stream->index, buf->vb.vb2_buf.index, buf->vb.sequence);
+	up3d_stream_account(stream, buf, buf->vb.sequence, ktime_get_ns());
+	vb2_buffer_done(&buf->vb.vb2_buf, state);
+}
+
+/* 把CLOCK_MONOTONIC时刻换算到tstamp_clock选择的时钟 */
+static u64 up3d_tstamp(struct up3d_video_ctx *ctx, ktime_t mono)
+{
+	switch (ctx->tstamp_clock) {
+	case TSTAMP_CLOCK_BOOTTIME:
+		return ktime_to_ns(ktime_mono_to_any(mono, TK_OFFS_BOOT));
+	case TSTAMP_CLOCK_REALTIME:
+		return ktime_to_ns(ktime_mono_to_any(mono, TK_OFFS_REAL));
+	default:
+		return ktime_to_ns(mono);
+	}
+}
+
+/**
+ * 生产一帧并分发给所有正在采集的节点：
+ * 第一个拿到缓冲区的节点由图案引擎填充；其他节点的缓冲区若与它共享内存
+ * (例如导入了主节点导出的DMABUF)则直接完成，不再生成也不拷贝；
+ * 否则从已填充的缓冲区整帧拷贝一次。没有空闲缓冲区时按丢帧策略处理。
+ * 所有缓冲区在写完之后才一起完成，拷贝期间源缓冲区不会被使用者拿走。
+ * deadline是这一帧对应的(最后一个)节拍的截止时间，SOE时间戳取这个时刻。
+ */
+static void up3d_produce_frame(struct up3d_video_ctx *ctx, int ticks, ktime_t deadline)
+{
+	struct up3d_vb2_buf *bufs[UP3D_MAX_STREAMS] = { NULL };
+	enum vb2_buffer_state states[UP3D_MAX_STREAMS];
+	struct up3d_vb2_buf *src = NULL, *next, *loop = NULL;
+	void *vaddr[UP3D_MAX_PLANES], *src_vaddr[UP3D_MAX_PLANES];
+	unsigned long size[UP3D_MAX_PLANES], src_size[UP3D_MAX_PLANES], payload[UP3D_MAX_PLANES] = { 0 };
+	const struct up3d_frame_layout *layout = &ctx->layout;
+	struct up3d_stream *stream;
+	struct up3d_meta_record meta;
+	bool latest = ctx->drop_policy == DROP_POLICY_LATEST;
+	bool shared = false;
+	bool replayed = false;
+	int active = 0;
+	int copies = 0;
+	int delivered = 0;
+	u64 dropped = 0;
+	u32 sequence;
+	u64 now, start, timestamp;
+	int i, p;
     
-	trace_in();
-    /* 1. 构造数据: 从队列头部取出第1个videobuf, 填充数据
-     */
-
-	// spin_lock_irqsave(&_g_ctx->vb_queue_lock, flags);
-	if(!list_empty(&_g_ctx->vb_queue_active)) 
-	{
-		up3d_vb = list_entry(_g_ctx->vb_queue_active.next, struct up3d_vb2_buf, list);
-
-		// 填充数据
-		// UP3D_DEBUG("vb2_plane_vaddr(&buf->vb.vb2_buf, 0):0x%x --- 0x%x", vb2_plane_vaddr(&up3d_vb->vb.vb2_buf, 0), up3d_vb->vb.vb2_buf.planes[0].mem_priv);
-		// memset(up3d_vb->vb.vb2_buf.planes[0].mem_priv, 0xff, _g_ctx->cur_v4l2_format.fmt.pix.sizeimage);
-		
-		p = (uint8_t *)vb2_plane_vaddr(&up3d_vb->vb.vb2_buf, 0);
-
-		for(x=0; x<_g_ctx->cur_v4l2_format.fmt.pix.width; x++)
-		{
-			for(y=0; y<_g_ctx->cur_v4l2_format.fmt.pix.height; y++)
-			{	
-				// RGB
-				*(p+0) = 0x00;
-				*(p+1) = (sequence*10) % 0xff;
-				*(p+2) = 0x00;
-				p += 3;
+	mutex_lock(&ctx->frame_lock);
+
+	// 回环：这一帧来自输出节点，没有待输出的帧时这个节拍空过
+	if (ctx->loop.streaming) {
+		loop = up3d_handoff_take(&ctx->loop);
+		if (!loop) {
+			ctx->stats.ticks += ticks;
+			ctx->stats.loop_underruns += ticks;
+			mutex_unlock(&ctx->frame_lock);
+			return;
+		}
+
+		// 输出缓冲区没有内核映射(例如导入的DMABUF不支持vmap)时无法读取，还给使用者，这个节拍改用测试图案
+		if (!up3d_buf_planes(&loop->vb.vb2_buf, src_vaddr, src_size)) {
+			dev_warn_ratelimited(ctx->dev, "output buffer %u has no kernel mapping\n", 
+				loop->vb.vb2_buf.index);
+			loop->vb.field = V4L2_FIELD_NONE;
+			loop->vb.sequence = ctx->sequence;
+			vb2_buffer_done(&loop->vb.vb2_buf, VB2_BUF_STATE_ERROR);
+			loop = NULL;
+		}
+	}
+
+	// 每个节拍都推进序号，丢掉的帧在v4l2_buffer.sequence上表现为间隔；
+	// 阻塞策略下等待缓冲区期间帧时钟相当于暂停，不算丢帧；回环时序号只随输出的帧增加
+	sequence = ctx->sequence;
+	if (ctx->drop_policy != DROP_POLICY_BLOCK && !loop)
+		sequence += ticks - 1;
+
+	trace_up3d_frame_start(ctx->inst, sequence, ticks);
+	start = ktime_get_ns();
+	ctx->stats.ticks += ticks;
+	ctx->stats.missed_ticks += ticks - 1;
+	if (start > ktime_to_ns(deadline))
+		up3d_hist_add(&ctx->stats.lateness, start - ktime_to_ns(deadline));
+
+	// 叠加到图案上的时间戳总是开始曝光的时刻，EOF时间戳要到填充完成才知道
+	timestamp = up3d_tstamp(ctx, deadline);
+
+	for (i = 0; i < ctx->stream_cnt; i++)
+		active += ctx->streams[i].streaming;
+
+	// 输出缓冲区就是这一帧的源，与它共享内存的采集缓冲区直接完成
+	if (loop) {
+		for (p = 0; p < layout->mem_planes; p++)
+			payload[p] = vb2_get_plane_payload(&loop->vb.vb2_buf, p);
+		src = loop;
+	}
+
+	/* 1. 构造数据: 每个节点从队列头部取出一个videobuf, 只有第一个需要填充 */
+	for (i = 0; i < ctx->stream_cnt; i++) {
+		stream = &ctx->streams[i];
+		if (!stream->streaming)
+			continue;
+
+		shared = false;
+		if (latest && stream->held) {
+			// 保留的缓冲区里还没交付的帧被新帧覆盖
+			if (stream->held_pending) {
+				trace_up3d_drop(ctx->inst, i, stream->held->vb.sequence);
+				stream->stats.dropped++;
+			}
+			bufs[i] = stream->held;
+			stream->held = NULL;
+			stream->held_pending = false;
+			// 回环时保留的缓冲区可能正是使用者刚入队的输出缓冲区，不是这一帧的源就不能写，换一个
+			if (loop && !up3d_buf_same_memory(&bufs[i]->vb.vb2_buf, &src->vb.vb2_buf) &&
+				up3d_buf_held_elsewhere(ctx, stream, &bufs[i]->vb.vb2_buf)) {
+				up3d_handoff_put(stream, bufs[i]);
+				bufs[i] = up3d_take_buf(ctx, stream, src, &shared);
+			} else {
+				shared = loop && up3d_buf_same_memory(&bufs[i]->vb.vb2_buf, &src->vb.vb2_buf);
 			}
+		} else if (active > 1 || loop) {
+			bufs[i] = up3d_take_buf(ctx, stream, src, &shared);
+		} else {
+			bufs[i] = up3d_handoff_take(stream);
+		}
+		if (!bufs[i]) {
+			trace_up3d_drop(ctx->inst, i, sequence);
+			stream->stats.dropped++;
+			continue;
+		}
+
+		states[i] = VB2_BUF_STATE_DONE;
+		if (shared)
+			continue;
+
+		if (!up3d_buf_planes(&bufs[i]->vb.vb2_buf, vaddr, size)) {
+			states[i] = VB2_BUF_STATE_ERROR;
+			continue;
 		}
 
-		// memset(, 0xff, _g_ctx->cur_v4l2_format.fmt.pix.sizeimage);
-		up3d_vb->vb.vb2_buf.timestamp = ktime_get_ns();
-		up3d_vb->vb.field = V4L2_FIELD_NONE;
-		up3d_vb->vb.sequence = sequence++;
-		vb2_set_plane_payload(&up3d_vb->vb.vb2_buf, 0, _g_ctx->cur_v4l2_format.fmt.pix.sizeimage);
-		vb2_buffer_done(&up3d_vb->vb.vb2_buf, VB2_BUF_STATE_DONE);
+		if (!src) {
+			// 填充数据：有回放数据时整块复制回放的一帧，否则由图案引擎按当前格式逐行复制预生成的扫描行
+			replayed = up3d_replay_fill(&ctx->replay, layout, vaddr, size, sequence, payload);
+			if (!replayed)
+				up3d_pattern_fill(&ctx->pattern, layout, vaddr, size, sequence, timestamp, payload);
+			src = bufs[i];
+			memcpy(src_vaddr, vaddr, sizeof(src_vaddr));
+		} else {
+			// 与已填充的缓冲区不共享内存，退回为一次整帧拷贝，压缩格式只拷贝有效数据
+			for (p = 0; p < layout->mem_planes; p++)
+				memcpy(vaddr[p], src_vaddr[p], payload[p]);
+			copies++;
+		}
 
-		list_del_init(&up3d_vb->list);
+		up3d_buf_sync_cpu_writes(ctx, &bufs[i]->vb.vb2_buf, vaddr);
 	}
-	// spin_unlock_irqrestore(&_g_ctx->vb_queue_lock, flags);
 
-    /* 3. 修改timer的超时时间 : 30fps, 1秒里有30帧数据
-     *    每1/30 秒产生一帧数据
-     */
-	if(0 == up3d_timer_stop)
-	{
-		mod_timer(timer, jiffies + HZ/30);
+	/* 2. 同一帧在所有节点上的序号和时间戳相同 */
+	now = ktime_get_ns();
+	if (src) {
+		trace_up3d_fill_done(ctx->inst, sequence, now - start, copies);
+		up3d_hist_add(&ctx->stats.fill_time, now - start);
+		ctx->stats.frames++;
 	}
-    	
-	trace_exit();
+	if (ctx->tstamp_src == TSTAMP_SRC_EOF)
+		timestamp = up3d_tstamp(ctx, ns_to_ktime(now));
+	for (i = 0; i < ctx->stream_cnt; i++) {
+		if (!bufs[i])
+			continue;
+
+		bufs[i]->vb.vb2_buf.timestamp = timestamp;
+		bufs[i]->vb.field = V4L2_FIELD_NONE;
+		bufs[i]->vb.sequence = sequence;
+		// 编码失败(缓冲区放不下)时没有有效数据
+		if (!payload[0])
+			states[i] = VB2_BUF_STATE_ERROR;
+		for (p = 0; p < layout->mem_planes; p++)
+			vb2_set_plane_payload(&bufs[i]->vb.vb2_buf, p, payload[p]);
+		delivered += states[i] == VB2_BUF_STATE_DONE;
+
+		/**
+		 * 交付最新帧：驱动始终保留一个缓冲区，有下一个空闲缓冲区时才交付这一帧，
+		 * 否则把它留着，使用者入队时立即交付，下一个节拍前没人要就被新帧覆盖。
+		 */
+		if (latest) {
+			stream = &ctx->streams[i];
+			next = active > 1 || loop ? up3d_take_buf(ctx, stream, NULL, &shared) : up3d_handoff_take(stream);
+			if (!next) {
+				stream->held = bufs[i];
+				stream->held_state = states[i];
+				stream->held_pending = true;
+				continue;
+			}
+			stream->held = next;
+		}
+
+		up3d_buf_complete(ctx, &ctx->streams[i], bufs[i], states[i]);
+	}
+
+	// 采集节点的缓冲区都已写好，输出缓冲区可以还给使用者
+	if (loop) {
+		loop->vb.field = V4L2_FIELD_NONE;
+		loop->vb.sequence = sequence;
+		vb2_buffer_done(&loop->vb.vb2_buf, VB2_BUF_STATE_DONE);
+	}
+
+	/* 3. 元数据节点：每次生产都输出一条记录，与帧使用相同的序号和时间戳 */
+	if (ctx->meta.streaming) {
+		for (i = 0; i < ctx->stream_cnt; i++)
+			dropped += ctx->streams[i].stats.dropped;
+
+		memset(&meta, 0, sizeof(meta));
+		meta.sequence = sequence;
+		meta.ticks = ticks;
+		meta.deadline_ns = ktime_to_ns(deadline);
+		meta.fill_start_ns = start;
+		meta.fill_end_ns = now;
+		meta.producer_cpu = raw_smp_processor_id();
+		meta.dropped = dropped - ctx->meta_dropped;
+		meta.delivered = delivered;
+		meta.pixelformat = layout->pixelformat;
+		meta.width = layout->width;
+		meta.height = layout->height;
+		meta.pattern = ctx->pattern.type;
+		if (loop)
+			meta.pattern_flags = UP3D_META_PATTERN_LOOPBACK;
+		else if (replayed)
+			meta.pattern_flags = UP3D_META_PATTERN_REPLAY;
+		else
+			meta.pattern_flags = ctx->pattern.overlay ? UP3D_META_PATTERN_OVERLAY : 0;
+		meta.pattern_color = ctx->pattern.color;
+		ctx->meta_dropped = dropped;
+		up3d_meta_emit(ctx, &meta, timestamp);
+	}
+
+	ctx->sequence = sequence + 1;
+
+	mutex_unlock(&ctx->frame_lock);
+}
+
+/* 交付最新帧策略：使用者入队了新的缓冲区，立即交付保留着的帧，新缓冲区成为下一帧的目标 */
+static void up3d_deliver_held(struct up3d_video_ctx *ctx)
+{
+	struct up3d_stream *stream;
+	struct up3d_vb2_buf *buf, *next;
+	bool shared;
+	int i;
+
+	mutex_lock(&ctx->frame_lock);
+	for (i = 0; i < ctx->stream_cnt; i++) {
+		stream = &ctx->streams[i];
+		if (!stream->streaming || !stream->held_pending)
+			continue;
+
+		next = up3d_take_buf(ctx, stream, NULL, &shared);
+		if (!next)
+			continue;
+
+		buf = stream->held;
+		stream->held = next;
+		stream->held_pending = false;
+		up3d_buf_complete(ctx, stream, buf, stream->held_state);
+	}
+	mutex_unlock(&ctx->frame_lock);
+}
+
+/* 阻塞策略：每个正在采集的节点都有空闲缓冲区时才生产 */
+static bool up3d_buffers_ready(struct up3d_video_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->stream_cnt; i++)
+		if (READ_ONCE(ctx->streams[i].streaming) && 
+			list_empty_careful(&ctx->streams[i].vb_queue_active))
+			return false;
+
+	return true;
+}
+
+/**
+ * 帧时钟回调：每个截止时间到达时唤醒生产线程，自身不做任何填充工作。
+ * 下一个截止时间在上一个截止时间的基础上累加周期(绝对时间)，不受回调延迟影响，
+ * 因此不会漂移；若回调迟到超过一个周期(中断负载、虚拟机被抢占、BOOTTIME下挂起)，
+ * hrtimer_forward_now跳过错过的截止时间并返回经过的周期数，这些节拍全部计入，
+ * 序号和missed_ticks仍然按实际经过的时间计数。
+ */
+static enum hrtimer_restart up3d_frame_timer_function(struct hrtimer *timer)
+{
+	struct up3d_video_ctx *ctx = container_of(timer, struct up3d_video_ctx, frame_timer);
+	ktime_t period = READ_ONCE(ctx->frame_period);
+	unsigned long flags;
+	u64 n;
+
+	n = hrtimer_forward_now(timer, period);
+
+	spin_lock_irqsave(&ctx->tick_lock, flags);
+	// 最近一个已经到达的截止时间，即新的到期时间之前一个周期
+	ctx->frame_deadline = ktime_sub(hrtimer_get_expires(timer), period);
+	atomic_add((int)n, &ctx->frame_ticks);
+	spin_unlock_irqrestore(&ctx->tick_lock, flags);
+	wake_up(&ctx->producer_wq);
+
+	return HRTIMER_RESTART;
+}
+
+/* 取走积压的节拍和最后一个节拍的截止时间，两者在同一把锁下读取，不会错开一个节拍 */
+static int up3d_take_ticks(struct up3d_video_ctx *ctx, ktime_t *deadline)
+{
+	unsigned long flags;
+	int ticks;
+
+	spin_lock_irqsave(&ctx->tick_lock, flags);
+	ticks = atomic_xchg(&ctx->frame_ticks, 0);
+	if (ticks)
+		*deadline = ctx->frame_deadline;
+	spin_unlock_irqrestore(&ctx->tick_lock, flags);
+
+	return ticks;
+}
+
+/**
+ * 帧生产线程：等待帧时钟节拍并填充一帧。
+ * 若线程被耽搁而积压了多个节拍，只产生一帧，错过的节拍不再补偿，序号跳过这些节拍。
+ * 阻塞策略下没有空闲缓冲区时一直等到使用者入队，期间的节拍作废。
+ */
+static int up3d_producer_thread(void *data)
+{
+	struct up3d_video_ctx *ctx = data;
+	ktime_t deadline = 0;
+	int ticks;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(ctx->producer_wq,
+			atomic_read(&ctx->frame_ticks) || atomic_read(&ctx->held_kick) || 
+			kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+
+		if (atomic_xchg(&ctx->held_kick, 0))
+			up3d_deliver_held(ctx);
+
+		ticks = up3d_take_ticks(ctx, &deadline);
+		if (!ticks)
+			continue;
+
+		if (ctx->drop_policy == DROP_POLICY_BLOCK && !up3d_buffers_ready(ctx)) {
+			wait_event_interruptible(ctx->producer_wq,
+				up3d_buffers_ready(ctx) || kthread_should_stop());
+			if (kthread_should_stop())
+				break;
+			ticks += up3d_take_ticks(ctx, &deadline);
+		}
+
+		up3d_produce_frame(ctx, ticks, deadline);
+	}
+
+	return 0;
+}
+
+static int up3d_producer_start(struct up3d_video_ctx *ctx)
+{
+	struct task_struct *task;
+
+	task = kthread_create(up3d_producer_thread, ctx, "%s-prod", ctx->v4l2_dev.name);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	// 线程还未运行，可以直接绑定CPU
+	if (ctx->producer_cpu >= 0 && cpu_online(ctx->producer_cpu))
+		kthread_bind(task, ctx->producer_cpu);
+
+	switch (ctx->producer_sched) {
+	case PRODUCER_SCHED_FIFO:
+		sched_set_fifo(task);
+		break;
+	case PRODUCER_SCHED_FIFO_LOW:
+		sched_set_fifo_low(task);
+		break;
+	default:
+		sched_set_normal(task, ctx->producer_nice);
+		break;
+	}
+
+	atomic_set(&ctx->frame_ticks, 0);
+	atomic_set(&ctx->held_kick, 0);
+	ctx->sequence = 0;
+	ctx->producer = task;
+	wake_up_process(task);
+
+	return 0;
+}
+
+static void up3d_producer_stop(struct up3d_video_ctx *ctx)
+{
+	if (!ctx->producer)
+		return;
+
+	kthread_stop(ctx->producer);
+	ctx->producer = NULL;
+}
+
+/* 把节点持有的所有缓冲区交还给videobuf2：先整体摘下链表，完成时不持有链表锁 */
+void up3d_return_all_buffers(struct up3d_stream *stream, enum vb2_buffer_state state)
+{
+	struct up3d_vb2_buf *buf, *tmp;
+	unsigned long flags;
+	LIST_HEAD(pending);
+
+	spin_lock_irqsave(&stream->vb_queue_lock, flags);
+	list_splice_init(&stream->vb_queue_active, &pending);
+	stream->stats.queue_depth = 0;
+	spin_unlock_irqrestore(&stream->vb_queue_lock, flags);
+
+	list_for_each_entry_safe(buf, tmp, &pending, list) {
+		list_del_init(&buf->list);
+		vb2_buffer_done(&buf->vb.vb2_buf, state);
+	}
+}
+
+void up3d_frame_clock_init(struct up3d_video_ctx *ctx)
+{
+	struct v4l2_fract tpf = {
+		.numerator = FRAME_INTERVAL_NUM_DEF,
+		.denominator = FRAME_INTERVAL_DEN_DEF,
+	};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&ctx->frame_timer, up3d_frame_timer_function, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&ctx->frame_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ctx->frame_timer.function = up3d_frame_timer_function;
+#endif
+	init_waitqueue_head(&ctx->producer_wq);
+	spin_lock_init(&ctx->tick_lock);
+	mutex_init(&ctx->frame_lock);
+	up3d_frame_clock_set_interval(ctx, &tpf);
+}
+
+/* 设置帧间隔，流运行中修改时从下一个截止时间开始生效 */
+void up3d_frame_clock_set_interval(struct up3d_video_ctx *ctx, const struct v4l2_fract *tpf)
+{
+	ctx->timeperframe = *tpf;
+	WRITE_ONCE(ctx->frame_period,
+		ns_to_ktime(div_u64((u64)tpf->numerator * NSEC_PER_SEC, tpf->denominator)));
+}
+
+/* 一个队列已经分配的缓冲区内存，从缓冲池取得的缓冲区按池中的实际大小计算 */
+static u64 up3d_queue_mem(struct up3d_video_ctx *ctx, struct vb2_queue *q)
+{
+	struct vb2_buffer *vb;
+	unsigned int i, p;
+	u64 used = 0;
+
+	for (i = 0; i < up3d_vb2_buf_slots(q); i++) {
+		vb = vb2_get_buffer(q, i);
+		if (!vb)
+			continue;
+		for (p = 0; p < vb->num_planes; p++)
+			used += max_t(u64, vb2_plane_size(vb, p), 
+						vb->memory == VB2_MEMORY_MMAP ? up3d_pool_buf_size(&ctx->pool, vb->planes[p].mem_priv) : 0);
+	}
+
+	return used;
+}
+
+/* 实例所有采集节点和回环输出节点已经分配的缓冲区内存，调用时持有ctx->mutex */
+static u64 up3d_mem_in_use(struct up3d_video_ctx *ctx)
+{
+	u64 used = up3d_queue_mem(ctx, &ctx->loop.vb_queue);
+	int s;
+
+	for (s = 0; s < ctx->stream_cnt; s++)
+		used += up3d_queue_mem(ctx, &ctx->streams[s].vb_queue);
+
+	return used;
 }
 
 /** 
  * 调用时机：由ioctl命令VIDIOC_REQBUFS和VIDIOC_CREATE_BUFS调用时被调用
- * 作用：设置参数
+ * 作用：检查/设置平面大小，按max_buffers和内存预算调整缓冲区个数。
+ * VIDIOC_CREATE_BUFS时*num_planes不为0，sizes[]是使用者要求的大小，不能小于当前格式；
+ * 个数超出上限或预算时减少个数而不是失败，videobuf2把实际个数返回给使用者。
  */
-static int up3d_queue_setup(struct vb2_queue *q,
+int up3d_queue_setup(struct vb2_queue *q,
 			   unsigned int *num_buffers, unsigned int *num_planes,
 			   unsigned int sizes[], struct device *alloc_devs[])
 {
-	struct up3d_video_ctx *ctx = vb2_get_drv_priv(q);
+	struct up3d_stream *stream = vb2_get_drv_priv(q);
+	struct up3d_video_ctx *ctx = stream->ctx;
+	unsigned int p, room, fit;
+	bool create = *num_planes != 0;
+	u64 frame = 0, used;
 
 	trace_in();
 
-	*num_planes = 1;	// 目前只支持单层，设为1
-	sizes[0] = ctx->cur_v4l2_format.fmt.pix.sizeimage;
-	// TODO:num_buffers\alloc_devs待研究
+	if (create) {
+		if (*num_planes != ctx->layout.mem_planes) {
+			trace_exit();
+			return -EINVAL;
+		}
+		for (p = 0; p < *num_planes; p++) {
+			if (sizes[p] < ctx->layout.sizeimage[p]) {
+				trace_exit();
+				return -EINVAL;
+			}
+		}
+	} else {
+		// 连续格式只有一个平面，NV12M等每个分量平面单独分配
+		*num_planes = ctx->layout.mem_planes;
+		for (p = 0; p < *num_planes; p++)
+			sizes[p] = ctx->layout.sizeimage[p];
+	}
+
+	for (p = 0; p < *num_planes; p++) {
+		// dma-contig/dma-sg从这个设备分配并映射；缓冲池由节点自己的设备找到所属的实例
+		alloc_devs[p] = up3d_pool_enabled(&ctx->pool) ? &stream->vid_cap_dev.dev : ctx->dev;
+		frame += sizes[p];
+	}
+
+	// read()方式：videobuf2只申请最少数量的缓冲区，这里扩大为一个环，读的同时生产线程可以继续填充
+	if (vb2_fileio_is_active(q) && *num_buffers < ctx->read_buffers)
+		*num_buffers = ctx->read_buffers;
+
+	// CREATE_BUFS追加时已有的缓冲区也计入上限
+	room = ctx->max_buffers > up3d_vb2_num_buffers(q) ? ctx->max_buffers - up3d_vb2_num_buffers(q) : 0;
+	if (*num_buffers > room)
+		*num_buffers = room;
+
+	// 4K下每帧几十MB，多个节点、多个实例同时申请很容易耗尽内存，预算内放不下时减少个数
+	used = up3d_mem_in_use(ctx);
+	if (ctx->mem_budget) {
+		fit = used < ctx->mem_budget ? min_t(u64, div64_u64(ctx->mem_budget - used, frame), VB2_MAX_FRAME) : 0;
+		if (*num_buffers > fit) {
+			dev_dbg(ctx->dev, "%u buffers of %llu bytes exceed the memory budget (%llu of %llu bytes in use), using %u\n",
+				*num_buffers, frame, used, ctx->mem_budget, fit);
+			*num_buffers = fit;
+		}
+	}
+
+	// REQBUFS少于开始采集需要的个数时videobuf2分配后也会失败，这里提前返回；CREATE_BUFS可以逐个追加
+	if (!*num_buffers || (!create && *num_buffers < up3d_vb2_min_queued(q))) {
+		dev_warn(ctx->dev, "no room for %u buffers of %llu bytes (%llu of %llu bytes in use, %u of %u buffers)\n",
+			max(*num_buffers, up3d_vb2_min_queued(q)), frame, used, ctx->mem_budget, up3d_vb2_num_buffers(q), ctx->max_buffers);
+		trace_exit();
+		return -ENOMEM;
+	}
 
 	trace_exit();
 
@@ -93,46 +805,64 @@ static int up3d_queue_setup(struct vb2_queue *q,
  */
 static int up3d_buf_prepare(struct vb2_buffer *vb)
 {
-	struct up3d_video_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+	struct up3d_stream *stream = vb2_get_drv_priv(vb->vb2_queue);
+	struct up3d_video_ctx *ctx = stream->ctx;
 	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
 	struct up3d_vb2_buf *buf = container_of(vbuf, struct up3d_vb2_buf, vb);
 	unsigned long size;
+	unsigned int p;
 
 	int ret = 0;
 
-	trace_in();
+	if (vb->num_planes != ctx->layout.mem_planes) {
+		dev_err(ctx->dev, "%s buffer has %u planes, format needs %u\n",
+			__func__, vb->num_planes, ctx->layout.mem_planes);
+		return -EINVAL;
+	}
 
-	size = ctx->cur_v4l2_format.fmt.pix.sizeimage;
+	for (p = 0; p < vb->num_planes; p++) {
+		size = ctx->layout.sizeimage[p];
 
-	if (vb2_plane_size(vb, 0) < size) {
-		dev_err(ctx->dev, "%s data will not fit into plane (%lu < %lu)\n",
-			__func__, vb2_plane_size(vb, 0), size);
-		return -EINVAL;
+		if (vb2_plane_size(vb, p) < size) {
+			dev_err(ctx->dev, "%s data will not fit into plane %u (%lu < %lu)\n",
+				__func__, p, vb2_plane_size(vb, p), size);
+			return -EINVAL;
+		}
+
+		// USERPTR/DMABUF导入的缓冲区：生产线程通过内核虚拟地址直接写入，没有映射就无法使用
+		if (vb->memory != VB2_MEMORY_MMAP && !vb2_plane_vaddr(vb, p)) {
+			dev_err(ctx->dev, "%s imported buffer %u plane %u has no kernel mapping\n",
+				__func__, vb->index, p);
+			return -EINVAL;
+		}
 	}
 
 	if (!buf->prepared) {
 		/* Get memory addresses */
 		buf->prepared = true;
-		vb2_set_plane_payload(&buf->vb.vb2_buf, 0, vb2_plane_size(&buf->vb.vb2_buf, 0));
+		for (p = 0; p < vb->num_planes; p++)
+			vb2_set_plane_payload(&buf->vb.vb2_buf, p, vb2_plane_size(&buf->vb.vb2_buf, p));
 	}
 
 	// 检查缓冲区虚拟地址是否存在和payload是否正确设置
-	if (vb2_plane_vaddr(vb, 0) &&
-		vb2_get_plane_payload(vb, 0) > vb2_plane_size(vb, 0)) {
-		ret = -EINVAL;
-		goto out;
+	for (p = 0; p < vb->num_planes; p++) {
+		if (vb2_plane_vaddr(vb, p) &&
+			vb2_get_plane_payload(vb, p) > vb2_plane_size(vb, p)) {
+			ret = -EINVAL;
+			goto out;
+		}
 	}
-	trace_exit();
 	return 0;
 out:
-	trace_exit();
 	return ret;
 }
 
 static void up3d_buf_finish(struct vb2_buffer *vb)
 {
-	trace_in();
-	trace_exit();
+	struct up3d_stream *stream = vb2_get_drv_priv(vb->vb2_queue);
+
+	trace_up3d_buf_dequeue(stream->ctx->inst, stream->index, vb->index, 
+				to_vb2_v4l2_buffer(vb)->sequence);
 }
 
 /**  必要
@@ -143,91 +873,143 @@ static void up3d_buf_queue(struct vb2_buffer *vb)
 {
 	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
 	struct up3d_vb2_buf *buf = container_of(vbuf, struct up3d_vb2_buf, vb);
-	struct up3d_video_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+	struct up3d_stream *stream = vb2_get_drv_priv(vb->vb2_queue);
+	struct up3d_video_ctx *ctx = stream->ctx;
 
-	trace_in();
+	trace_up3d_buf_queue(ctx->inst, stream->index, vb->index, vbuf->sequence);
+	buf->qbuf_ns = ktime_get_ns();
+	up3d_handoff_put(stream, buf);
 
-	spin_lock(&ctx->vb_queue_lock);
-	list_add_tail(&buf->list, &ctx->vb_queue_active);
-	spin_unlock(&ctx->vb_queue_lock);
-
-	trace_exit();
+	// 交付最新帧：通知生产线程交付保留着的帧；阻塞策略：唤醒等待缓冲区的生产线程
+	if (ctx->drop_policy == DROP_POLICY_LATEST) {
+		atomic_set(&ctx->held_kick, 1);
+		wake_up(&ctx->producer_wq);
+	} else if (ctx->drop_policy == DROP_POLICY_BLOCK) {
+		wake_up(&ctx->producer_wq);
+	}
 }
 
-static int up3d_start_streaming(struct vb2_queue *q, unsigned int count)
+/* 第一个节点开始采集时启动帧时钟和生产线程 */
+static int up3d_clock_start(struct up3d_video_ctx *ctx)
 {
-	trace_in();
-	
-	// TODO:控制硬件开始采集 这里用定时器模拟数据产生
+	int ret;
 
-	// 测试定时器
-	up3d_timer.expires = jiffies + 5;
-	up3d_timer.function = up3d_timer_function;
-	
-	_g_ctx = vb2_get_drv_priv(q);
-	UP3D_DEBUG("_g_ctx:%p", _g_ctx);
+	// TODO:控制硬件开始采集 这里用帧时钟+生产线程模拟数据产生
+	ret = up3d_pattern_prepare(&ctx->pattern, &ctx->layout);
+	if (ret < 0) {
+		UP3D_DEBUG("up3d_pattern_prepare failed ret:%d", ret);
+		return ret;
+	}
 
-	up3d_timer_stop = 0;
-	add_timer(&up3d_timer);
+	ret = up3d_producer_start(ctx);
+	if (ret < 0) {
+		UP3D_DEBUG("up3d_producer_start failed ret:%d", ret);
+		up3d_pattern_release(&ctx->pattern);
+		return ret;
+	}
 
-	trace_exit();
+	// 第一帧在一个帧周期之后产生，之后按绝对截止时间推进
+	hrtimer_start(&ctx->frame_timer, ktime_add(ktime_get(), ctx->frame_period), 
+				HRTIMER_MODE_ABS);
 	return 0;
 }
 
-/**  必要
- * 调用时机：
- * 作用：停止请求
- */
-static void up3d_stop_streaming(struct vb2_queue *q)
+/* 最后一个节点停止采集时停止帧时钟和生产线程 */
+static void up3d_clock_stop(struct up3d_video_ctx *ctx)
 {
-	trace_in();
 	// TODO:控制硬件停止采集
-	// del_timer(&up3d_timer);
-	up3d_timer_stop = 1;
-	trace_exit();
+	// hrtimer_cancel会等待正在执行的回调结束，之后不会再有新的唤醒
+	hrtimer_cancel(&ctx->frame_timer);
+	up3d_producer_stop(ctx);
+	up3d_pattern_release(&ctx->pattern);
 }
 
-static void up3d_wait_prepare(struct vb2_queue *q)
+/**
+ * 节点开始/停止采集时的引用计数(包括元数据节点)：第一个节点开始时启动帧时钟，
+ * 最后一个停止时停止。所有节点的vb2回调都在ctx->mutex下调用，streaming_cnt不需要另外加锁
+ */
+int up3d_streaming_get(struct up3d_video_ctx *ctx)
 {
-	trace_in();
-	trace_exit();
+	int ret;
+
+	if (ctx->streaming_cnt == 0) {
+		ret = up3d_clock_start(ctx);
+		if (ret < 0)
+			return ret;
+	}
+	ctx->streaming_cnt++;
+	return 0;
 }
 
-static void up3d_wait_finish(struct vb2_queue *q)
+void up3d_streaming_put(struct up3d_video_ctx *ctx)
 {
-	trace_in();
-	trace_exit();
+	if (--ctx->streaming_cnt == 0)
+		up3d_clock_stop(ctx);
 }
 
-static int up3d_buf_init(struct vb2_buffer *vb)
+static int up3d_start_streaming(struct vb2_queue *q, unsigned int count)
 {
-	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
-	struct up3d_vb2_buf *buf = container_of(vbuf, struct up3d_vb2_buf, vb);
+	int ret;
+	struct up3d_stream *stream = vb2_get_drv_priv(q);
+	struct up3d_video_ctx *ctx = stream->ctx;
 
 	trace_in();
 
-	INIT_LIST_HEAD(&buf->list);
-	UP3D_DEBUG("vb->vb2_queue:%p", vb->vb2_queue);
-	UP3D_DEBUG("vb->index:%d type:0x%x memory:0x%x num_planes:%d timestamp:%lld state:%d", 
-		vb->index, vb->type, vb->memory, vb->num_planes, vb->timestamp, vb->state);
-
-	UP3D_DEBUG(" vb->planes ###################### ");
-	UP3D_DEBUG("mem_priv:%p dbuf_mapped:%d bytesused:%d length:%d min_length:%d offset:0x%x data_offset:0x%x", 
-		vb->planes[0].mem_priv, vb->planes[0].dbuf_mapped, vb->planes[0].bytesused, vb->planes[0].length, 
-		vb->planes[0].min_length, vb->planes[0].m.offset, vb->planes[0].data_offset);
-
+	ret = up3d_streaming_get(ctx);
+	if (ret < 0) {
+		up3d_return_all_buffers(stream, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
 
+	mutex_lock(&ctx->frame_lock);
+	// 序号在帧时钟启动时清零，之前的序号不能用来计算间隔
+	stream->stats.seq_valid = false;
+	stream->streaming = true;
+	mutex_unlock(&ctx->frame_lock);
 
 	trace_exit();
 	return 0;
 }
 
-static void up3d_buf_cleanup(struct vb2_buffer *vb)
+/**  必要
+ * 调用时机：
+ * 作用：停止请求
+ */
+static void up3d_stop_streaming(struct vb2_queue *q)
 {
+	struct up3d_stream *stream = vb2_get_drv_priv(q);
+	struct up3d_video_ctx *ctx = stream->ctx;
+
 	trace_in();
+
+	// 等待正在生产的帧完成，之后生产线程不会再访问这个节点的缓冲区
+	mutex_lock(&ctx->frame_lock);
+	stream->streaming = false;
+	if (stream->held) {
+		vb2_buffer_done(&stream->held->vb.vb2_buf, VB2_BUF_STATE_ERROR);
+		stream->held = NULL;
+		stream->held_pending = false;
+	}
+	mutex_unlock(&ctx->frame_lock);
+
+	// 阻塞策略下生产线程可能在等这个节点的缓冲区
+	wake_up(&ctx->producer_wq);
+
+	up3d_return_all_buffers(stream, VB2_BUF_STATE_ERROR);
+
+	up3d_streaming_put(ctx);
 	trace_exit();
 }
 
+static int up3d_buf_init(struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct up3d_vb2_buf *buf = container_of(vbuf, struct up3d_vb2_buf, vb);
+
+	INIT_LIST_HEAD(&buf->list);
+	return 0;
+}
+
 
 const struct vb2_ops up3d_vb2_ops = {
 	.queue_setup		= up3d_queue_setup,			// 当用户空间调用VIDIOC_REQBUFS时，此回调用于初始化队列，分配缓冲区。
@@ -237,7 +1019,182 @@ const struct vb2_ops up3d_vb2_ops = {
 	.start_streaming	= up3d_start_streaming,		// 开始缓冲区的数据采集流程。
 	.buf_finish			= up3d_buf_finish,			// 在缓冲区完成数据采集后，进行必要的后处理。
 	.stop_streaming		= up3d_stop_streaming,		// 停止数据采集，并进行清理。
-	.wait_prepare		= up3d_wait_prepare,
-	.wait_finish		= up3d_wait_finish,
-	.buf_cleanup		= up3d_buf_cleanup,
+	UP3D_VB2_WAIT_OPS								// 阻塞DQBUF/read()等待帧时释放ctx->mutex，不挡住其他节点
 };
+
+/* 缓冲区交接的压力测试：多个线程同时入队，一个线程取走，检查有没有丢失或重复 */
+#define HANDOFF_BENCH_QUEUERS	4
+#define HANDOFF_BENCH_BUFS		8		// 每个入队线程轮流使用的缓冲区个数
+
+struct up3d_handoff_bench {
+	struct up3d_stream		stream;
+	struct up3d_vb2_buf		*bufs;
+	atomic_t				*queued;	// 每个缓冲区：0空闲，1在链表中
+	atomic_t				queuers;	// 还在运行的入队线程数
+	atomic_t				running;	// 还在运行的线程数
+	atomic64_t				puts;
+	atomic64_t				takes;
+	atomic_t				errors;
+	wait_queue_head_t		wq;
+};
+
+struct up3d_handoff_queuer {
+	struct up3d_handoff_bench	*b;
+	int							id;
+};
+
+static int up3d_handoff_queuer_thread(void *data)
+{
+	struct up3d_handoff_queuer *q = data;
+	struct up3d_handoff_bench *b = q->b;
+	int base = q->id * HANDOFF_BENCH_BUFS;
+	unsigned long spins = 0;
+	int n = 0, j = 0;
+
+	while (n < HANDOFF_BENCH_OPS) {
+		// 只有被取走(空闲)的缓冲区才能再次入队，同一个缓冲区不会同时在链表中出现两次
+		if (atomic_cmpxchg(&b->queued[base + j], 0, 1) == 0) {
+			up3d_handoff_put(&b->stream, &b->bufs[base + j]);
+			atomic64_inc(&b->puts);
+			n++;
+		} else {
+			cpu_relax();
+		}
+		j = (j + 1) % HANDOFF_BENCH_BUFS;
+		if (!(++spins & 1023))
+			cond_resched();
+	}
+
+	atomic_dec(&b->queuers);
+	if (atomic_dec_and_test(&b->running))
+		wake_up(&b->wq);
+	return 0;
+}
+
+static int up3d_handoff_taker_thread(void *data)
+{
+	struct up3d_handoff_bench *b = data;
+	struct up3d_vb2_buf *buf;
+	unsigned long spins = 0;
+	bool last = false;
+
+	for (;;) {
+		buf = up3d_handoff_take(&b->stream);
+		if (!buf) {
+			// 入队线程全部结束后再取一遍，保证链表已经清空
+			if (last)
+				break;
+			last = !atomic_read(&b->queuers);
+			if (!(++spins & 1023))
+				cond_resched();
+			continue;
+		}
+
+		if (!list_empty(&buf->list) || atomic_xchg(&b->queued[buf - b->bufs], 0) != 1)
+			atomic_inc(&b->errors);
+		atomic64_inc(&b->takes);
+	}
+
+	if (atomic_dec_and_test(&b->running))
+		wake_up(&b->wq);
+	return 0;
+}
+
+/**
+ * 压力测试：HANDOFF_BENCH_QUEUERS个线程以最快速度入队，一个线程模拟生产线程取走，
+ * 结果(入队/取走次数、错误次数、耗时)填到res里，handoff_bench参数和KUnit测试共用。
+ * running归零时最后一个线程可能还在wake_up里访问b，先持有每个线程的task_struct引用，
+ * 用kthread_stop等它们真正退出后才释放b。
+ */
+int up3d_handoff_stress(struct up3d_handoff_result *res)
+{
+	struct up3d_handoff_queuer queuers[HANDOFF_BENCH_QUEUERS];
+	struct task_struct *tasks[HANDOFF_BENCH_QUEUERS + 1] = { NULL };
+	struct up3d_handoff_bench *b;
+	struct task_struct *task;
+	int nbufs = HANDOFF_BENCH_QUEUERS * HANDOFF_BENCH_BUFS;
+	u64 start;
+	int i;
+
+	memset(res, 0, sizeof(*res));
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	b->bufs = kcalloc(nbufs, sizeof(*b->bufs), GFP_KERNEL);
+	b->queued = kcalloc(nbufs, sizeof(*b->queued), GFP_KERNEL);
+	if (!b->bufs || !b->queued) {
+		kfree(b->queued);
+		kfree(b->bufs);
+		kfree(b);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nbufs; i++)
+		INIT_LIST_HEAD(&b->bufs[i].list);
+	spin_lock_init(&b->stream.vb_queue_lock);
+	INIT_LIST_HEAD(&b->stream.vb_queue_active);
+	init_waitqueue_head(&b->wq);
+	atomic_set(&b->queuers, HANDOFF_BENCH_QUEUERS);
+	atomic_set(&b->running, HANDOFF_BENCH_QUEUERS + 1);
+
+	start = ktime_get_ns();
+
+	task = kthread_run(up3d_handoff_taker_thread, b, "up3d-bench-take");
+	if (IS_ERR(task)) {
+		atomic_set(&b->queuers, 0);
+		atomic_set(&b->running, 0);
+	} else {
+		tasks[HANDOFF_BENCH_QUEUERS] = get_task_struct(task);
+		for (i = 0; i < HANDOFF_BENCH_QUEUERS; i++) {
+			queuers[i].b = b;
+			queuers[i].id = i;
+			task = kthread_run(up3d_handoff_queuer_thread, &queuers[i], "up3d-bench-q%d", i);
+			if (IS_ERR(task)) {
+				// 没有启动的线程直接记为结束
+				atomic_dec(&b->queuers);
+				atomic_dec(&b->running);
+				continue;
+			}
+			tasks[i] = get_task_struct(task);
+			res->queuers++;
+		}
+	}
+
+	wait_event(b->wq, !atomic_read(&b->running));
+	res->ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	// 线程都已经过了running的递减，kthread_stop只是等它们退出，不会打断工作
+	for (i = 0; i <= HANDOFF_BENCH_QUEUERS; i++) {
+		if (!tasks[i])
+			continue;
+		kthread_stop(tasks[i]);
+		put_task_struct(tasks[i]);
+	}
+
+	res->puts = atomic64_read(&b->puts);
+	res->takes = atomic64_read(&b->takes);
+	res->errors = atomic_read(&b->errors);
+	res->depth = b->stream.stats.queue_depth;
+
+	kfree(b->queued);
+	kfree(b->bufs);
+	kfree(b);
+	return 0;
+}
+UP3D_EXPORT_FOR_TESTS(up3d_handoff_stress);
+
+/* handoff_bench参数：压力测试的结果(交接速率、丢失/重复次数)输出到内核日志 */
+void up3d_handoff_bench(void)
+{
+	struct up3d_handoff_result res;
+
+	if (up3d_handoff_stress(&res) < 0) {
+		pr_err("up3d: handoff bench: out of memory\n");
+		return;
+	}
+
+	pr_info("up3d: handoff bench %d queuers: %llu buffers in %llu us, %llu k/s, lost %lld, errors %d\n",
+		res.queuers, res.takes, div_u64(res.ns, NSEC_PER_USEC),
+		div64_u64(res.takes * NSEC_PER_MSEC, res.ns), (s64)(res.puts - res.takes), res.errors);
+}
@@ -1,8 +1,38 @@
 #ifndef __UP3D_VB2OPS_H__
 #define __UP3D_VB2OPS_H__
 
+#include <linux/videodev2.h>
 #include <media/videobuf2-core.h>
 
 extern const struct vb2_ops up3d_vb2_ops;
 
+struct up3d_video_ctx;
+extern void up3d_frame_clock_init(struct up3d_video_ctx *ctx);
+extern void up3d_frame_clock_set_interval(struct up3d_video_ctx *ctx, const struct v4l2_fract *tpf);
+extern void up3d_handoff_bench(void);
+
+/* 缓冲区交接压力测试的结果 */
+#define HANDOFF_BENCH_OPS		200000	// 每个入队线程的入队次数
+
+struct up3d_handoff_result {
+	int		queuers;		// 成功启动的入队线程数
+	u64		puts;
+	u64		takes;
+	int		errors;			// 取到不在链表中的缓冲区或同一个缓冲区被取走两次
+	u32		depth;			// 结束时的队列深度，应为0
+	u64		ns;
+};
+
+extern int up3d_handoff_stress(struct up3d_handoff_result *res);
+
+struct up3d_stream;
+struct up3d_vb2_buf;
+extern void up3d_handoff_put(struct up3d_stream *stream, struct up3d_vb2_buf *buf);
+extern struct up3d_vb2_buf *up3d_handoff_take(struct up3d_stream *stream);
+extern void up3d_return_all_buffers(struct up3d_stream *stream, enum vb2_buffer_state state);
+extern int up3d_queue_setup(struct vb2_queue *q, unsigned int *num_buffers, unsigned int *num_planes,
+						unsigned int sizes[], struct device *alloc_devs[]);
+extern int up3d_streaming_get(struct up3d_video_ctx *ctx);
+extern void up3d_streaming_put(struct up3d_video_ctx *ctx);
+
 #endif /*__UP3D_VB2OPS_H__*/
\ No newline at end of file